@@ -21,9 +21,9 @@ struct state_vect
 	int rpm;                   // rpm of engine
 	unsigned char fuel;                 // gallons of fuel
 	unsigned char fuelConsump;          // fuel consumption in gallons/hr.
-	int x_pos;                 // current location on world-x
-	int y_pos;                 // current location on world-y
-	int z_pos;                 // current location on world-z
+	long long x_pos;           // current location on world-x
+	long long y_pos;           // current location on world-y
+	long long z_pos;           // current location on world-z
 	double pitch;              // rotation about x 0 to 255
 	double yaw;                // rotation about y 0 to 255
 	double roll;               // rotation about z 0 to 255
@@ -52,12 +52,18 @@ struct delta_vect
 
 static const int LOOP = 40;        // if the timer is off this value will be used for the loop timing
 
-// this block declares various data used internally in this module
+// this block declares various data used internally in this module. It is
+// thread local so that several flight models can run side by side in the
+// headless tools; the game itself only ever runs one.
 
-static unsigned long loopTime;               // elapsed time since last pass
-static int frmIndex;                 // index into frame rate save buffer
-static bool frmWrap;              // true when NUM_FRMS frame times saved
-static delta_vect deltaVect;         // copy of rotational deltas
+static thread_local unsigned long loopTime;  // elapsed time since last pass
+static thread_local int frmIndex;            // index into frame rate save buffer
+static thread_local bool frmWrap;            // true when NUM_FRMS frame times saved
+static thread_local delta_vect deltaVect;    // copy of rotational deltas
+static thread_local float collectX;          // accumulators for delta changes in
+static thread_local float collectY;          // x, y, and z world coords; adjusts
+static thread_local float collectZ;          // for rounding errors
+static unsigned long fixedLoopTime;          // if non-zero, used instead of the timer
 
 // miscellaneous constants
 
@@ -78,7 +84,7 @@ static const int START_PIT = 0;
 
 static const long WALK_RATE = 100000; // world walk speed in feet/min
 
-static unsigned int frameTimes[NUM_FRMS];     // buffer for 500 elapsed frame times
+static thread_local unsigned int frameTimes[NUM_FRMS]; // buffer for 500 elapsed frame times
 
 // this function is called from main() (FSMAIN.CPP) when running in debugging dump mode.
 void ACDump()
@@ -161,6 +167,9 @@ void ResetACState(state_vect *tSV)
 	deltaVect.dPitch = 0;
 	deltaVect.dRoll = 0;
 	deltaVect.dYaw = 0;
+	collectX = 0;
+	collectY = 0;
+	collectZ = 0;
 }
 
 // set aircraft conditions after landing
@@ -175,6 +184,20 @@ void LandAC(state_vect *tSV)
 	deltaVect.dYaw = 0;
 }
 
+// returns true if the aircraft touched down with too much pitch or roll,
+// meaning it crashed rather than landed
+bool CrashAttitude(state_vect *tSV)
+{
+	return ((tSV->pitch > 10) || (tSV->pitch < -10)) || ((tSV->roll > 10) || (tSV->roll < -10));
+}
+
+// fixes the length of every flight model pass at ms milliseconds, the same
+// way LOOP was used when the timer was off. Passing 0 restores the timer.
+void SetLoopTime(unsigned long ms)
+{
+	fixedLoopTime = ms;
+}
+
 // initializes aircraft statevector and flight model, starts internal timer
 void InitAircraft(state_vect *tSV)
 {
@@ -183,6 +206,19 @@ void InitAircraft(state_vect *tSV)
 	frmWrap = false;            // flag used by frame rate accumulator
 }
 
+// moves a world coordinate by a fractional distance, rounding the way the
+// 32 bit coordinates always did. The float sum is taken relative to a
+// nearby multiple of 65536, so it is as precise far from the world origin
+// as it is near it.
+long long MoveCoord(long long pos, float delta)
+{
+	long long base = pos / 65536 * 65536;
+	int rel = pos - base;
+
+	rel += delta;
+	return base + rel;
+}
+
 // converts degrees to radians - expects degrees in -179 to +180 format
 double Rads(double degrees)
 {
@@ -475,12 +511,12 @@ void DoWalk(state_vect *tSV)
 // *in the morning (his time) to help me work on the pitch and roll component
 // *calculations.
 //
-// DEBUGGING NOTE: If __TIMEROFF__ is defined (see top of this module) then
-// this function sets the loopTime variable to LOOP ms, else it uses the timer1
+// DEBUGGING NOTE: If SetLoopTime() has been called with a non-zero value then
+// this function uses that many ms for loopTime, else it uses the timer1
 // object to time the running of the flight model. The loopTime variable
 // is set on entry to this module with the number of elapsed ms since the
 // last call, and then used throughout the module for calculations of rate
-// of change parameters. Defining __TIMEROFF__ effectively sets the
+// of change parameters. Calling SetLoopTime(LOOP) effectively sets the
 // performance of the system to match my 486. This lets you step through the
 // flight model and get a nice, smooth change in the variables you're
 // watching. Otherwise the timer continues to run while you're staring at the
@@ -489,13 +525,14 @@ void RunFModel(state_vect *tSV)
 {
 	float tmpX, tmpY, tmpZ;         // these are used later to preserve
 	float newX, newY, newZ;         // position values during conversion
-	static float collectX;          // accumulators for delta changes in
-	static float collectY;          // x, y, and z world coords; adjusts
-	static float collectZ;          // for rounding errors
 
-	loopTime = SDL_GetTicks64();
-	if (!(loopTime /= 1000)) {
-		loopTime = 1;
+	if (fixedLoopTime) {
+		loopTime = fixedLoopTime;
+	} else {
+		loopTime = SDL_GetTicks64();
+		if (!(loopTime /= 1000)) {
+			loopTime = 1;
+		}
 	}
 	AddFrameTime();
 
@@ -550,19 +587,19 @@ void RunFModel(state_vect *tSV)
 
 	collectX += newX;
 	if ((collectX > 1) || (collectX < -1)) {
-		tSV->x_pos -= collectX;
+		tSV->x_pos = MoveCoord(tSV->x_pos, -collectX);
 		collectX = 0;
 	}
 
 	collectY += newY;
 	if ((collectY > 1) || (collectY < -1)) {
-		tSV->y_pos -= collectY;
+		tSV->y_pos = MoveCoord(tSV->y_pos, -collectY);
 		collectY = 0;
 	}
 
 	collectZ += newZ;
 	if ((collectZ > 1) || (collectZ < -1)) {
-		tSV->z_pos += collectZ;
+		tSV->z_pos = MoveCoord(tSV->z_pos, collectZ);
 		collectZ = 0;
 	}
 
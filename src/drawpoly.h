@@ -2,9 +2,46 @@
 #ifndef _DRAWPOLY_H_
 #define _DRAWPOLY_H_
 
-void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
+inline void drawspan(unsigned char *screen_buffer, int start, int length, int y, int color, mask_type *mask)
 {
-	// Draw polygon in structure POLYGON in SCREEN_BUFFER
+	// Draw LENGTH+1 pixels from offset START on line Y, leaving out the
+	// pixels that MASK says will be covered by an overlay
+
+	if (mask) {
+		int x1 = start - 320 * y;
+		int x2 = x1 + length;
+		if (x1 < mask->xstart[y]) {
+			x1 = mask->xstart[y];
+		}
+		if (x2 > mask->xend[y]) {
+			x2 = mask->xend[y];
+		}
+		if (x1 > x2) {
+			return;
+		}
+		start = 320 * y + x1;
+		length = x2 - x1;
+	}
+	memset(&screen_buffer[start], color, length + 1);
+}
+
+inline void drawpixel(unsigned char *screen_buffer, int offset, int y, int color, mask_type *mask)
+{
+	// Plot the pixel at OFFSET on line Y, unless MASK says it will be covered
+
+	if (mask) {
+		int x = offset - 320 * y;
+		if ((x < mask->xstart[y]) || (x > mask->xend[y])) {
+			return;
+		}
+	}
+	screen_buffer[offset] = color;
+}
+
+void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer, mask_type *mask = NULL)
+{
+	// Draw polygon in structure POLYGON in SCREEN_BUFFER, skipping the
+	// pixels hidden by the overlay described in MASK, if any
 
 	// Uninitialized variables:
 	int ydiff1, ydiff2,         // Difference between starting x and ending x
@@ -19,6 +56,9 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 	// Initialize count of number of edges drawn:
 	int edgecount = clip->number_of_vertices - 1;
 
+	// Last line that isn't completely covered:
+	int ylast = mask ? mask->ylast : 199;
+
 	// Determine which vertex is at top of polygon:
 	int firstvert = 0;           // Start by assuming vertex 0 is at top
 	int min_amt = clip->vertex[0].y; // Find y coordinate of vertex 0
@@ -82,7 +122,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 
 				count1 = xdiff1;    // Count for x increment on edge 1
 				count2 = xdiff2;    // Count for x increment on edge 2
-				while (count1 && count2) {  // Continue drawing until one edge is done
+				while (count1 && count2 && (ystart1 <= ylast)) {  // Continue drawing until one edge is done
 
 					// Calculate edge 1:
 
@@ -93,7 +133,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 						}
 						errorterm1 += ydiff1; // Increment error term
 						if (errorterm1 < xdiff1) {  // If not more than XDIFF
-							screen_buffer[offset1] = clip->color; // ...plot a pixel
+							drawpixel(screen_buffer, offset1, ystart1, clip->color, mask); // ...plot a pixel
 						}
 					}
 					errorterm1 -= xdiff1; // If time to increment X, restore error term
@@ -107,7 +147,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 						}
 						errorterm2 += ydiff2; // Increment error term
 						if (errorterm2 < xdiff2) {  // If not more than XDIFF
-							screen_buffer[offset2] = clip->color;  // ...plot a pixel
+							drawpixel(screen_buffer, offset2, ystart2, clip->color, mask);  // ...plot a pixel
 						}
 					}
 					errorterm2 -= xdiff2; // If time to increment X, restore error term
@@ -123,7 +163,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 					}
 					//					for (int i=start; i<start+length+1; i++)  // From edge to edge...
 					//						screen_buffer[i]=clip->color;         // ...draw the line
-					memset(&screen_buffer[start], clip->color, length + 1);
+					drawspan(screen_buffer, start, length, ystart1, clip->color, mask);
 					offset1 += 320;           // Advance edge 1 offset to next line
 					ystart1++;
 					offset2 += 320;           // Advance edge 2 offset to next line
@@ -135,7 +175,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 
 				count1 = xdiff1;    // Count for X increment on edge 1
 				count2 = ydiff2;    // Count for Y increment on edge 2
-				while (count1 && count2) {  // Continue drawing until one edge is done
+				while (count1 && count2 && (ystart1 <= ylast)) {  // Continue drawing until one edge is done
 
 					// Calculate edge 1:
 
@@ -146,7 +186,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 						}
 						errorterm1 += ydiff1; // Increment error term
 						if (errorterm1 < xdiff1) {  // If not more than XDIFF
-							screen_buffer[offset1] = clip->color; // ...plot a pixel
+							drawpixel(screen_buffer, offset1, ystart1, clip->color, mask); // ...plot a pixel
 						}
 					}
 					errorterm1 -= xdiff1; // If time to increment X, restore error term
@@ -172,7 +212,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 					}
 					//					for (int i=start; i<start+length+1; i++)  // From edge to edge
 					//						screen_buffer[i]=clip->color;         // ...draw the line
-					memset(&screen_buffer[start], clip->color, length + 1);
+					drawspan(screen_buffer, start, length, ystart1, clip->color, mask);
 					offset1 += 320;           // Advance edge 1 offset to next line
 					ystart1++;
 					offset2 += 320;           // Advance edge 2 offset to next line
@@ -186,7 +226,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 
 				count1 = ydiff1;  // Count for Y increment on edge 1
 				count2 = xdiff2;  // Count for X increment on edge 2
-				while (count1 && count2) {  // Continue drawing until one edge is done
+				while (count1 && count2 && (ystart1 <= ylast)) {  // Continue drawing until one edge is done
 
 					// Calculate edge 1:
 
@@ -207,7 +247,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 						}
 						errorterm2 += ydiff2; // Increment error term
 						if (errorterm2 < xdiff2) {  // If not more than XDIFF
-							screen_buffer[offset2] = clip->color; // ...plot a pixel
+							drawpixel(screen_buffer, offset2, ystart2, clip->color, mask); // ...plot a pixel
 						}
 					}
 					errorterm2 -= xdiff2;  // If time to increment X, restore error term
@@ -223,7 +263,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 					}
 					//					for (int i=start; i<start+length+1; i++) // From edge to edge...
 					//						screen_buffer[i]=clip->color;        // ...draw the line
-					memset(&screen_buffer[start], clip->color, length + 1);
+					drawspan(screen_buffer, start, length, ystart1, clip->color, mask);
 					offset1 += 320;         // Advance edge 1 offset to next line
 					ystart1++;
 					offset2 += 320;         // Advance edge 2 offset to next line
@@ -235,7 +275,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 
 				count1 = ydiff1;  // Count for Y increment on edge 1
 				count2 = ydiff2;  // Count for Y increment on edge 2
-				while (count1 && count2) {  // Continue drawing until one edge is done
+				while (count1 && count2 && (ystart1 <= ylast)) {  // Continue drawing until one edge is done
 
 					// Calculate edge 1:
 
@@ -268,7 +308,7 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 					}
 					//					for (int i=start; i<start+length+1; i++)   // From edge to edge
 					//						screen_buffer[i]=clip->color;          // ...draw the linee
-					memset(&screen_buffer[start], clip->color, length + 1);
+					drawspan(screen_buffer, start, length, ystart1, clip->color, mask);
 					offset1 += 320;            // Advance edge 1 offset to next line
 					ystart1++;
 					offset2 += 320;            // Advance edge 2 offset to next line
@@ -277,6 +317,12 @@ void drawpoly(clipped_polygon_type *clip, unsigned char *screen_buffer)
 			}
 		}
 
+		// Stop if the rest of the polygon is covered:
+
+		if (ystart1 > ylast) {
+			break;
+		}
+
 		// Another edge (at least) is complete. Start next edge, if any.
 
 		if (!count1) {           // If edge 1 is complete...
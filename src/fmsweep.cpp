@@ -0,0 +1,312 @@
+//
+// fmsweep.c
+//
+// Headless flight envelope sweep. Runs the flight model in RunFModel() for
+// a grid or a random sample of fixed control settings, spread across all
+// cores, and reports stall onset, climb rate, crashes and top speed.
+//
+#include "lib/retro.h"
+#include "aircraft.h"
+
+struct sweep_scenario {
+	int throttle_pos;          // throttle position 0 to 15
+	int elevator_pos;          // elevator position -15 to 15
+	int aileron_pos;           // aileron position -15 to 15
+	int rudder_pos;            // rudder position -15 to 15
+};
+
+struct sweep_result {
+	sweep_scenario input;
+	int stall_ms;              // time of first stall, -1 if none
+	int crash_ms;              // time of crash, -1 if none
+	int landings;              // number of safe touchdowns
+	float max_climb;           // best rate of climb in feet per minute
+	float min_climb;           // worst rate of climb in feet per minute
+	float max_speed;           // top airspeed
+	int max_altitude;          // highest altitude reached
+};
+
+static struct {
+	int grid;                  // steps per control axis, 0 for random samples
+	long samples;              // number of random samples
+	unsigned long seed;        // seed for random samples
+	int seconds;               // simulated seconds per scenario
+	int step;                  // flight model time slice in ms
+	int threads;               // number of worker threads
+	char *csv;                 // per scenario output file
+	long count;                // total number of scenarios
+	SDL_atomic_t next;         // next scenario to run
+	sweep_result *result;
+} SWEEP = { .grid = 0, .samples = 100000, .seed = 1, .seconds = 60, .step = LOOP };
+
+// maps index i of n evenly spaced steps onto the range lo..hi
+int SweepAxis(int i, int n, int lo, int hi)
+{
+	if (n < 2) {
+		return (lo + hi) / 2;
+	}
+	return lo + (i * (hi - lo)) / (n - 1);
+}
+
+// splitmix64, so that a random scenario only depends on the seed and its
+// index and not on which thread happens to run it
+unsigned long SweepRandom(unsigned long x)
+{
+	x += 0x9e3779b97f4a7c15UL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+	return x ^ (x >> 31);
+}
+
+// returns the control settings of scenario number index
+sweep_scenario SweepScenario(long index)
+{
+	sweep_scenario s;
+
+	if (SWEEP.grid) {
+		int n = SWEEP.grid;
+		s.throttle_pos = SweepAxis(index % n, n, 0, 15); index /= n;
+		s.elevator_pos = SweepAxis(index % n, n, -15, 15); index /= n;
+		s.aileron_pos = SweepAxis(index % n, n, -15, 15); index /= n;
+		s.rudder_pos = SweepAxis(index % n, n, -15, 15);
+	} else {
+		unsigned long r = SweepRandom(SWEEP.seed * 0x100000001b3UL + index);
+		s.throttle_pos = (r & 0xff) % 16; r >>= 8;
+		s.elevator_pos = (int)((r & 0xff) % 31) - 15; r >>= 8;
+		s.aileron_pos = (int)((r & 0xff) % 31) - 15; r >>= 8;
+		s.rudder_pos = (int)((r & 0xff) % 31) - 15;
+	}
+	return s;
+}
+
+// flies one scenario from the standard start position with the controls
+// held fixed, handling touchdowns the same way GroundApproach() does
+void SweepRun(sweep_result *r)
+{
+	state_vect tSV;
+
+	InitAircraft(&tSV);
+	tSV.ignition_on = true;
+	tSV.brake = false;
+
+	r->stall_ms = -1;
+	r->crash_ms = -1;
+	r->landings = 0;
+	r->max_climb = 0;
+	r->min_climb = 0;
+	r->max_speed = 0;
+	r->max_altitude = 0;
+
+	for (int t = 0; t < SWEEP.seconds * 1000; t += SWEEP.step) {
+		tSV.throttle_pos = r->input.throttle_pos;
+		tSV.elevator_pos = r->input.elevator_pos;
+		tSV.aileron_pos = r->input.aileron_pos;
+		tSV.rudder_pos = r->input.rudder_pos;
+
+		RunFModel(&tSV);
+
+		if (tSV.stall && r->stall_ms < 0) {
+			r->stall_ms = t;
+		}
+		if (tSV.climbRate > r->max_climb) {
+			r->max_climb = tSV.climbRate;
+		}
+		if (tSV.climbRate < r->min_climb) {
+			r->min_climb = tSV.climbRate;
+		}
+		if (tSV.h_speed > r->max_speed) {
+			r->max_speed = tSV.h_speed;
+		}
+		if (tSV.altitude > r->max_altitude) {
+			r->max_altitude = tSV.altitude;
+		}
+
+		if ((tSV.airborne) && (tSV.altitude <= 0)) {
+			if (CrashAttitude(&tSV)) {
+				r->crash_ms = t;
+				break;
+			}
+			LandAC(&tSV);
+			r->landings++;
+		}
+	}
+}
+
+int SweepWorker(void *data)
+{
+	long i;
+	while ((i = SDL_AtomicAdd(&SWEEP.next, 1)) < SWEEP.count) {
+		SWEEP.result[i].input = SweepScenario(i);
+		SweepRun(&SWEEP.result[i]);
+	}
+	return 0;
+}
+
+void SweepReport(double seconds)
+{
+	long stalls = 0, crashes = 0, landings = 0;
+	double climb = 0;
+	sweep_result *best_climb = NULL, *best_speed = NULL;
+
+	for (long i = 0; i < SWEEP.count; i++) {
+		sweep_result *r = &SWEEP.result[i];
+		stalls += (r->stall_ms >= 0);
+		crashes += (r->crash_ms >= 0);
+		landings += (r->landings > 0);
+		climb += r->max_climb;
+		if (best_climb == NULL || r->max_climb > best_climb->max_climb) {
+			best_climb = r;
+		}
+		if (best_speed == NULL || r->max_speed > best_speed->max_speed) {
+			best_speed = r;
+		}
+	}
+
+	printf("Scenarios:             %ld (%d s at %d ms steps)\n", SWEEP.count, SWEEP.seconds, SWEEP.step);
+	printf("Wall time:             %.2f s on %d threads (%.0f scenarios/s)\n", seconds, SWEEP.threads, SWEEP.count / seconds);
+	printf("Stalled:               %ld (%.1f%%)\n", stalls, 100.0 * stalls / SWEEP.count);
+	printf("Crashed:               %ld (%.1f%%)\n", crashes, 100.0 * crashes / SWEEP.count);
+	printf("Landed safely:         %ld (%.1f%%)\n", landings, 100.0 * landings / SWEEP.count);
+	printf("Mean best climb:       %.0f ft/min\n", climb / SWEEP.count);
+	if (best_climb) {
+		printf("Best climb:            %.0f ft/min (throttle %d, elevator %d, aileron %d, rudder %d)\n", best_climb->max_climb,
+			best_climb->input.throttle_pos, best_climb->input.elevator_pos, best_climb->input.aileron_pos, best_climb->input.rudder_pos);
+		printf("Max speed:             %.1f mph (throttle %d, elevator %d, aileron %d, rudder %d)\n", best_speed->max_speed,
+			best_speed->input.throttle_pos, best_speed->input.elevator_pos, best_speed->input.aileron_pos, best_speed->input.rudder_pos);
+	}
+}
+
+void SweepWriteCsv(const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", filename);
+	}
+
+	fprintf(fp, "throttle,elevator,aileron,rudder,stall_ms,crash_ms,landings,max_climb,min_climb,max_speed,max_altitude\n");
+	for (long i = 0; i < SWEEP.count; i++) {
+		sweep_result *r = &SWEEP.result[i];
+		fprintf(fp, "%d,%d,%d,%d,%d,%d,%d,%.1f,%.1f,%.1f,%d\n", r->input.throttle_pos, r->input.elevator_pos, r->input.aileron_pos,
+			r->input.rudder_pos, r->stall_ms, r->crash_ms, r->landings, r->max_climb, r->min_climb, r->max_speed, r->max_altitude);
+	}
+
+	fclose(fp);
+}
+
+void SweepParseArguments(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"grid", required_argument, 0, 'g'},
+		{"samples", required_argument, 0, 'n'},
+		{"seed", required_argument, 0, 's'},
+		{"time", required_argument, 0, 't'},
+		{"step", required_argument, 0, 0},
+		{"threads", required_argument, 0, 'j'},
+		{"csv", required_argument, 0, 0},
+		{0, 0, 0, 0} };
+	bool usage = false;
+	int c;
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, ":hg:n:s:t:j:", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 0:
+			if (strcmp("step", long_options[option_index].name) == 0) {
+				SWEEP.step = atoi(optarg);
+			} else if (strcmp("csv", long_options[option_index].name) == 0) {
+				SWEEP.csv = optarg;
+			}
+			break;
+		case 'g':
+			SWEEP.grid = atoi(optarg);
+			break;
+		case 'n':
+			SWEEP.samples = atol(optarg);
+			break;
+		case 's':
+			SWEEP.seed = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			SWEEP.seconds = atoi(optarg);
+			break;
+		case 'j':
+			SWEEP.threads = atoi(optarg);
+			break;
+		case '?':
+			printf("unrecognized option '%s'\n", argv[optind - 1]);
+			usage = true;
+			break;
+		default:
+			usage = true;
+			break;
+		}
+	}
+	if (SWEEP.step <= 0 || SWEEP.seconds <= 0 || SWEEP.grid < 0 || SWEEP.samples <= 0) {
+		usage = true;
+	}
+	if (usage) {
+		printf("Usage: %s [OPTION]...\n\n", basename(argv[0]));
+		printf("Options:\n");
+		printf(" -h, --help           Display this text and exit\n");
+		printf(" -g, --grid=N         Sweep N evenly spaced settings per control (N^4 scenarios)\n");
+		printf(" -n, --samples=N      Sweep N random settings (default 100000)\n");
+		printf(" -s, --seed=VALUE     Seed for random settings (default 1)\n");
+		printf(" -t, --time=SECONDS   Simulated time per scenario (default 60)\n");
+		printf("     --step=MS        Flight model time slice (default %d)\n", LOOP);
+		printf(" -j, --threads=N      Number of worker threads (default all cores)\n");
+		printf("     --csv=FILE       Write per scenario results to FILE\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	SweepParseArguments(argc, argv);
+
+	if (SWEEP.grid) {
+		SWEEP.count = (long)SWEEP.grid * SWEEP.grid * SWEEP.grid * SWEEP.grid;
+	} else {
+		SWEEP.count = SWEEP.samples;
+	}
+	if (SWEEP.count > INT_MAX) {
+		RETRO_RageQuit("Too many scenarios\n");
+	}
+	if (SWEEP.threads <= 0) {
+		SWEEP.threads = SDL_GetCPUCount();
+		if (SWEEP.threads <= 0) {
+			SWEEP.threads = 1;
+		}
+	}
+
+	SWEEP.result = (sweep_result *)malloc(SWEEP.count * sizeof(sweep_result));
+	if (SWEEP.result == NULL) {
+		RETRO_RageQuit("Cannot allocate result memory\n");
+	}
+
+	// The workers only read the loop time, so set it before they start:
+	SetLoopTime(SWEEP.step);
+
+	unsigned long start = SDL_GetPerformanceCounter();
+
+	SDL_Thread **worker = new SDL_Thread *[SWEEP.threads];
+	for (int i = 0; i < SWEEP.threads; i++) {
+		if ((worker[i] = SDL_CreateThread(SweepWorker, "sweep", NULL)) == NULL) {
+			RETRO_RageQuit("SDL_CreateThread failed: %s\n", SDL_GetError());
+		}
+	}
+	for (int i = 0; i < SWEEP.threads; i++) {
+		SDL_WaitThread(worker[i], NULL);
+	}
+	delete[] worker;
+
+	double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+	SweepReport(seconds);
+	if (SWEEP.csv) {
+		SweepWriteCsv(SWEEP.csv);
+	}
+
+	free(SWEEP.result);
+
+	return 0;
+}
@@ -17,6 +17,10 @@
 
 state_vect tSV;               // the control-state vector
 
+RETRO_TripleBuffer<state_vect> snapshots;  // state vectors published by the simulation thread
+static SDL_Thread *simThread;               // simulation thread in pipelined mode
+static SDL_atomic_t simQuit;                // tells the simulation thread to finish
+
 // handles a ground approach by determining from pitch and roll whether
 // the airplane has landed safely or crashed
 void GroundApproach(state_vect *tSV)
@@ -24,8 +28,8 @@ void GroundApproach(state_vect *tSV)
 	// handle approaching the ground
 	if (tSV->opMode == FLIGHT) {
 		if ((tSV->airborne) && (tSV->altitude <= 0)) {
-			if (((tSV->pitch > 10) || (tSV->pitch < -10)) || ((tSV->roll > 10) || (tSV->roll < -10))) {
-				ShowCrash();
+			if (CrashAttitude(tSV)) {
+				ShowCrash(&simQuit);
 				ResetACState(tSV);
 			} else {
 				LandAC(tSV);
@@ -34,23 +38,67 @@ void GroundApproach(state_vect *tSV)
 	}
 }
 
+// In pipelined mode the flight model runs on this thread, one pass every
+// loop time, independent of how long frames take to render. After each pass
+// it publishes a copy of the state vector for the render thread.
+int Simulate(void *data)
+{
+	unsigned long next = SDL_GetPerformanceCounter();
+
+	while (!SDL_AtomicGet(&simQuit)) {
+		// hold still while Space pauses the render thread, and start
+		// afresh after it rather than catch up
+		if (RETRO_KeyState(SDL_SCANCODE_SPACE)) {
+			SDL_Delay(10);
+			next = SDL_GetPerformanceCounter();
+			continue;
+		}
+
+		GetControls(&tSV);
+		RunFModel(&tSV);
+		RecordControls();
+		GroundApproach(&tSV);
+
+		*snapshots.Back() = tSV;
+		snapshots.Publish();
+
+		// wait for the next pass, without trying to catch up if behind
+		unsigned long now = SDL_GetPerformanceCounter();
+		next += SDL_GetPerformanceFrequency() * fixedLoopTime / 1000;
+		if (next > now) {
+			SDL_Delay((next - now) * 1000 / SDL_GetPerformanceFrequency());
+		} else {
+			next = now;
+		}
+	}
+	return 0;
+}
+
 void DEMO_Render(double deltatime)
 {
+	if (RETRO.pipeline) {
+		snapshots.Update();
+		UpdateView(snapshots.Front());
+		return;
+	}
+
 	GetControls(&tSV);
 	RunFModel(&tSV);
+	RecordControls();
 	UpdateView(&tSV);
 	GroundApproach(&tSV);
 }
 
 void DEMO_Initialize(void)
 {
-	RETRO_LoadImage("assets/title.pcx");
-	RETRO_LoadImage("assets/ckpit01.pcx");  // front view
-	RETRO_LoadImage("assets/sideview.pcx");  // right view
-	FlipFrame(0, 0, 319, 199, RETRO_ImageData(PCX_RIGHT));
-	RETRO_LoadImage("assets/sideview.pcx");  // left view
-	RETRO_LoadImage("assets/tail.pcx");  // rear view
-	RETRO_LoadImage("assets/doodads.pcx");  // buttons
+	RETRO_OpenPack("assets/fof.pak");
+	RETRO_QueueImage("assets/title.pcx");
+	RETRO_QueueImage("assets/ckpit01.pcx");  // front view
+	RETRO_QueueMirror(PCX_LEFT);  // right view
+	RETRO_QueueImage("assets/sideview.pcx");  // left view
+	RETRO_QueueImage("assets/tail.pcx");  // rear view
+	RETRO_QueueImage("assets/doodads.pcx");  // buttons
+	RETRO_LoadQueuedImages();
 
 	RETRO_Blit(RETRO_ImageData(PCX_TITLE));
 
@@ -72,8 +120,60 @@ void DEMO_Initialize(void)
 	RETRO_SetPalette(RETRO_ImagePalette(PCX_FRONT));
 
 	InitView();
-	SetUpACDisplay(RETRO_ImageData(PCX_DOODADS));
+	SetUpACDisplay(RETRO_PinImage(PCX_DOODADS));  // the gauges copy their parts
+	RETRO_UnpinImage(PCX_DOODADS);
 	InitAircraft(&tSV);
+
+	if (RETRO.pipeline) {
+		if (!fixedLoopTime) {
+			SetLoopTime(LOOP);
+		}
+		for (int i = 0; i < 3; i++) {
+			snapshots.buffer[i] = tSV;
+		}
+		if ((simThread = SDL_CreateThread(Simulate, "simulate", NULL)) == NULL) {
+			RETRO_RageQuit("SDL_CreateThread failed: %s\n", SDL_GetError());
+		}
+	}
+
+	RETRO_EnableDirtyRects();
+}
+
+void DEMO_Deinitialize(void)
+{
+	if (simThread) {
+		SDL_AtomicSet(&simQuit, 1);
+		SDL_WaitThread(simThread, NULL);
+	}
+	StopRecording();
+	DeinitView();
+}
+
+RETRO_Option *DEMO_Options(void)
+{
+	static RETRO_Option options[] = {
+		{"record", required_argument, "     --record=FILE    Record flight controls to FILE"},
+		{"replay", required_argument, "     --replay=FILE    Replay flight controls from FILE, then exit"},
+		{"fixedstep", required_argument, "     --fixedstep=MS   Run the flight model in fixed MS time slices"},
+		{"fog", no_argument, "     --fog            Fade distant objects into the haze"},
+		{"tiles", required_argument, "     --tiles=FILE     Stream the world from tiled world FILE"},
+		{0, 0, 0} };
+	return options;
+}
+
+void DEMO_Option(const char *name, const char *arg)
+{
+	if (strcmp("record", name) == 0) {
+		StartRecording(arg);
+	} else if (strcmp("replay", name) == 0) {
+		StartReplay(arg);
+	} else if (strcmp("fixedstep", name) == 0) {
+		SetLoopTime(atoi(arg));
+	} else if (strcmp("fog", name) == 0) {
+		EnableDepthFog();
+	} else if (strcmp("tiles", name) == 0) {
+		UseWorldTiles(arg);
+	}
 }
 
 void DEMO_Startup(void)
@@ -0,0 +1,618 @@
+//
+// fofbench.c
+//
+// Microbenchmarks of the hot kernels of the renderer and the library. Each
+// benchmark is warmed up, then timed over repeated batches of operations,
+// and the batches whose time per operation strays far from the median are
+// rejected as outliers before the rest are summed up. Inputs come from a
+// seeded generator, and where it matters from a real frame of a generated
+// world, so runs are comparable from one build to the next.
+//
+#include "lib/retro.h"
+#include "fix.h"
+#include "screen.h"
+#include "poly.h"
+#include "view.h"
+#include "worldgen.h"
+
+#define BENCH_SAMPLES 1000     // most timed batches per benchmark
+#define BENCH_CASES 256        // inputs cycled through by each benchmark
+#define BENCH_OUTLIER 3.0      // median absolute deviations beyond which a batch is rejected
+
+typedef void (*bench_fn)(long count);
+
+static struct {
+	char *filter;              // only run benchmarks whose names contain this
+	bool list;                 // list the benchmarks instead
+	int repetitions;           // timed batches per benchmark
+	int warmup;                // ms of untimed runs first
+	int batch;                 // ms each timed batch aims to take
+	char *csv;                 // results output file
+	FILE *csvfile;
+	int run;                   // benchmarks run
+} BENCH = { .repetitions = 30, .warmup = 200, .batch = 10 };
+
+static unsigned char bench_screen[320 * 200];
+static unsigned long bench_state = 1;
+
+// inputs of the benchmark being run
+static clipped_polygon_type *bench_clip;
+static polygon_type *bench_polygon;
+static int bench_count;
+static clipped_polygon_type bench_work;
+static object_type bench_object;
+static unsigned char *bench_src;
+static unsigned int bench_pixels[320 * 200];
+static unsigned char *bench_file;
+static long bench_size;
+static const char *bench_path;
+
+// the polygon list of one frame of a generated world, in the order
+// make_polygon_list() leaves it, and its clipped polygons at each step
+static world_type bench_world;
+static polygon_type *frame_list;
+static int frame_polygons;
+static clipped_polygon_type *frame_zclipped, *frame_projected, *frame_clipped;
+static int frame_clips;
+
+double BenchSeconds(unsigned long long ticks)
+{
+	return (double)ticks / SDL_GetPerformanceFrequency();
+}
+
+int BenchCompare(const void *a, const void *b)
+{
+	double da = *(double *)a, db = *(double *)b;
+	return (da > db) - (da < db);
+}
+
+// times FN at PER elements per operation and reports nanoseconds per element
+void BenchRun(const char *name, const char *unit, bench_fn fn, int per = 1)
+{
+	if (BENCH.filter && !strstr(name, BENCH.filter)) {
+		return;
+	}
+	if (BENCH.list) {
+		printf("%s\n", name);
+		return;
+	}
+
+	// Warm up, doubling the batch until it takes long enough:
+	long count = 1;
+	unsigned long long start = SDL_GetPerformanceCounter();
+	while (true) {
+		unsigned long long t = SDL_GetPerformanceCounter();
+		fn(count);
+		double seconds = BenchSeconds(SDL_GetPerformanceCounter() - t);
+		if (seconds * 1000 < BENCH.batch) {
+			count = seconds > 0 ? MAX(count * 2, (long)(count * BENCH.batch / (seconds * 1000) / 2)) : count * 2;
+		} else if (BenchSeconds(SDL_GetPerformanceCounter() - start) * 1000 >= BENCH.warmup) {
+			break;
+		}
+	}
+
+	double sample[BENCH_SAMPLES], deviation[BENCH_SAMPLES];
+	int samples = MIN(BENCH.repetitions, BENCH_SAMPLES);
+	for (int r = 0; r < samples; r++) {
+		unsigned long long t = SDL_GetPerformanceCounter();
+		fn(count);
+		sample[r] = BenchSeconds(SDL_GetPerformanceCounter() - t) * 1e9 / ((double)count * per);
+	}
+
+	// Reject batches more than BENCH_OUTLIER median absolute deviations
+	//  from the median, such as ones interrupted by the system:
+	qsort(sample, samples, sizeof(double), BenchCompare);
+	double median = sample[samples / 2];
+	for (int r = 0; r < samples; r++) {
+		deviation[r] = fabs(sample[r] - median);
+	}
+	qsort(deviation, samples, sizeof(double), BenchCompare);
+	double limit = BENCH_OUTLIER * 1.4826 * deviation[samples / 2];
+	double sum = 0, sumsq = 0;
+	int kept = 0;
+	for (int r = 0; r < samples; r++) {
+		if (fabs(sample[r] - median) <= limit) {
+			sum += sample[r];
+			sumsq += sample[r] * sample[r];
+			kept++;
+		}
+	}
+	double mean = sum / kept;
+	double sd = sqrt(MAX(sumsq / kept - mean * mean, 0.0));
+
+	printf("%-44s %10.2f %10.2f %8.2f %10.2f %3d/%-3d ns/%s\n", name, median, mean, sd, sample[0], kept, samples, unit);
+	fflush(stdout);
+	if (BENCH.csvfile) {
+		fprintf(BENCH.csvfile, "\"%s\",%s,%.3f,%.3f,%.3f,%.3f,%d,%d\n", name, unit, median, mean, sd, sample[0], kept, samples);
+	}
+	BENCH.run++;
+}
+
+// *******************************************************************
+// Inputs
+// *******************************************************************
+
+// regular polygon of SIDES vertices around cx,cy, RX by RY pixels, turned by
+// ANGLE radians, in screen coordinates as xyclip() leaves them
+void BenchShape(clipped_polygon_type *clip, int sides, float cx, float cy, float rx, float ry, float angle)
+{
+	clip->number_of_vertices = sides;
+	clip->color = 1 + gen_random(&bench_state) % 255;
+	for (int v = 0; v < sides; v++) {
+		float a = angle + 2 * M_PI * v / sides;
+		clip->vertex[v].x = lround(cx + rx * cos(a));
+		clip->vertex[v].y = lround(cy + ry * sin(a));
+		clip->vertex[v].z = 100;
+	}
+}
+
+// polygons of SIDES vertices, RADIUS pixels across, or long thin slivers
+// that wide if SLIVER, placed at random inside the window
+void BenchShapes(int sides, float radius, bool sliver)
+{
+	for (int i = 0; i < BENCH_CASES; i++) {
+		float rx = sliver ? radius : MIN(radius, (xmax - xmin) / 2.0f - 1);
+		float ry = sliver ? MIN(radius / 16, (ymax - ymin) / 2.0f - 1) : MIN(radius, (ymax - ymin) / 2.0f - 1);
+		float r = MAX(rx, ry);
+		float cx = xmin + r + gen_uniform(&bench_state) * MAX(xmax - xmin - 2 * r, 0.0f);
+		float cy = ymin + r + gen_uniform(&bench_state) * MAX(ymax - ymin - 2 * r, 0.0f);
+		float angle = sliver ? 0 : 2 * M_PI * gen_uniform(&bench_state);
+		BenchShape(&bench_clip[i], sides, cx, CLAMP(cy, ymin + ry, ymax - ry), rx, ry, angle);
+	}
+	bench_count = BENCH_CASES;
+}
+
+// views one frame of a generated world and keeps its polygon list and the
+// clipped polygons made from it, for realistic inputs
+void BenchFrame()
+{
+	worldgen_type gen = { .seed = 1, .objects = 400, .polygons = 48, .area = 16384, .distribution = GEN_UNIFORM, .overlap = 0.5 };
+	FILE *fp = tmpfile();
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open temporary file\n");
+	}
+	generate_world(&gen, fp);
+	rewind(fp);
+	int polycount = loadobjects(&bench_world, fp);
+	fclose(fp);
+	initworld(polycount);
+	initgrid(&bench_world);
+
+	view_type view = { 0, -200, -gen.area / 2 - 500, 0, 0, 0 };
+	RETRO_ResetArena();
+	alignview(view);
+	object_type **visible = (object_type **)RETRO_ArenaAlloc(grid.objects * sizeof(object_type *));
+	int count = query_grid(&view, visible);
+	make_polygon_list(visible, count, &view, &polylist);
+
+	frame_polygons = polylist.number_of_polygons;
+	frame_list = (polygon_type *)malloc(MAX(frame_polygons, 1) * sizeof(polygon_type));
+	frame_zclipped = (clipped_polygon_type *)malloc(MAX(frame_polygons, 1) * sizeof(clipped_polygon_type));
+	frame_projected = (clipped_polygon_type *)malloc(MAX(frame_polygons, 1) * sizeof(clipped_polygon_type));
+	frame_clipped = (clipped_polygon_type *)malloc(MAX(frame_polygons, 1) * sizeof(clipped_polygon_type));
+	if (frame_list == NULL || frame_zclipped == NULL || frame_projected == NULL || frame_clipped == NULL) {
+		RETRO_RageQuit("Cannot allocate benchmark memory\n");
+	}
+	memcpy(frame_list, polylist.polygon, frame_polygons * sizeof(polygon_type));
+	for (int i = 0; i < frame_polygons; i++) {
+		clipped_polygon_type clip;
+		zclip(&frame_list[i], &clip);
+		if (clip.number_of_vertices > 0) {
+			frame_zclipped[frame_clips] = clip;
+			cproject(&clip);
+			frame_projected[frame_clips] = clip;
+			xyclip(&clip);
+			if (clip.number_of_vertices > 0) {
+				frame_clipped[frame_clips++] = clip;
+			}
+		}
+	}
+}
+
+// polygons with vertices of their own, aligned with the view, which are
+// in front of the viewer or straddle the view plane if CROSSING
+void BenchPolygons(bool crossing)
+{
+	static vertex_type vertex[BENCH_CASES * 4];
+	static vertex_type *pointer[BENCH_CASES * 4];
+	for (int i = 0; i < BENCH_CASES; i++) {
+		float cx = (gen_uniform(&bench_state) - 0.5) * 2000;
+		float cy = (gen_uniform(&bench_state) - 0.5) * 1000;
+		float cz = crossing ? 0 : 200 + gen_uniform(&bench_state) * 4000;
+		for (int v = 0; v < 4; v++) {
+			vertex_type *curvert = &vertex[i * 4 + v];
+			curvert->ax = cx + ((v == 1 || v == 2) ? 100 : -100);
+			curvert->ay = cy + ((v >= 2) ? 100 : -100);
+			curvert->az = cz + ((v == 0 || v == 3) ? 150 : -150);
+			pointer[i * 4 + v] = curvert;
+		}
+		bench_polygon[i].number_of_vertices = 4;
+		bench_polygon[i].vertex = &pointer[i * 4];
+		bench_polygon[i].color = 1;
+	}
+	bench_count = BENCH_CASES;
+}
+
+// polygon list of the frame's length, with DISTANCES 0 for random ones, 1
+// for far to near, as sorted, 2 for near to far, 3 for all the same
+void BenchDistances(int distances)
+{
+	for (int i = 0; i < frame_polygons; i++) {
+		bench_polygon[i] = frame_list[i];
+		switch (distances) {
+		case 0:
+			bench_polygon[i].distance = gen_uniform(&bench_state) * 1e8;
+			break;
+		case 1:
+			bench_polygon[i].distance = frame_polygons - i;
+			break;
+		case 2:
+			bench_polygon[i].distance = i;
+			break;
+		default:
+			bench_polygon[i].distance = 1000;
+			break;
+		}
+	}
+	bench_count = frame_polygons;
+}
+
+// reads a whole file for the decoding benchmarks, false if it is missing
+bool BenchFile(const char *filename)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		printf("%-44s skipped, cannot open file\n", filename);
+		return false;
+	}
+	fclose(fp);
+	free(bench_file);
+	bench_file = RETRO_ReadFile(filename, &bench_size);
+	bench_path = filename;
+	return true;
+}
+
+// *******************************************************************
+// Kernels
+// *******************************************************************
+
+void BenchDrawpoly(long count)
+{
+	for (long i = 0; i < count; i++) {
+		drawpoly(&bench_clip[i % bench_count], bench_screen);
+	}
+}
+
+void BenchZclip(long count)
+{
+	for (long i = 0; i < count; i++) {
+		zclip(&bench_polygon[i % bench_count], &bench_work);
+	}
+}
+
+void BenchCproject(long count)
+{
+	// Projects in place, which costs the same whatever the coordinates
+	for (long i = 0; i < count; i++) {
+		cproject(&bench_clip[i % bench_count]);
+	}
+}
+
+void BenchCopyClip(long count)
+{
+	for (long i = 0; i < count; i++) {
+		clipped_polygon_type *clip = &bench_clip[i % bench_count];
+		bench_work.number_of_vertices = clip->number_of_vertices;
+		memcpy(bench_work.vertex, clip->vertex, clip->number_of_vertices * sizeof(clip_type));
+	}
+}
+
+void BenchXyclip(long count)
+{
+	// Clips in place, so each polygon is copied first as BenchCopyClip() does
+	for (long i = 0; i < count; i++) {
+		clipped_polygon_type *clip = &bench_clip[i % bench_count];
+		bench_work.number_of_vertices = clip->number_of_vertices;
+		memcpy(bench_work.vertex, clip->vertex, clip->number_of_vertices * sizeof(clip_type));
+		xyclip(&bench_work);
+	}
+}
+
+void BenchZsort(long count)
+{
+	for (long i = 0; i < count; i++) {
+		RETRO_ResetArena();
+		polygon_list_type list = { bench_count, bench_polygon };
+		z_sort(&list);
+	}
+}
+
+void BenchTransform(long count)
+{
+	for (long i = 0; i < count; i++) {
+		transform(&bench_object);
+	}
+}
+
+void BenchAtransform(long count)
+{
+	for (long i = 0; i < count; i++) {
+		atransform(&bench_object);
+	}
+}
+
+void BenchPaletteConvert(long count)
+{
+	for (long i = 0; i < count; i++) {
+		RETRO_PaletteConvert(bench_src, bench_pixels, 320 * 200);
+	}
+}
+
+void BenchBitBlit(long count)
+{
+	for (long i = 0; i < count; i++) {
+		RETRO_BitBlit(bench_src, 320 * 200, bench_screen);
+	}
+}
+
+void BenchDecodeImage(long count)
+{
+	for (long i = 0; i < count; i++) {
+		RETRO_Image image;
+		RETRO_DecodeImage(&image, bench_file, bench_size, bench_path);
+		free(image.data);
+	}
+}
+
+void BenchReadDecodeImage(long count)
+{
+	for (long i = 0; i < count; i++) {
+		RETRO_Image image;
+		long size;
+		unsigned char *file = RETRO_ReadFile(bench_path, &size);
+		RETRO_DecodeImage(&image, file, size, bench_path);
+		free(file);
+		free(image.data);
+	}
+}
+
+void BenchLoadpoly(long count)
+{
+	for (long i = 0; i < count; i++) {
+		world_type world;
+		loadpoly(&world, bench_path);
+		unloadpoly(&world);
+	}
+}
+
+// *******************************************************************
+// Suite
+// *******************************************************************
+
+void BenchAll()
+{
+	char name[64];
+	setview(159, 73, 0, 0, 319, 147, 400, 105, 11, bench_screen);
+	BenchFrame();
+
+	// Room for the synthetic inputs, as many as the frame has or BENCH_CASES:
+	polygon_type *polygons = (polygon_type *)malloc(MAX(frame_polygons, BENCH_CASES) * sizeof(polygon_type));
+	clipped_polygon_type *clips = (clipped_polygon_type *)malloc(MAX(frame_clips, BENCH_CASES) * sizeof(clipped_polygon_type));
+	if (polygons == NULL || clips == NULL) {
+		RETRO_RageQuit("Cannot allocate benchmark memory\n");
+	}
+	printf("%-44s %10s %10s %8s %10s %7s\n", "benchmark", "median", "mean", "sd", "min", "kept");
+
+	// Polygon fill over shapes and sizes, then as a frame draws them:
+	static const struct { const char *name; int sides; bool sliver; } shapes[] = {
+		{ "triangle", 3, false }, { "quad", 4, false }, { "16-gon", 16, false }, { "sliver", 3, true } };
+	static const int sizes[] = { 2, 8, 32, 128 };
+	bench_clip = clips;
+	for (int s = 0; s < 4; s++) {
+		for (int r = 0; r < 4; r++) {
+			snprintf(name, sizeof(name), "drawpoly %s radius %d", shapes[s].name, sizes[r]);
+			if (!BENCH.filter || strstr(name, BENCH.filter)) {
+				BenchShapes(shapes[s].sides, sizes[r], shapes[s].sliver);
+			}
+			BenchRun(name, "polygon", BenchDrawpoly);
+		}
+	}
+	bench_clip = frame_clipped;
+	bench_count = frame_clips;
+	snprintf(name, sizeof(name), "drawpoly frame of %d", frame_clips);
+	BenchRun(name, "polygon", BenchDrawpoly);
+
+	// Clipping and projection, of a frame's polygons and of harder cases:
+	bench_polygon = frame_list;
+	bench_count = frame_polygons;
+	BenchRun("zclip frame", "polygon", BenchZclip);
+	bench_polygon = polygons;
+	BenchPolygons(false);
+	BenchRun("zclip in front", "polygon", BenchZclip);
+	BenchPolygons(true);
+	BenchRun("zclip crossing view plane", "polygon", BenchZclip);
+
+	bench_clip = clips;
+	memcpy(bench_clip, frame_zclipped, frame_clips * sizeof(clipped_polygon_type));
+	bench_count = frame_clips;
+	BenchRun("cproject frame", "polygon", BenchCproject);
+
+	bench_clip = frame_projected;
+	BenchRun("clip copy frame (xyclip overhead)", "polygon", BenchCopyClip);
+	BenchRun("xyclip frame", "polygon", BenchXyclip);
+	bench_clip = clips;
+	for (int i = 0; i < BENCH_CASES; i++) {
+		float cx = xmin + gen_uniform(&bench_state) * (xmax - xmin);
+		float cy = ymin + gen_uniform(&bench_state) * (ymax - ymin);
+		BenchShape(&bench_clip[i], 4, cx, cy, 250, 250, 2 * M_PI * gen_uniform(&bench_state));
+	}
+	bench_count = BENCH_CASES;
+	BenchRun("xyclip crossing window edges", "polygon", BenchXyclip);
+
+	// Depth sort of a frame's list, and of lists of its length in other orders:
+	static const char *orders[] = { "random", "sorted", "reversed", "equal" };
+	bench_polygon = frame_list;
+	bench_count = frame_polygons;
+	snprintf(name, sizeof(name), "z_sort frame of %d", frame_polygons);
+	BenchRun(name, "polygon", BenchZsort, frame_polygons);
+	bench_polygon = polygons;
+	for (int o = 0; o < 4; o++) {
+		snprintf(name, sizeof(name), "z_sort %s %d", orders[o], frame_polygons);
+		BenchDistances(o);
+		BenchRun(name, "polygon", BenchZsort, frame_polygons);
+	}
+
+	// Vertex transformation of a large object:
+	mesh_type mesh;
+	gen_mesh(&mesh, 1000, 500, 300, 1);
+	setmesh(&bench_object, &mesh);
+	inittrans();
+	scale(2, 2, 2);
+	rotate(10, 20, 30);
+	translate(100, -50, 1000);
+	snprintf(name, sizeof(name), "transform %d vertices", mesh.number_of_vertices);
+	BenchRun(name, "vertex", BenchTransform, mesh.number_of_vertices);
+	snprintf(name, sizeof(name), "atransform %d vertices", mesh.number_of_vertices);
+	BenchRun(name, "vertex", BenchAtransform, mesh.number_of_vertices);
+
+	// Presenting and compositing whole frames:
+	static unsigned char random[320 * 200], opaque[320 * 200], clear[320 * 200];
+	for (int i = 0; i < 320 * 200; i++) {
+		random[i] = gen_random(&bench_state);
+		opaque[i] = 1 + i % 255;
+		clear[i] = 0;
+	}
+	bench_src = random;
+	BenchRun("RETRO_Flip palette conversion 320x200", "frame", BenchPaletteConvert);
+	bench_src = opaque;
+	BenchRun("RETRO_BitBlit opaque 320x200", "frame", BenchBitBlit);
+	bench_src = clear;
+	BenchRun("RETRO_BitBlit transparent 320x200", "frame", BenchBitBlit);
+	for (int i = 0; i < 320 * 200; i++) {
+		random[i] = (gen_random(&bench_state) & 1) ? random[i] | 1 : 0;
+	}
+	bench_src = random;
+	BenchRun("RETRO_BitBlit half transparent at random", "frame", BenchBitBlit);
+	if (BenchFile("assets/ckpit01.pcx")) {
+		RETRO_Image cockpit;
+		RETRO_DecodeImage(&cockpit, bench_file, bench_size, bench_path);
+		if (cockpit.width * cockpit.height == 320 * 200) {
+			bench_src = cockpit.data;
+			BenchRun("RETRO_BitBlit cockpit", "frame", BenchBitBlit);
+		}
+	}
+
+	// Image decoding, from memory and with the file read that
+	//  RETRO_LoadImage() does:
+	static const char *images[] = { "assets/title.pcx", "assets/ckpit01.pcx", "assets/doodads.pcx" };
+	for (int i = 0; i < 3; i++) {
+		if (BenchFile(images[i])) {
+			snprintf(name, sizeof(name), "RETRO_DecodeImage %s", basename((char *)images[i]));
+			BenchRun(name, "image", BenchDecodeImage);
+			snprintf(name, sizeof(name), "RETRO_LoadImage read and decode %s", basename((char *)images[i]));
+			BenchRun(name, "image", BenchReadDecodeImage);
+		}
+	}
+
+	// World parsing, of the demo world and of a larger generated one:
+	world_type world;
+	if (BenchFile("assets/fof2.wld")) {
+		int polycount = loadpoly(&world, bench_path);
+		unloadpoly(&world);
+		BenchRun("loadpoly fof2.wld", "polygon", BenchLoadpoly, polycount);
+	}
+	char *path = (char *)"/tmp/fofbench.wld";
+	FILE *fp = fopen(path, "wt");
+	if (fp) {
+		worldgen_type gen = { .seed = 1, .objects = 200, .polygons = 48, .area = 16384, .distribution = GEN_UNIFORM, .overlap = 0.5 };
+		int polycount = generate_world(&gen, fp);
+		fclose(fp);
+		bench_path = path;
+		snprintf(name, sizeof(name), "loadpoly generated %d polygons", polycount);
+		BenchRun(name, "polygon", BenchLoadpoly, polycount);
+		remove(path);
+	}
+}
+
+void BenchParseArguments(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"filter", required_argument, 0, 'f'},
+		{"list", no_argument, 0, 'l'},
+		{"repetitions", required_argument, 0, 'r'},
+		{"warmup", required_argument, 0, 'w'},
+		{"batch", required_argument, 0, 'b'},
+		{"csv", required_argument, 0, 0},
+		{0, 0, 0, 0} };
+	bool usage = false;
+	int c;
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, ":hf:lr:w:b:", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 0:
+			if (strcmp("csv", long_options[option_index].name) == 0) {
+				BENCH.csv = optarg;
+			}
+			break;
+		case 'f':
+			BENCH.filter = optarg;
+			break;
+		case 'l':
+			BENCH.list = true;
+			break;
+		case 'r':
+			BENCH.repetitions = atoi(optarg);
+			break;
+		case 'w':
+			BENCH.warmup = atoi(optarg);
+			break;
+		case 'b':
+			BENCH.batch = atoi(optarg);
+			break;
+		case '?':
+			printf("unrecognized option '%s'\n", argv[optind - 1]);
+			usage = true;
+			break;
+		default:
+			usage = true;
+			break;
+		}
+	}
+	if (BENCH.repetitions <= 0 || BENCH.repetitions > BENCH_SAMPLES || BENCH.warmup < 0 || BENCH.batch <= 0 || optind != argc) {
+		usage = true;
+	}
+	if (usage) {
+		printf("Usage: %s [OPTION]...\n\n", basename(argv[0]));
+		printf("Options:\n");
+		printf(" -h, --help           Display this text and exit\n");
+		printf(" -f, --filter=TEXT    Only run the benchmarks whose names contain TEXT\n");
+		printf(" -l, --list           List the benchmarks instead of running them\n");
+		printf(" -r, --repetitions=N  Timed batches per benchmark, up to %d (default 30)\n", BENCH_SAMPLES);
+		printf(" -w, --warmup=MS      Untimed runs before the batches (default 200)\n");
+		printf(" -b, --batch=MS       Time each batch aims to take (default 10)\n");
+		printf("     --csv=FILE       Write the results to FILE\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	BenchParseArguments(argc, argv);
+
+	if (BENCH.csv) {
+		BENCH.csvfile = fopen(BENCH.csv, "wt");
+		if (BENCH.csvfile == NULL) {
+			RETRO_RageQuit("Cannot open file: %s\n", BENCH.csv);
+		}
+		fprintf(BENCH.csvfile, "benchmark,unit,median,mean,sd,min,kept,batches\n");
+	}
+	BenchAll();
+	if (BENCH.csvfile) {
+		fclose(BENCH.csvfile);
+	}
+	if (!BENCH.list) {
+		printf("%d benchmarks, ns per unit; mean and sd without the rejected batches\n", BENCH.run);
+	}
+	return 0;
+}
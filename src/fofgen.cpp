@@ -0,0 +1,82 @@
+//
+// fofgen.c
+//
+// Generates a synthetic world definition file of any size, for testing how
+// the renderer and the tools scale. See worldgen.h. Run foftile on the
+// result to stream it with --tiles.
+//
+#include "lib/retro.h"
+#include "fix.h"
+#include "screen.h"
+#include "poly.h"
+#include "view.h"
+#include "worldgen.h"
+
+static struct {
+	char *output;              // world to write
+	worldgen_type gen;
+} GEN = { .output = (char *)"assets/gen.wld", .gen = { .seed = 1, .objects = 1000, .polygons = 24, .area = 32768, .distribution = GEN_UNIFORM, .overlap = 0.5 } };
+
+void GenParseArguments(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"output", required_argument, 0, 'o'},
+		{"objects", required_argument, 0, 'n'},
+		GEN_LONG_OPTIONS,
+		{0, 0, 0, 0} };
+	worldgen_type defaults = GEN.gen;
+	bool usage = false;
+	int c;
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, ":ho:n:" GEN_SHORT_OPTIONS, long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'o':
+			GEN.output = optarg;
+			break;
+		case 'n':
+			GEN.gen.objects = atoi(optarg);
+			break;
+		case '?':
+			printf("unrecognized option '%s'\n", argv[optind - 1]);
+			usage = true;
+			break;
+		default:
+			if (!gen_option(&GEN.gen, c, optarg)) {
+				usage = true;
+			}
+			break;
+		}
+	}
+	if (!gen_valid(&GEN.gen)) {
+		usage = true;
+	}
+	if (optind != argc) {
+		usage = true;
+	}
+	if (usage) {
+		printf("Usage: %s [OPTION]...\n\n", basename(argv[0]));
+		printf("Options:\n");
+		printf(" -h, --help           Display this text and exit\n");
+		printf(" -o, --output=FILE    Write the world to FILE (default assets/gen.wld)\n");
+		printf(" -n, --objects=N      Number of objects (default %d)\n", defaults.objects);
+		gen_usage(&defaults);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	GenParseArguments(argc, argv);
+
+	FILE *fp = fopen(GEN.output, "wt");
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", GEN.output);
+	}
+	int polycount = generate_world(&GEN.gen, fp);
+	if (fclose(fp)) {
+		RETRO_RageQuit("Cannot write file: %s\n", GEN.output);
+	}
+	printf("Generated %d objects, %d polygons\n", GEN.gen.objects, polycount);
+	return 0;
+}
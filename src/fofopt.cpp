@@ -0,0 +1,521 @@
+//
+// fofopt.c
+//
+// Optimizes a world definition file. Within every mesh, vertices at the same
+// place are welded, polygons with no area and repeated polygons are dropped,
+// coplanar neighbors of the same color are merged into larger convex
+// polygons, and the vertices are renumbered in the order the polygons use
+// them, so that transforming and listing them walks memory in sequence.
+// Polygons keep their order, since it decides which of two coplanar polygons
+// is drawn on top.
+//
+#include "lib/retro.h"
+#include "fix.h"
+#include "screen.h"
+#include "poly.h"
+#include "view.h"
+#include "loadpoly.h"
+
+#define OPT_VERTICES 16        // most vertices in a polygon, leaving room to clip
+#define OPT_FLAT 1e-9          // sine of the angle below which edges or planes count as one
+
+static struct {
+	char *output;              // optimized world to write
+	bool merge;                // merge coplanar polygons
+} OPT = { .output = (char *)"assets/fof2opt.wld", .merge = true };
+
+struct opt_polygon {
+	int number_of_vertices;
+	int vertex[OPT_VERTICES];
+	int color;
+	bool dropped;
+};
+
+struct opt_edge {              // One edge of a polygon, for finding neighbors
+	int a, b;                  // Vertices in the polygon's order
+	int polygon;
+};
+
+struct opt_stats {
+	int vertices, polygons;
+	int welded, unused;
+	int degenerate, duplicate, merged;
+};
+
+static opt_stats stats;
+static long (*opt_vertex)[3];  // vertex coordinates, for the sort functions
+
+int OptCompareVertices(const void *a, const void *b)
+{
+	const long *va = opt_vertex[*(int *)a], *vb = opt_vertex[*(int *)b];
+	for (int i = 0; i < 3; i++) {
+		if (va[i] != vb[i]) {
+			return (va[i] > vb[i]) - (va[i] < vb[i]);
+		}
+	}
+	return *(int *)a - *(int *)b;
+}
+
+int OptCompareEdges(const void *a, const void *b)
+{
+	const opt_edge *ea = (opt_edge *)a, *eb = (opt_edge *)b;
+	int a1 = MIN(ea->a, ea->b), a2 = MAX(ea->a, ea->b);
+	int b1 = MIN(eb->a, eb->b), b2 = MAX(eb->a, eb->b);
+	if (a1 != b1) {
+		return a1 - b1;
+	}
+	if (a2 != b2) {
+		return a2 - b2;
+	}
+	return ea->polygon - eb->polygon;
+}
+
+// normal of a polygon by Newell's method, zero if it has no area
+void OptNormal(opt_polygon *poly, double normal[3])
+{
+	normal[0] = normal[1] = normal[2] = 0;
+	for (int i = 0; i < poly->number_of_vertices; i++) {
+		long *u = opt_vertex[poly->vertex[i]];
+		long *v = opt_vertex[poly->vertex[(i + 1) % poly->number_of_vertices]];
+		normal[0] += (double)(u[1] - v[1]) * (u[2] + v[2]);
+		normal[1] += (double)(u[2] - v[2]) * (u[0] + v[0]);
+		normal[2] += (double)(u[0] - v[0]) * (u[1] + v[1]);
+	}
+}
+
+// cross product of the edges into and out of vertex i of a polygon
+void OptCorner(opt_polygon *poly, int i, double cross[3], double *dot)
+{
+	int n = poly->number_of_vertices;
+	long *p = opt_vertex[poly->vertex[(i + n - 1) % n]];
+	long *c = opt_vertex[poly->vertex[i]];
+	long *q = opt_vertex[poly->vertex[(i + 1) % n]];
+	double ax = c[0] - p[0], ay = c[1] - p[1], az = c[2] - p[2];
+	double bx = q[0] - c[0], by = q[1] - c[1], bz = q[2] - c[2];
+	cross[0] = ay * bz - az * by;
+	cross[1] = az * bx - ax * bz;
+	cross[2] = ax * by - ay * bx;
+	*dot = ax * bx + ay * by + az * bz;
+	double length = sqrt((ax * ax + ay * ay + az * az) * (bx * bx + by * by + bz * bz));
+	if (sqrt(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]) <= OPT_FLAT * length) {
+		cross[0] = cross[1] = cross[2] = 0;
+	}
+}
+
+// drops repeated vertices and vertices where the outline runs straight on or
+// doubles back, returning false if less than a triangle is left
+bool OptStraighten(opt_polygon *poly)
+{
+	bool changed = true;
+	while (changed && poly->number_of_vertices >= 3) {
+		changed = false;
+		for (int i = 0; i < poly->number_of_vertices && poly->number_of_vertices >= 3; i++) {
+			int n = poly->number_of_vertices;
+			double cross[3], dot;
+			bool repeated = poly->vertex[i] == poly->vertex[(i + 1) % n];
+			if (!repeated) {
+				OptCorner(poly, i, cross, &dot);
+			}
+			if (repeated || (cross[0] == 0 && cross[1] == 0 && cross[2] == 0)) {
+				memmove(&poly->vertex[i], &poly->vertex[i + 1], (n - i - 1) * sizeof(int));
+				poly->number_of_vertices--;
+				changed = true;
+				i--;
+			}
+		}
+	}
+	return poly->number_of_vertices >= 3;
+}
+
+// true if every corner of a polygon turns the same way as its normal
+bool OptConvex(opt_polygon *poly)
+{
+	double normal[3];
+	OptNormal(poly, normal);
+	for (int i = 0; i < poly->number_of_vertices; i++) {
+		double cross[3], dot;
+		OptCorner(poly, i, cross, &dot);
+		if (cross[0] * normal[0] + cross[1] * normal[1] + cross[2] * normal[2] <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// true if two polygons lie in one plane and face the same way
+bool OptCoplanar(opt_polygon *p1, opt_polygon *p2)
+{
+	double n1[3], n2[3];
+	OptNormal(p1, n1);
+	OptNormal(p2, n2);
+	double l1 = sqrt(n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]);
+	double l2 = sqrt(n2[0] * n2[0] + n2[1] * n2[1] + n2[2] * n2[2]);
+	double cx = n1[1] * n2[2] - n1[2] * n2[1];
+	double cy = n1[2] * n2[0] - n1[0] * n2[2];
+	double cz = n1[0] * n2[1] - n1[1] * n2[0];
+	if (n1[0] * n2[0] + n1[1] * n2[1] + n1[2] * n2[2] <= 0 || sqrt(cx * cx + cy * cy + cz * cz) > OPT_FLAT * l1 * l2) {
+		return false;
+	}
+	long *v0 = opt_vertex[p1->vertex[0]];
+	for (int i = 0; i < p2->number_of_vertices; i++) {
+		long *v = opt_vertex[p2->vertex[i]];
+		double dx = v[0] - v0[0], dy = v[1] - v0[1], dz = v[2] - v0[2];
+		if (fabs(dx * n1[0] + dy * n1[1] + dz * n1[2]) > OPT_FLAT * l1 * sqrt(dx * dx + dy * dy + dz * dz)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// merges polygon p2 into p1 across their shared edge from a to b in p1,
+// returning false and leaving them be if the result is not a convex polygon
+bool OptMerge(opt_polygon *p1, opt_polygon *p2, int a, int b)
+{
+	opt_polygon merged = *p1;
+	merged.number_of_vertices = 0;
+	int n1 = p1->number_of_vertices, n2 = p2->number_of_vertices;
+	int i1 = 0, i2 = 0;
+	while (p1->vertex[i1] != b) {
+		i1++;
+	}
+	while (p2->vertex[i2] != a) {
+		i2++;
+	}
+
+	// Around p1 from b to a, then around p2 from after a to before b:
+	for (int i = 0; i < n1; i++) {
+		merged.vertex[merged.number_of_vertices++] = p1->vertex[(i1 + i) % n1];
+	}
+	for (int i = 1; i < n2 - 1; i++) {
+		if (merged.number_of_vertices == OPT_VERTICES) {
+			return false;
+		}
+		merged.vertex[merged.number_of_vertices++] = p2->vertex[(i2 + i) % n2];
+	}
+	if (p2->vertex[(i2 + n2 - 1) % n2] != b) {
+		return false;
+	}
+
+	// Polygons touching along more than one edge would leave a hole:
+	for (int i = 0; i < merged.number_of_vertices; i++) {
+		for (int j = i + 1; j < merged.number_of_vertices; j++) {
+			if (merged.vertex[i] == merged.vertex[j]) {
+				return false;
+			}
+		}
+	}
+	if (!OptStraighten(&merged) || !OptConvex(&merged)) {
+		return false;
+	}
+	*p1 = merged;
+	p2->dropped = true;
+	return true;
+}
+
+// merges coplanar neighbors of the same color until none are left
+void OptMergePolygons(opt_polygon *poly, int polygons)
+{
+	int edges = 0;
+	for (int p = 0; p < polygons; p++) {
+		edges += poly[p].number_of_vertices;
+	}
+	opt_edge *edge = (opt_edge *)malloc(MAX(edges, 1) * sizeof(opt_edge));
+	bool *touched = (bool *)malloc(MAX(polygons, 1) * sizeof(bool));
+	if (edge == NULL || touched == NULL) {
+		RETRO_RageQuit("Cannot allocate mesh memory\n");
+	}
+
+	bool merging = true;
+	while (merging) {
+		merging = false;
+		edges = 0;
+		for (int p = 0; p < polygons; p++) {
+			touched[p] = false;
+			for (int i = 0; !poly[p].dropped && i < poly[p].number_of_vertices; i++) {
+				edge[edges].a = poly[p].vertex[i];
+				edge[edges].b = poly[p].vertex[(i + 1) % poly[p].number_of_vertices];
+				edge[edges++].polygon = p;
+			}
+		}
+		qsort(edge, edges, sizeof(opt_edge), OptCompareEdges);
+
+		// Neighbors share an edge, run the opposite way. Each polygon is
+		//  merged once a pass, since its edges change:
+		for (int e = 0; e + 1 < edges; e++) {
+			opt_edge *e1 = &edge[e], *e2 = &edge[e + 1];
+			if (e1->a != e2->b || e1->b != e2->a) {
+				continue;
+			}
+			opt_polygon *p1 = &poly[e1->polygon], *p2 = &poly[e2->polygon];
+			if (touched[e1->polygon] || touched[e2->polygon] || p1->color != p2->color || !OptCoplanar(p1, p2)) {
+				continue;
+			}
+			if (OptMerge(p1, p2, e1->a, e1->b)) {
+				touched[e1->polygon] = touched[e2->polygon] = true;
+				stats.merged++;
+				merging = true;
+			}
+		}
+	}
+	free(edge);
+	free(touched);
+}
+
+void OptMesh(mesh_type *mesh)
+{
+	int vertices = mesh->number_of_vertices, polygons = mesh->number_of_polygons;
+	stats.vertices += vertices;
+	stats.polygons += polygons;
+	opt_vertex = (long (*)[3])malloc(MAX(vertices, 1) * sizeof(long[3]));
+	int *order = (int *)malloc(MAX(vertices, 1) * sizeof(int));
+	int *weld = (int *)malloc(MAX(vertices, 1) * sizeof(int));
+	opt_polygon *poly = (opt_polygon *)malloc(MAX(polygons, 1) * sizeof(opt_polygon));
+	if (opt_vertex == NULL || order == NULL || weld == NULL || poly == NULL) {
+		RETRO_RageQuit("Cannot allocate mesh memory\n");
+	}
+	for (int v = 0; v < vertices; v++) {
+		opt_vertex[v][0] = mesh->vertex[v].lx;
+		opt_vertex[v][1] = mesh->vertex[v].ly;
+		opt_vertex[v][2] = mesh->vertex[v].lz;
+		order[v] = v;
+	}
+
+	// Weld each vertex to the first one at the same place:
+	qsort(order, vertices, sizeof(int), OptCompareVertices);
+	for (int i = 0; i < vertices; i++) {
+		weld[order[i]] = order[i];
+		if (i > 0 && !memcmp(opt_vertex[order[i]], opt_vertex[order[i - 1]], sizeof(long[3]))) {
+			weld[order[i]] = weld[order[i - 1]];
+			stats.welded++;
+		}
+	}
+
+	// Drop polygons that have no area once welded:
+	for (int p = 0; p < polygons; p++) {
+		polygon_type *curpoly = &mesh->polygon[p];
+		if (curpoly->number_of_vertices > OPT_VERTICES) {
+			RETRO_RageQuit("Polygon has too many vertices\n");
+		}
+		poly[p].number_of_vertices = curpoly->number_of_vertices;
+		for (int i = 0; i < curpoly->number_of_vertices; i++) {
+			poly[p].vertex[i] = weld[curpoly->vertex[i] - mesh->vertex];
+		}
+		poly[p].color = curpoly->color;
+		poly[p].dropped = !OptStraighten(&poly[p]);
+		if (poly[p].dropped) {
+			stats.degenerate++;
+		}
+	}
+
+	// Drop a polygon that another one later on repeats, with the same
+	//  vertices the same way round, keeping the one drawn on top:
+	for (int p = 0; p < polygons; p++) {
+		for (int q = p + 1; q < polygons && !poly[p].dropped; q++) {
+			int n = poly[p].number_of_vertices;
+			if (poly[q].dropped || poly[q].number_of_vertices != n || poly[q].color != poly[p].color) {
+				continue;
+			}
+			for (int start = 0; start < n; start++) {
+				int i = 0;
+				while (i < n && poly[p].vertex[i] == poly[q].vertex[(start + i) % n]) {
+					i++;
+				}
+				if (i == n) {
+					poly[p].dropped = true;
+					stats.duplicate++;
+					break;
+				}
+			}
+		}
+	}
+
+	if (OPT.merge) {
+		OptMergePolygons(poly, polygons);
+	}
+
+	// Renumber the vertices in the order the polygons use them, leaving
+	//  out the ones none does:
+	int used = 0, pointers = 0, kept = 0;
+	for (int v = 0; v < vertices; v++) {
+		order[v] = -1;
+	}
+	for (int p = 0; p < polygons; p++) {
+		for (int i = 0; !poly[p].dropped && i < poly[p].number_of_vertices; i++) {
+			if (order[poly[p].vertex[i]] < 0) {
+				order[poly[p].vertex[i]] = used++;
+			}
+		}
+		if (!poly[p].dropped) {
+			pointers += poly[p].number_of_vertices;
+			kept++;
+		}
+	}
+	for (int v = 0; v < vertices; v++) {
+		if (weld[v] == v && order[v] < 0) {
+			stats.unused++;
+		}
+	}
+
+	// Build the mesh again the way loadmesh() does:
+	mesh_type optimized = *mesh;
+	optimized.number_of_vertices = used;
+	optimized.number_of_polygons = kept;
+	optimized.vertex = new vertex_type[used];
+	optimized.polygon = new polygon_type[kept];
+	optimized.pointers = pointers;
+	for (int v = 0; v < vertices; v++) {
+		if (order[v] >= 0) {
+			vertex_type *curvert = &optimized.vertex[order[v]];
+			curvert->lx = opt_vertex[v][0];
+			curvert->ly = opt_vertex[v][1];
+			curvert->lz = opt_vertex[v][2];
+			curvert->lt = 1;
+			curvert->wt = 1;
+			curvert->stamp = 0;
+		}
+	}
+	kept = 0;
+	for (int p = 0; p < polygons; p++) {
+		if (poly[p].dropped) {
+			continue;
+		}
+		polygon_type *curpoly = &optimized.polygon[kept++];
+		curpoly->number_of_vertices = poly[p].number_of_vertices;
+		curpoly->number_of_clipped_vertices = curpoly->number_of_vertices + 4;
+		curpoly->vertex = new vertex_type * [curpoly->number_of_vertices];
+		for (int i = 0; i < curpoly->number_of_vertices; i++) {
+			curpoly->vertex[i] = &optimized.vertex[order[poly[p].vertex[i]]];
+		}
+		curpoly->color = poly[p].color;
+		curpoly->sortflag = 0;
+		curpoly->light = 0;
+	}
+	find_planes(&optimized);
+	freemesh(mesh);
+	*mesh = optimized;
+
+	free(opt_vertex);
+	free(order);
+	free(weld);
+	free(poly);
+}
+
+void OptWorld(world_type *world)
+{
+	for (int i = 0; i < world->number_of_objects; i++) {
+		object_type *object = &world->obj[i];
+		if (object->shared) {
+			continue;
+		}
+		if (object->number_of_lods) {
+			for (int m = 0; m < object->number_of_lods; m++) {
+				OptMesh(&object->lod[m]);
+			}
+			setmesh(object, &object->lod[object->level]);
+			object->radius = meshradius(&object->lod[0]) * object->xscale;
+		} else {
+			mesh_type mesh;
+			getmesh(object, &mesh);
+			OptMesh(&mesh);
+			setmesh(object, &mesh);
+			object->radius = meshradius(&mesh) * object->xscale;
+		}
+	}
+	for (int m = 0; m < world->number_of_meshes; m++) {
+		OptMesh(&world->mesh[m]);
+	}
+}
+
+// counts the vertices and polygons of every mesh in a world
+void OptCount(world_type *world, int *vertices, int *polygons)
+{
+	*vertices = *polygons = 0;
+	for (int i = 0; i < world->number_of_objects; i++) {
+		mesh_type own;
+		int count;
+		mesh_type *mesh = getmeshes(&world->obj[i], &own, &count);
+		for (int m = 0; m < count && !world->obj[i].shared; m++) {
+			*vertices += mesh[m].number_of_vertices;
+			*polygons += mesh[m].number_of_polygons;
+		}
+	}
+	for (int m = 0; m < world->number_of_meshes; m++) {
+		*vertices += world->mesh[m].number_of_vertices;
+		*polygons += world->mesh[m].number_of_polygons;
+	}
+}
+
+void OptBuild(const char *filename)
+{
+	world_type world;
+	loadpoly(&world, filename);
+	long bytes = polybytes(&world);
+
+	OptWorld(&world);
+
+	FILE *fp = fopen(OPT.output, "wt");
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", OPT.output);
+	}
+	saveworld(&world, fp);
+	if (fclose(fp)) {
+		RETRO_RageQuit("Cannot write file: %s\n", OPT.output);
+	}
+
+	int vertices, polygons;
+	OptCount(&world, &vertices, &polygons);
+	printf("%-10s %10s %10s %10s\n", "", "before", "after", "change");
+	printf("%-10s %10d %10d %9.1f%%\n", "vertices", stats.vertices, vertices, 100.0 * (vertices - stats.vertices) / MAX(stats.vertices, 1));
+	printf("%-10s %10d %10d %9.1f%%\n", "polygons", stats.polygons, polygons, 100.0 * (polygons - stats.polygons) / MAX(stats.polygons, 1));
+	printf("%-10s %10ld %10ld %9.1f%%\n", "bytes", bytes, polybytes(&world), 100.0 * (polybytes(&world) - bytes) / MAX(bytes, 1));
+	printf("Welded %d vertices and left out %d unused ones\n", stats.welded, stats.unused);
+	printf("Dropped %d polygons without area and %d repeated ones, merged %d pairs\n", stats.degenerate, stats.duplicate, stats.merged);
+	unloadpoly(&world);
+}
+
+void OptParseArguments(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"output", required_argument, 0, 'o'},
+		{"nomerge", no_argument, 0, 'n'},
+		{0, 0, 0, 0} };
+	bool usage = false;
+	int c;
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, ":ho:n", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'o':
+			OPT.output = optarg;
+			break;
+		case 'n':
+			OPT.merge = false;
+			break;
+		case '?':
+			printf("unrecognized option '%s'\n", argv[optind - 1]);
+			usage = true;
+			break;
+		default:
+			usage = true;
+			break;
+		}
+	}
+	if (optind != argc - 1) {
+		usage = true;
+	}
+	if (usage) {
+		printf("Usage: %s [OPTION]... FILE\n\n", basename(argv[0]));
+		printf("Options:\n");
+		printf(" -h, --help           Display this text and exit\n");
+		printf(" -o, --output=FILE    Write the optimized world to FILE (default assets/fof2opt.wld)\n");
+		printf(" -n, --nomerge        Keep coplanar polygons apart\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	OptParseArguments(argc, argv);
+	OptBuild(argv[optind]);
+	return 0;
+}
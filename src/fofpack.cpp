@@ -0,0 +1,225 @@
+//
+// fofpack.c
+//
+// Builds an asset pack from PCX images, to be opened with RETRO_OpenPack().
+// Each image is stored decoded, as width, height, palette and pixels,
+// compressed with the LZ4 style block format read by RETRO_Unpack().
+//
+#include "lib/retro.h"
+
+static struct {
+	char *output;              // pack file to write
+	bool list;                 // list and verify packs instead
+} PACK = { .output = (char *)"assets/fof.pak" };
+
+void PackWrite32(unsigned char *dest, unsigned int value)
+{
+	for (int i = 0; i < 4; i++) {
+		dest[i] = value >> (i * 8);
+	}
+}
+
+void PackWrite64(unsigned char *dest, unsigned long long value)
+{
+	PackWrite32(dest, value);
+	PackWrite32(dest + 4, value >> 32);
+}
+
+// writes a sequence length extension, see RETRO_Unpack()
+unsigned char *PackLength(unsigned char *out, int length)
+{
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+	return out;
+}
+
+unsigned char *PackSequence(unsigned char *out, const unsigned char *literals, int count, int offset, int length)
+{
+	unsigned char *token = out++;
+	*token = MIN(count, 15) << 4;
+	if (count >= 15) {
+		out = PackLength(out, count - 15);
+	}
+	memcpy(out, literals, count);
+	out += count;
+	if (length) {
+		out[0] = offset;
+		out[1] = offset >> 8;
+		out += 2;
+		*token |= MIN(length - 4, 15);
+		if (length - 4 >= 15) {
+			out = PackLength(out, length - 19);
+		}
+	}
+	return out;
+}
+
+// greedy compressor, finding matches through a hash table of 4 byte strings.
+// dest must hold size + size / 255 + 16 bytes.
+int PackCompress(const unsigned char *src, int size, unsigned char *dest)
+{
+	static int table[1 << 12];
+	unsigned char *out = dest;
+	int anchor = 0;
+	int i = 0;
+
+	for (int h = 0; h < (1 << 12); h++) {
+		table[h] = -1;
+	}
+	while (i + 4 <= size) {
+		unsigned int v = src[i] | (src[i + 1] << 8) | (src[i + 2] << 16) | ((unsigned int)src[i + 3] << 24);
+		unsigned int h = (v * 2654435761U) >> 20;
+		int match = table[h];
+		table[h] = i;
+		if (match >= 0 && i - match <= 65535 && memcmp(&src[match], &src[i], 4) == 0) {
+			int length = 4;
+			while (i + length < size && src[match + length] == src[i + length]) {
+				length++;
+			}
+			out = PackSequence(out, &src[anchor], i - anchor, i - match, length);
+			i += length;
+			anchor = i;
+		} else {
+			i++;
+		}
+	}
+	out = PackSequence(out, &src[anchor], size - anchor, 0, 0);
+	return out - dest;
+}
+
+void PackBuild(int count, char *files[])
+{
+	FILE *fp = fopen(PACK.output, "wb");
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", PACK.output);
+	}
+
+	unsigned char header[12];
+	memcpy(header, "RPAK", 4);
+	PackWrite32(header + 4, RETRO_PACK_VERSION);
+	PackWrite32(header + 8, count);
+	unsigned char *index = (unsigned char *)calloc(count, RETRO_PACK_ENTRY);
+	if (index == NULL) {
+		RETRO_RageQuit("Cannot allocate index memory\n");
+	}
+	fwrite(header, sizeof(header), 1, fp);
+	fwrite(index, RETRO_PACK_ENTRY, count, fp);
+
+	unsigned long long offset = sizeof(header) + (unsigned long long)count * RETRO_PACK_ENTRY;
+	unsigned long total = 0;
+	for (int i = 0; i < count; i++) {
+		if (strlen(files[i]) >= RETRO_PACK_NAME) {
+			RETRO_RageQuit("File name too long: %s\n", files[i]);
+		}
+		RETRO_Image *image = RETRO_LoadImage(files[i]);
+		int size = 4 + 768 + image->width * image->height;
+		unsigned char *blob = (unsigned char *)malloc(size);
+		unsigned char *packed = (unsigned char *)malloc(size + size / 255 + 16);
+		if (blob == NULL || packed == NULL) {
+			RETRO_RageQuit("Cannot allocate image memory\n");
+		}
+		blob[0] = image->width;
+		blob[1] = image->width >> 8;
+		blob[2] = image->height;
+		blob[3] = image->height >> 8;
+		memcpy(blob + 4, image->palette, 768);
+		memcpy(blob + 4 + 768, image->data, image->width * image->height);
+		int length = PackCompress(blob, size, packed);
+		fwrite(packed, length, 1, fp);
+
+		unsigned char *entry = &index[i * RETRO_PACK_ENTRY];
+		strcpy((char *)entry, files[i]);
+		PackWrite64(entry + RETRO_PACK_NAME, offset);
+		PackWrite32(entry + RETRO_PACK_NAME + 8, length);
+		PackWrite32(entry + RETRO_PACK_NAME + 12, size);
+		PackWrite64(entry + RETRO_PACK_NAME + 16, RETRO_Hash(blob, size));
+		printf("%-40s %4dx%-4d %8d -> %8d bytes\n", files[i], image->width, image->height, size, length);
+
+		offset += length;
+		total += size;
+		free(blob);
+		free(packed);
+	}
+
+	fseek(fp, sizeof(header), SEEK_SET);
+	fwrite(index, RETRO_PACK_ENTRY, count, fp);
+	if (fclose(fp)) {
+		RETRO_RageQuit("Cannot write file: %s\n", PACK.output);
+	}
+	free(index);
+	printf("Packed %d images, %lu bytes into %llu bytes\n", count, total, offset);
+}
+
+// lists the images of a pack, decoding each one to verify its hash
+void PackList(const char *filename)
+{
+	int first = RETRO_PACKS.entries;
+	if (!RETRO_OpenPack(filename)) {
+		RETRO_RageQuit("Cannot open file: %s\n", filename);
+	}
+	for (int i = first; i < RETRO_PACKS.entries; i++) {
+		RETRO_Image *image = RETRO_AllocateImage();
+		image->entry = i;
+		RETRO_DecodePackImage(image);
+		printf("%-40s %4dx%-4d %8u -> %8u bytes, hash %016llx\n", RETRO_PACKS.entry[i].name, image->width, image->height,
+			RETRO_PACKS.entry[i].size, RETRO_PACKS.entry[i].packed, RETRO_PACKS.entry[i].hash);
+	}
+}
+
+void PackParseArguments(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"output", required_argument, 0, 'o'},
+		{"list", no_argument, 0, 'l'},
+		{0, 0, 0, 0} };
+	bool usage = false;
+	int c;
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, ":ho:l", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'o':
+			PACK.output = optarg;
+			break;
+		case 'l':
+			PACK.list = true;
+			break;
+		case '?':
+			printf("unrecognized option '%s'\n", argv[optind - 1]);
+			usage = true;
+			break;
+		default:
+			usage = true;
+			break;
+		}
+	}
+	if (optind >= argc) {
+		usage = true;
+	}
+	if (usage) {
+		printf("Usage: %s [OPTION]... FILE...\n\n", basename(argv[0]));
+		printf("Options:\n");
+		printf(" -h, --help           Display this text and exit\n");
+		printf(" -o, --output=FILE    Write the pack to FILE (default assets/fof.pak)\n");
+		printf(" -l, --list           List and verify the images in the packs FILE...\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	PackParseArguments(argc, argv);
+
+	if (PACK.list) {
+		for (int i = optind; i < argc; i++) {
+			PackList(argv[i]);
+		}
+	} else {
+		PackBuild(argc - optind, &argv[optind]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,283 @@
+//
+// fofscale.c
+//
+// Scaling benchmark. Generates worlds of growing size with worldgen.h, from
+// 10^2 to 10^6 polygons by default, loads each one and renders it headless
+// from a camera sweeping across it, timing every stage of display(). The
+// growth of each stage between sizes shows its complexity.
+//
+#include "lib/retro.h"
+#include "fix.h"
+#include "screen.h"
+#include "poly.h"
+#include "view.h"
+#include "worldgen.h"
+
+#define SCALE_SIZES 64         // most world sizes in a sweep
+#define SCALE_WIDTH 60         // characters in the widest bar of the chart
+
+static const char *stage_names[STAGES + 2] = { "clear", "query", "update", "list", "sort", "draw", "load", "grid" };
+
+struct scale_result {
+	int polygons;              // polygons in the world
+	int objects;
+	double listed;             // polygons in the list per frame
+	int frames;
+	double ms[STAGES + 2];     // per frame for the stages of display(), in all for loading and gridding
+	double total;              // per frame
+};
+
+static struct {
+	worldgen_type gen;
+	int min, max;              // polygons in the smallest and largest world
+	int steps;                 // sizes per power of ten
+	int frames;                // most frames per size
+	float seconds;             // most time spent rendering each size
+	char *csv;                 // results output file
+	scale_result result[SCALE_SIZES];
+	int sizes;
+} SCALE = { .gen = { .seed = 1, .polygons = 48, .area = 16384, .distribution = GEN_UNIFORM, .overlap = 0.5 },
+	.min = 100, .max = 1000000, .steps = 1, .frames = 100, .seconds = 5 };
+
+double ScaleSeconds(unsigned long long ticks)
+{
+	return (double)ticks / SDL_GetPerformanceFrequency();
+}
+
+void ScaleRun(scale_result *result, int polygons)
+{
+	static unsigned char screen[320 * 200];
+	worldgen_type gen = SCALE.gen;
+	gen.objects = MAX(polygons / gen.polygons, 1);
+
+	FILE *fp = tmpfile();
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open temporary file\n");
+	}
+	generate_world(&gen, fp);
+	rewind(fp);
+
+	world_type world;
+	unsigned long long start = SDL_GetPerformanceCounter();
+	result->polygons = loadobjects(&world, fp);
+	result->ms[STAGES] = 1000 * ScaleSeconds(SDL_GetPerformanceCounter() - start);
+	fclose(fp);
+	result->objects = world.number_of_objects;
+
+	start = SDL_GetPerformanceCounter();
+	initworld(result->polygons);
+	initgrid(&world);
+	result->ms[STAGES + 1] = 1000 * ScaleSeconds(SDL_GetPerformanceCounter() - start);
+
+	// The front view of the game, from above the near edge of the world,
+	//  moving across it and panning from side to side:
+	setview(159, 73, 0, 0, 319, 147, 400, 105, 11, screen);
+	for (int s = 0; s < STAGES; s++) {
+		stage_ticks[s] = 0;
+	}
+	long listed = 0;
+	int frame = 0;
+	start = SDL_GetPerformanceCounter();
+	while (frame < SCALE.frames && (frame < 3 || ScaleSeconds(SDL_GetPerformanceCounter() - start) < SCALE.seconds)) {
+		double t = (double)frame / SCALE.frames;
+		view_type view;
+		view.copx = gen.area / 4 * sin(2 * M_PI * t);
+		view.copy = -200;
+		view.copz = -gen.area / 2 - 500;
+		view.xangle = 0;
+		view.yangle = (int)(30 * sin(4 * M_PI * t) * NUMBER_OF_DEGREES / 360 + NUMBER_OF_DEGREES) % NUMBER_OF_DEGREES;
+		view.zangle = 0;
+		display(&world, view, 1);
+		listed += polylist.number_of_polygons;
+		frame++;
+	}
+	result->frames = frame;
+	result->listed = (double)listed / frame;
+	result->total = 0;
+	for (int s = 0; s < STAGES; s++) {
+		result->ms[s] = 1000 * ScaleSeconds(stage_ticks[s]) / frame;
+		result->total += result->ms[s];
+	}
+
+	freegrid();
+	unloadpoly(&world);
+}
+
+void ScaleReport()
+{
+	printf("\n%9s %8s %9s", "polygons", "objects", "listed");
+	for (int s = 0; s < STAGES + 2; s++) {
+		printf(" %8s", stage_names[s]);
+	}
+	printf(" %8s\n", "frame");
+	for (int i = 0; i < SCALE.sizes; i++) {
+		scale_result *r = &SCALE.result[i];
+		printf("%9d %8d %9.0f", r->polygons, r->objects, r->listed);
+		for (int s = 0; s < STAGES + 2; s++) {
+			printf(" %8.3f", r->ms[s]);
+		}
+		printf(" %8.3f\n", r->total);
+	}
+	printf("(milliseconds per frame; load and grid once per world)\n");
+
+	// The exponent of each stage's growth with the number of polygons,
+	//  1 for linear, 2 for quadratic:
+	printf("\n%-19s", "growth");
+	for (int s = 0; s < STAGES + 2; s++) {
+		printf(" %8s", stage_names[s]);
+	}
+	printf(" %8s\n", "frame");
+	for (int i = 1; i < SCALE.sizes; i++) {
+		scale_result *a = &SCALE.result[i - 1], *b = &SCALE.result[i];
+		double n = log((double)b->polygons / a->polygons);
+		printf("%9d-%-9d", a->polygons, b->polygons);
+		for (int s = 0; s < STAGES + 2; s++) {
+			if (a->ms[s] > 0 && b->ms[s] > 0) {
+				printf(" %8.2f", log(b->ms[s] / a->ms[s]) / n);
+			} else {
+				printf(" %8s", "-");
+			}
+		}
+		printf(" %8.2f\n", log(b->total / a->total) / n);
+	}
+
+	// Frame time on a log scale, each bar split between the stages by
+	//  their share of it, marked with their first letters:
+	double lo = INFINITY, hi = 0;
+	for (int i = 0; i < SCALE.sizes; i++) {
+		lo = MIN(lo, SCALE.result[i].total);
+		hi = MAX(hi, SCALE.result[i].total);
+	}
+	lo /= 2;
+	printf("\nframe time, log scale from %.3f to %.3f ms\n", lo, hi);
+	for (int i = 0; i < SCALE.sizes; i++) {
+		scale_result *r = &SCALE.result[i];
+		int width = SCALE_WIDTH * log(r->total / lo) / log(hi / lo);
+		char bar[SCALE_WIDTH + 1];
+		int used = 0;
+		double share = 0;
+		for (int s = 0; s < STAGES; s++) {
+			share += r->ms[s] / r->total;
+			while (used < width && used < share * width + 0.5) {
+				bar[used++] = stage_names[s][0];
+			}
+		}
+		bar[used] = 0;
+		printf("%9d |%s\n", r->polygons, bar);
+	}
+	printf("%9s  c=clear q=query u=update l=list s=sort d=draw\n", "");
+}
+
+void ScaleWriteCSV(const char *filename)
+{
+	FILE *fp = fopen(filename, "wt");
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", filename);
+	}
+	fprintf(fp, "polygons,objects,listed,frames");
+	for (int s = 0; s < STAGES + 2; s++) {
+		fprintf(fp, ",%s", stage_names[s]);
+	}
+	fprintf(fp, ",frame\n");
+	for (int i = 0; i < SCALE.sizes; i++) {
+		scale_result *r = &SCALE.result[i];
+		fprintf(fp, "%d,%d,%.1f,%d", r->polygons, r->objects, r->listed, r->frames);
+		for (int s = 0; s < STAGES + 2; s++) {
+			fprintf(fp, ",%.4f", r->ms[s]);
+		}
+		fprintf(fp, ",%.4f\n", r->total);
+	}
+	fclose(fp);
+}
+
+void ScaleParseArguments(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		GEN_LONG_OPTIONS,
+		{"min", required_argument, 0, 0},
+		{"max", required_argument, 0, 0},
+		{"steps", required_argument, 0, 0},
+		{"frames", required_argument, 0, 'f'},
+		{"time", required_argument, 0, 't'},
+		{"csv", required_argument, 0, 0},
+		{0, 0, 0, 0} };
+	worldgen_type defaults = SCALE.gen;
+	bool usage = false;
+	int c;
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, ":hf:t:" GEN_SHORT_OPTIONS, long_options, &option_index)) != -1) {
+		switch (c) {
+		case 0:
+			if (strcmp("min", long_options[option_index].name) == 0) {
+				SCALE.min = atoi(optarg);
+			} else if (strcmp("max", long_options[option_index].name) == 0) {
+				SCALE.max = atoi(optarg);
+			} else if (strcmp("steps", long_options[option_index].name) == 0) {
+				SCALE.steps = atoi(optarg);
+			} else if (strcmp("csv", long_options[option_index].name) == 0) {
+				SCALE.csv = optarg;
+			}
+			break;
+		case 'f':
+			SCALE.frames = atoi(optarg);
+			break;
+		case 't':
+			SCALE.seconds = atof(optarg);
+			break;
+		case '?':
+			printf("unrecognized option '%s'\n", argv[optind - 1]);
+			usage = true;
+			break;
+		default:
+			if (!gen_option(&SCALE.gen, c, optarg)) {
+				usage = true;
+			}
+			break;
+		}
+	}
+	if (!gen_valid(&SCALE.gen)) {
+		usage = true;
+	}
+	if (SCALE.min <= 0 || SCALE.max < SCALE.min || SCALE.steps <= 0 || SCALE.frames <= 0 || SCALE.seconds <= 0) {
+		usage = true;
+	}
+	if (optind != argc) {
+		usage = true;
+	}
+	if (usage) {
+		printf("Usage: %s [OPTION]...\n\n", basename(argv[0]));
+		printf("Options:\n");
+		printf(" -h, --help           Display this text and exit\n");
+		gen_usage(&defaults);
+		printf("     --min=N          Polygons in the smallest world (default 100)\n");
+		printf("     --max=N          Polygons in the largest world (default 1000000)\n");
+		printf("     --steps=N        World sizes per power of ten (default 1)\n");
+		printf(" -f, --frames=N       Frames rendered per world (default 100)\n");
+		printf(" -t, --time=SECONDS   Most time spent rendering each world (default 5)\n");
+		printf("     --csv=FILE       Write the results to FILE\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	ScaleParseArguments(argc, argv);
+
+	for (int i = 0; i < SCALE_SIZES; i++) {
+		int polygons = lround(SCALE.min * pow(10.0, (double)i / SCALE.steps));
+		if (polygons > SCALE.max) {
+			break;
+		}
+		ScaleRun(&SCALE.result[SCALE.sizes], polygons);
+		scale_result *r = &SCALE.result[SCALE.sizes++];
+		printf("%9d polygons: %8.3f ms per frame over %d frames\n", r->polygons, r->total, r->frames);
+		fflush(stdout);
+	}
+
+	ScaleReport();
+	if (SCALE.csv) {
+		ScaleWriteCSV(SCALE.csv);
+	}
+	return 0;
+}
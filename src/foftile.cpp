@@ -0,0 +1,213 @@
+//
+// foftile.c
+//
+// Builds a tiled world from a world definition file, to be streamed with
+// --tiles. The world is cut into square cells, and the objects whose origins
+// lie in a cell are written together as one block of world definition text,
+// so that each tile can be loaded on its own, along with the library meshes
+// its instances use. See tiles.h.
+//
+#include "lib/retro.h"
+#include "fix.h"
+#include "screen.h"
+#include "poly.h"
+#include "tiles.h"
+
+static struct {
+	char *output;              // tiled world to write
+	int cell;                  // side of a tile in world units
+} TILE = { .output = (char *)"assets/fof2.wlt", .cell = 4096 };
+
+void TileWrite32(unsigned char *dest, unsigned int value)
+{
+	for (int i = 0; i < 4; i++) {
+		dest[i] = value >> (i * 8);
+	}
+}
+
+void TileWrite64(unsigned char *dest, unsigned long long value)
+{
+	TileWrite32(dest, value);
+	TileWrite32(dest + 4, value >> 32);
+}
+
+// rounds down to a multiple of the tile size
+long long TileFloor(long long value)
+{
+	return (value >= 0 ? value : value - TILE.cell + 1) / TILE.cell * TILE.cell;
+}
+
+void TileBuild(const char *filename)
+{
+	world_type world;
+	int polycount = loadpoly(&world, filename);
+
+	long long x0 = LLONG_MAX, z0 = LLONG_MAX, x1 = LLONG_MIN, z1 = LLONG_MIN;
+	for (int i = 0; i < world.number_of_objects; i++) {
+		x0 = MIN(x0, world.obj[i].x);
+		z0 = MIN(z0, world.obj[i].z);
+		x1 = MAX(x1, world.obj[i].x);
+		z1 = MAX(z1, world.obj[i].z);
+	}
+	if (world.number_of_objects == 0) {
+		x0 = x1 = z0 = z1 = 0;
+	}
+	x0 = TileFloor(x0);
+	z0 = TileFloor(z0);
+	int columns = (x1 - x0) / TILE.cell + 1;
+	int rows = (z1 - z0) / TILE.cell + 1;
+	int tiles = columns * rows;
+
+	FILE *fp = fopen(TILE.output, "wb");
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", TILE.output);
+	}
+
+	unsigned char header[TILE_HEADER] = { 0 };
+	memcpy(header, "RWLT", 4);
+	TileWrite32(header + 4, TILE_VERSION);
+	TileWrite32(header + 8, TILE.cell);
+	TileWrite32(header + 12, columns);
+	TileWrite32(header + 16, rows);
+	TileWrite64(header + 24, x0);
+	TileWrite64(header + 32, z0);
+	unsigned char *index = (unsigned char *)calloc(tiles, TILE_ENTRY);
+	object_type *obj = (object_type *)malloc(MAX(world.number_of_objects, 1) * sizeof(object_type));
+	int *first = (int *)malloc(tiles * sizeof(int));
+	int *next = (int *)malloc(MAX(world.number_of_objects, 1) * sizeof(int));
+	mesh_type *library = (mesh_type *)malloc(MAX(world.number_of_meshes, 1) * sizeof(mesh_type));
+	int *remap = (int *)malloc(MAX(world.number_of_meshes, 1) * sizeof(int));
+	if (index == NULL || obj == NULL || first == NULL || next == NULL || library == NULL || remap == NULL) {
+		RETRO_RageQuit("Cannot allocate tile memory\n");
+	}
+
+	// Chain the objects of each tile, keeping them in world order:
+	for (int t = 0; t < tiles; t++) {
+		first[t] = -1;
+	}
+	for (int m = 0; m < world.number_of_meshes; m++) {
+		remap[m] = -1;
+	}
+	for (int i = world.number_of_objects - 1; i >= 0; i--) {
+		int t = (world.obj[i].z - z0) / TILE.cell * columns + (world.obj[i].x - x0) / TILE.cell;
+		next[i] = first[t];
+		first[t] = i;
+	}
+	fwrite(header, sizeof(header), 1, fp);
+	fwrite(index, TILE_ENTRY, tiles, fp);
+
+	int used = 0;
+	long largest = 0;
+	for (int t = 0; t < tiles; t++) {
+		// Gather the objects whose origins lie in the tile:
+		world_type tile = { 0, obj, 0, library };
+		for (int i = first[t]; i >= 0; i = next[i]) {
+			obj[tile.number_of_objects++] = world.obj[i];
+		}
+		if (tile.number_of_objects == 0) {
+			continue;
+		}
+
+		// Give it a library of just the meshes its instances use:
+		for (int i = 0; i < tile.number_of_objects; i++) {
+			if (obj[i].shared) {
+				int m = obj[i].shared - world.mesh;
+				if (remap[m] < 0) {
+					remap[m] = tile.number_of_meshes;
+					library[tile.number_of_meshes++] = world.mesh[m];
+				}
+				obj[i].shared = &library[remap[m]];
+			}
+		}
+
+		long offset = ftell(fp);
+		fprintf(fp, "%d,\t\t* Number of objects in tile %d,%d\n\n", tile.number_of_objects, t % columns, t / columns);
+		int polygons = 0;
+		for (int i = 0; i < tile.number_of_objects; i++) {
+			saveobject(&obj[i], library, fp);
+			polygons += obj[i].shared ? obj[i].shared->number_of_polygons : obj[i].number_of_polygons;
+		}
+		savelods(&tile, fp);
+		savemeshes(&tile, fp);
+		long bytes = polybytes(&tile);
+		for (int i = first[t]; i >= 0; i = next[i]) {
+			if (world.obj[i].shared) {
+				remap[world.obj[i].shared - world.mesh] = -1;
+			}
+		}
+
+		unsigned char *entry = &index[t * TILE_ENTRY];
+		TileWrite64(entry, offset);
+		TileWrite32(entry + 8, ftell(fp) - offset);
+		TileWrite32(entry + 12, tile.number_of_objects);
+		TileWrite32(entry + 16, polygons);
+		TileWrite32(entry + 20, bytes);
+		largest = MAX(largest, bytes);
+		used++;
+	}
+
+	fseek(fp, sizeof(header), SEEK_SET);
+	fwrite(index, TILE_ENTRY, tiles, fp);
+	if (fclose(fp)) {
+		RETRO_RageQuit("Cannot write file: %s\n", TILE.output);
+	}
+	printf("Tiled %d objects, %d polygons into %dx%d tiles of %d units, %d in use\n", world.number_of_objects, polycount, columns, rows, TILE.cell, used);
+	printf("Loaded world takes %ld bytes, the largest tile %ld bytes\n", polybytes(&world), largest);
+	free(index);
+	free(obj);
+	free(first);
+	free(next);
+	free(library);
+	free(remap);
+	unloadpoly(&world);
+}
+
+void TileParseArguments(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"output", required_argument, 0, 'o'},
+		{"cell", required_argument, 0, 'c'},
+		{0, 0, 0, 0} };
+	bool usage = false;
+	int c;
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, ":ho:c:", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'o':
+			TILE.output = optarg;
+			break;
+		case 'c':
+			TILE.cell = atoi(optarg);
+			if (TILE.cell <= 0) {
+				usage = true;
+			}
+			break;
+		case '?':
+			printf("unrecognized option '%s'\n", argv[optind - 1]);
+			usage = true;
+			break;
+		default:
+			usage = true;
+			break;
+		}
+	}
+	if (optind != argc - 1) {
+		usage = true;
+	}
+	if (usage) {
+		printf("Usage: %s [OPTION]... FILE\n\n", basename(argv[0]));
+		printf("Options:\n");
+		printf(" -h, --help           Display this text and exit\n");
+		printf(" -o, --output=FILE    Write the tiled world to FILE (default assets/fof2.wlt)\n");
+		printf(" -c, --cell=SIZE      Cut the world into tiles of SIZE units (default 4096)\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	TileParseArguments(argc, argv);
+	TileBuild(argv[optind]);
+	return 0;
+}
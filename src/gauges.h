@@ -9,28 +9,90 @@
 
 enum gaugeStat { gaugeInitFailed, gaugeBroken, gaugeOk };
 
+// Class Instrument is the base class of all the cockpit instruments. It keeps
+// track of the reading each instrument last drew, so that an instrument is
+// only redrawn when its reading changes, or when the cockpit has been
+// composited over it again. Before an instrument is redrawn the cockpit
+// backdrop is restored under it, and its bounding rectangle is reported to
+// the retro library as dirty. SetBackdrop() is called once per frame with the
+// cockpit image, and the first row that was not composited this frame.
+class Instrument
+{
+public:                        // PUBLICS
+	Instrument() { drawn = false; };
+	gaugeStat Status() { return(stat); };
+	void Invalidate() { drawn = false; };  // force a redraw on the next Set()
+	static void SetBackdrop(unsigned char *image, int top);
+
+protected:                     // PROTECTED
+	void SetBounds(int x1, int y1, int x2, int y2);
+	bool Changed(int newReading);  // true if the instrument must be redrawn
+	int boundX1, boundY1;          // bounding rectangle of everything the...
+	int boundX2, boundY2;          // instrument draws
+	int reading;                   // quantized reading last drawn
+	bool drawn;                    // true if reading is on screen
+	gaugeStat stat;                // current gauge status
+
+	static unsigned char *backdrop;  // cockpit image drawn under the instruments
+	static int backdropTop;          // first row not composited this frame
+};
+
+unsigned char *Instrument::backdrop;
+int Instrument::backdropTop;
+
+// A needle is drawn as a list of horizontal runs of pixels, kept in a single
+// atlas shared by all the dial instruments. Offsets are relative to the gauge
+// origin, in framebuffer bytes.
+struct needleSpan {
+	unsigned short offset;         // offset of the first pixel of the run
+	unsigned char length;          // number of pixels in the run
+};
+
+static const int NEEDLE_ROWS = 64;   // rows of the scratch buffer, more than any gauge
+
+struct needleSprite {
+	int first;                     // index of the first run in the atlas
+	int count;                     // number of runs
+};
+
 // Class DialInstruments is a virtual base class from which the specific dial
 // type instrument classes are derived below. Note that the presence of the pure
 // virtual function DialIntrument::Set() makes this a pure virtual class. As
 // such it is illegal to declare an instance of DialInstrument. Set() is redef-
 // ined in class-specific ways in the classes below. Also note the inline func-
 // tion DialInstrument::Status().
+//
+// The constructors of the derived classes pass their needle point tables to
+// CacheNeedles(), which pre-renders a needle from the gauge center to every
+// point. Set() then draws needles with DrawNeedle() instead of Line().
 
-class DialInstrument
+class DialInstrument : public Instrument
 {
 public:                        // PUBLICS
+	DialInstrument() { sprites = NULL; spriteCount = 0; };
+	~DialInstrument() { free(sprites); };
 	virtual void Set(unsigned int) = 0;    // set a new reading
-	gaugeStat Status() { return(stat); };
 
 protected:                     // PROTECTED
+	int CacheNeedles(const unsigned char points[][2], int count);
+	void DrawNeedle(int sprite, unsigned char color);
 	int scrOrigX;                  // x,y coords where the corner of the...
 	int scrOrigY;                  // save rectangle is displayed
 	unsigned char needleColor;              // the color used to draw the needle
 	int centerX;                   // center of the gauge x coordinate
 	int centerY;                   // center of the gauge y coordinate
-	gaugeStat stat;                // current gauge status
+
+private:                       // PRIVATES
+	needleSprite *sprites;         // one sprite per cached needle position
+	int spriteCount;
+
+	static needleSpan *atlas;      // runs of all the cached needles
+	static int atlasCount;
 };
 
+needleSpan *DialInstrument::atlas;
+int DialInstrument::atlasCount;
+
 // Class FuelGauge. Publicly derived from DialInstrument. Control class for the
 // cockpit fuel gauge display. The constructor takes the screen origin for the
 // gauge in origX and origY, the size of the fuel tank in tankSize, the current
@@ -49,6 +111,7 @@ public:                        // PUBLICS
 
 private:                       // PRIVATES
 	unsigned char sizeOfTank;               // size of fuel tank in gallons
+	int needles;                            // first cached needle
 };
 
 // Class Altimeter, publicly derived from class DialInstrument. Control class
@@ -60,6 +123,10 @@ class Altimeter : public DialInstrument
 public:                        // PUBLICS
 	Altimeter(int origX, int origY, unsigned char nColor);
 	void Set(unsigned int feet);
+
+private:                       // PRIVATES
+	int longNeedles;               // first cached hundreds and thousands needle
+	int shortNeedles;              // first cached tens needle
 };
 
 // Class KphDial, publicly derived from class DialInstrument. Control class
@@ -71,6 +138,9 @@ class KphDial : public DialInstrument
 public:                        // PUBLICS
 	KphDial(int origX, int origY, unsigned char nColor);
 	void Set(unsigned int speed);
+
+private:                       // PRIVATES
+	int needles;                   // first cached needle
 };
 
 // Class RpmGauge, publicly derived from class DialInstrument. Control class
@@ -82,36 +152,35 @@ class RpmGauge : public DialInstrument
 public:
 	RpmGauge(int origX, int origY, unsigned char nColor);
 	void Set(unsigned int rpms);
+
+private:
+	int needles;                   // first cached needle
 };
 
-// Class SlipGauge. Not currently derived from anything, but we may yet get a
-// virtual base class that encompasses all the instruments. Control class for
+// Class SlipGauge, publicly derived from class Instrument. Control class for
 // the cockpit slip indicator display. Constructor takes an x and y screen
 // origin for the gauge. Set() takes a deflection value where 0 places the ball
 // at rest in the center, -9 is full deflection to the left, and 9 is full def-
 // lection to the right.
-class SlipGauge
+class SlipGauge : public Instrument
 {
 public:                          // PUBLICS
 	SlipGauge(int origX, int origY, unsigned char *image);
 	void Set(int deflection);
-	gaugeStat Status() { return (stat); };
 
 private:                         // PRIVATES
 	unsigned char ballFrame[40];              // storage for the ball sprite
 	int scrOrigX;                    // x,y coords where the corner of the...
 	int scrOrigY;                    // save rectangle is displayed
-	gaugeStat stat;                  // current gauge status
 };
 
 // class Compass. Class for control of the compass instrument.
-class Compass
+class Compass : public Instrument
 {
 public:
 	Compass(int origX, int origY, unsigned char *image);
 	~Compass();
 	void Set(unsigned int heading);
-	gaugeStat Status() { return(stat); };
 
 private:
 	unsigned char *cStrip;                    // storage for the compass strip
@@ -122,22 +191,19 @@ private:
 	int stripWid;                    // width of the compass strip
 	int stripDep;                    // depth of the compass strip
 	unsigned char lastDir;                    // last valid heading
-	gaugeStat stat;                  // current gauge status
 
 	void BlitBox(unsigned int centerX); // used to display the heading
 };
 
 // class IgnitionSwitch, for control of the ignition switch and indicator light
-class IgnitionSwitch
+class IgnitionSwitch : public Instrument
 {
 public:
 	IgnitionSwitch(unsigned char *image);
 	~IgnitionSwitch();
 	void Set(unsigned char onOff);
-	gaugeStat Status() { return(stat); };
 
 private:
-	gaugeStat stat;
 	unsigned char *switch_on_map;
 	unsigned char *light_on_map;
 };
@@ -201,6 +267,103 @@ const unsigned char slipPoints[19][2] = { {4, 1},  {10, 2}, {16, 3},
 								{87, 4}, {93, 3}, {99, 3},
 								{105, 1} };
 
+//-------+---------+---------+---------+---------+---------+---------+---------+
+// CLASS: Instrument, member function definitions
+//-------+---------+---------+---------+---------+---------+---------+---------+
+
+// sets the cockpit image to restore under redrawn instruments. Rows from top
+// down have not been composited this frame, so only they need restoring.
+void Instrument::SetBackdrop(unsigned char *image, int top)
+{
+	backdrop = image;
+	backdropTop = top;
+}
+
+// sets the bounding rectangle of everything the instrument draws
+void Instrument::SetBounds(int x1, int y1, int x2, int y2)
+{
+	boundX1 = x1;
+	boundY1 = y1;
+	boundX2 = x2;
+	boundY2 = y2;
+}
+
+// this function is called by Set() with the new quantized reading. It returns
+// false if the reading on screen is still valid. Otherwise it restores the
+// backdrop under the instrument, marks it dirty, and returns true.
+bool Instrument::Changed(int newReading)
+{
+	if (drawn && (newReading == reading) && (boundY1 >= backdropTop)) {
+		return false;
+	}
+	reading = newReading;
+	drawn = true;
+	for (int row = MAX(boundY1, backdropTop); row <= boundY2; row++) {
+		memcpy(&RETRO.framebuffer[(row * 320) + boundX1], &backdrop[(row * 320) + boundX1], (boundX2 - boundX1) + 1);
+	}
+	RETRO_MarkDirty(boundX1, boundY1, boundX2, boundY2);
+	return true;
+}
+
+//-------+---------+---------+---------+---------+---------+---------+---------+
+// CLASS: DialInstrument, member function definitions
+//-------+---------+---------+---------+---------+---------+---------+---------+
+
+// pre-renders a needle from the gauge center to each of count points, and
+// returns the sprite number of the first one. Each needle is drawn with Line()
+// into a scratch buffer, so the sprites match Line() pixel for pixel.
+int DialInstrument::CacheNeedles(const unsigned char points[][2], int count)
+{
+	unsigned char *scratch = (unsigned char *)calloc(NEEDLE_ROWS * 320, 1);
+	int first = spriteCount;
+
+	sprites = (needleSprite *)realloc(sprites, (spriteCount + count) * sizeof(needleSprite));
+	if ((scratch == NULL) || (sprites == NULL)) {
+		RETRO_RageQuit("Cannot allocate needle memory\n");
+	}
+	for (int i = 0; i < count; i++) {
+		int x1 = MIN(centerX, (int)points[i][0]);
+		int x2 = MAX(centerX, (int)points[i][0]);
+		int y1 = MIN(centerY, (int)points[i][1]);
+		int y2 = MAX(centerY, (int)points[i][1]);
+		Line(centerX, centerY, points[i][0], points[i][1], 1, scratch);
+
+		needleSprite *sprite = &sprites[spriteCount++];
+		sprite->first = atlasCount;
+		sprite->count = 0;
+		for (int y = y1; y <= y2; y++) {
+			for (int x = x1; x <= x2; x++) {
+				if (scratch[(y * 320) + x] && ((x == x1) || !scratch[(y * 320) + x - 1])) {
+					atlas = (needleSpan *)realloc(atlas, (atlasCount + 1) * sizeof(needleSpan));
+					if (atlas == NULL) {
+						RETRO_RageQuit("Cannot allocate needle memory\n");
+					}
+					atlas[atlasCount].offset = (y * 320) + x;
+					atlas[atlasCount].length = 0;
+					atlasCount++;
+					sprite->count++;
+				}
+				if (scratch[(y * 320) + x]) {
+					atlas[atlasCount - 1].length++;
+				}
+			}
+			memset(&scratch[(y * 320) + x1], 0, (x2 - x1) + 1);
+		}
+	}
+	free(scratch);
+	return first;
+}
+
+// draws a cached needle in the given color
+void DialInstrument::DrawNeedle(int sprite, unsigned char color)
+{
+	unsigned char *origin = &RETRO.framebuffer[(scrOrigY * 320) + scrOrigX];
+	needleSpan *span = &atlas[sprites[sprite].first];
+	for (int i = 0; i < sprites[sprite].count; i++, span++) {
+		memset(origin + span->offset, color, span->length);
+	}
+}
+
 //-------+---------+---------+---------+---------+---------+---------+---------+
 // CLASS: FuelGauge, member function definitions
 //-------+---------+---------+---------+---------+---------+---------+---------+
@@ -217,6 +380,8 @@ FuelGauge::FuelGauge(int origX, int origY, unsigned char tankSize, unsigned char
 	scrOrigY = origY;
 	sizeOfTank = tankSize;
 	needleColor = nColor;
+	needles = CacheNeedles(fuelPoints, 9);
+	SetBounds(origX, origY, origX + 25, origY + 10);
 	stat = gaugeOk;
 	return;
 }
@@ -225,19 +390,20 @@ FuelGauge::FuelGauge(int origX, int origY, unsigned char tankSize, unsigned char
 void FuelGauge::Set(unsigned int newGals)
 {
 	unsigned char eighthTank = sizeOfTank / 8;
-	int i, pX, pY;
+	int i, point = 8;  // full, if over the top mark
 	for (i = 0; i < 9; i++) {
 		if ((i * eighthTank) > newGals) {
-			pX = fuelPoints[i - 1][0];
-			pY = fuelPoints[i - 1][1];
+			point = i - 1;
 			break;
 		} else if ((i * eighthTank) == newGals) {
-			pX = fuelPoints[i][0];
-			pY = fuelPoints[i][1];
+			point = i;
 			break;
 		}
 	}
-	Line((scrOrigX + centerX), (scrOrigY + centerY), (scrOrigX + pX), (scrOrigY + pY), needleColor);
+	if (!Changed(point)) {
+		return;
+	}
+	DrawNeedle(needles + point, needleColor);
 	return;
 }
 
@@ -253,6 +419,9 @@ Altimeter::Altimeter(int origX, int origY, unsigned char nColor)
 	scrOrigX = origX;
 	scrOrigY = origY;
 	needleColor = nColor;
+	longNeedles = CacheNeedles(altTPoints, 20);
+	shortNeedles = CacheNeedles(altHPoints, 40);
+	SetBounds(origX, origY, origX + 38, origY + 30);
 	stat = gaugeOk;
 	return;
 }
@@ -260,24 +429,20 @@ Altimeter::Altimeter(int origX, int origY, unsigned char nColor)
 // this function sets the instrument reading, feet - number of feet
 void Altimeter::Set(unsigned int feet)
 {
-	int hPX, hPY, tPX, tPY, fPX, fPY;
-	int temp;
+	int tIdx, hIdx, fIdx;
 
 	feet = (feet % 10000);
-	temp = (feet / 500);
-	tPX = altTPoints[temp][0];
-	tPY = altTPoints[temp][1];
+	tIdx = (feet / 500);
 	feet = (feet % 1000);
-	temp = (feet / 50);
-	hPX = altTPoints[temp][0];
-	hPY = altTPoints[temp][1];
+	hIdx = (feet / 50);
 	feet = (feet % 100);
-	temp = (feet / 2.5);
-	fPX = altHPoints[temp][0];
-	fPY = altHPoints[temp][1];
-	Line((scrOrigX + centerX), (scrOrigY + centerY), (scrOrigX + hPX), (scrOrigY + hPY), needleColor);
-	Line((scrOrigX + centerX), (scrOrigY + centerY), (scrOrigX + tPX), (scrOrigY + tPY), 7);
-	Line((scrOrigX + centerX), (scrOrigY + centerY), (scrOrigX + fPX), (scrOrigY + fPY), 12);
+	fIdx = (feet / 2.5);
+	if (!Changed((((tIdx * 20) + hIdx) * 40) + fIdx)) {
+		return;
+	}
+	DrawNeedle(longNeedles + hIdx, needleColor);
+	DrawNeedle(longNeedles + tIdx, 7);
+	DrawNeedle(shortNeedles + fIdx, 12);
 
 	return;
 }
@@ -295,6 +460,8 @@ KphDial::KphDial(int origX, int origY, unsigned char nColor)
 	scrOrigX = origX;
 	scrOrigY = origY;
 	needleColor = nColor;
+	needles = CacheNeedles(mphPoints, 32);
+	SetBounds(origX, origY, origX + 42, origY + 32);
 	stat = gaugeOk;
 	return;
 }
@@ -302,7 +469,6 @@ KphDial::KphDial(int origX, int origY, unsigned char nColor)
 // this function sets the instrument reading, speed - speed in mph
 void KphDial::Set(unsigned int speed)
 {
-	int pX, pY;
 	if (speed > 175) {
 		speed = 175;
 	}
@@ -313,9 +479,10 @@ void KphDial::Set(unsigned int speed)
 	} else {
 		speed = (speed / 5) - 4;
 	}
-	pX = mphPoints[speed][0];
-	pY = mphPoints[speed][1];
-	Line((scrOrigX + centerX), (scrOrigY + centerY), (scrOrigX + pX), (scrOrigY + pY), needleColor);
+	if (!Changed(speed)) {
+		return;
+	}
+	DrawNeedle(needles + speed, needleColor);
 	return;
 }
 
@@ -331,6 +498,8 @@ RpmGauge::RpmGauge(int origX, int origY, unsigned char nColor)
 	scrOrigX = origX;
 	scrOrigY = origY;
 	needleColor = nColor;
+	needles = CacheNeedles(rpmPoints, 17);
+	SetBounds(origX, origY, origX + 26, origY + 22);
 	stat = gaugeOk;
 	return;
 }
@@ -338,12 +507,12 @@ RpmGauge::RpmGauge(int origX, int origY, unsigned char nColor)
 // this function sets the instrument reading, rpms - rpm in range 0..2000
 void RpmGauge::Set(unsigned int rpms)
 {
-	int pX, pY;
 	if (rpms >= 0) {
 		rpms = rpms / 125;
-		pX = rpmPoints[rpms][0];
-		pY = rpmPoints[rpms][1];
-		Line((scrOrigX + centerX), (scrOrigY + centerY), (scrOrigX + pX), (scrOrigY + pY), needleColor);
+		if (!Changed(rpms)) {
+			return;
+		}
+		DrawNeedle(needles + rpms, needleColor);
 	}
 	return;
 }
@@ -359,6 +528,7 @@ SlipGauge::SlipGauge(int origX, int origY, unsigned char *image)
 	scrOrigY = origY;
 	GetImage((scrOrigX + 55), (scrOrigY + 5), (scrOrigX + 60), (scrOrigY + 10), ballFrame, image);
 	BarFill((scrOrigX + 55), (scrOrigY + 5), (scrOrigX + 61), (scrOrigY + 10), 15);
+	SetBounds(origX + 4, origY + 1, origX + 110, origY + 10);
 	stat = gaugeOk;
 	return;
 }
@@ -370,9 +540,13 @@ void SlipGauge::Set(int deflection)
 	int pX, pY;
 
 	if ((deflection < -9) || (deflection > 9)) {
+		Changed(-1);                 // no ball
 		return;
 	}
 	deflection = deflection + 9;
+	if (!Changed(deflection)) {
+		return;
+	}
 	pX = slipPoints[deflection][0];
 	pY = slipPoints[deflection][1];
 	PutImage((scrOrigX + pX), (scrOrigY + pY), (scrOrigX + pX + 5), (scrOrigY + pY + 5), ballFrame);
@@ -395,6 +569,7 @@ Compass::Compass(int origX, int origY, unsigned char *image)
 		scrOrigX = origX;
 		scrOrigY = origY;
 		GetImage(100, 95, 219, 100, cStrip, image);
+		SetBounds(origX, origY, origX + framWid - 1, origY + framDep - 1);
 		stat = gaugeOk;
 	}
 	return;
@@ -422,6 +597,9 @@ void Compass::Set(unsigned int heading)
 		}
 		lastDir = heading;
 	}
+	if (!Changed(lastDir)) {
+		return;
+	}
 	BlitBox(lastDir);
 	return;
 }
@@ -499,6 +677,7 @@ IgnitionSwitch::IgnitionSwitch(unsigned char *image)
 	}
 	GetImage(160, 64, 171, 80, switch_on_map, image);
 	GetImage(142, 64, 151, 73, light_on_map, image);
+	SetBounds(279, 161, 296, 193);
 	stat = gaugeOk;
 	return;
 }
@@ -518,6 +697,9 @@ IgnitionSwitch::~IgnitionSwitch()
 // this function sets the instrument reading, onOff - boolean true = on
 void IgnitionSwitch::Set(unsigned char onOff)
 {
+	if (!Changed(onOff != 0)) {
+		return;
+	}
 	if (onOff) {
 		PutImage(279, 177, 290, 193, switch_on_map);
 		PutImage(287, 161, 296, 170, light_on_map);
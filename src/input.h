@@ -23,6 +23,29 @@ static int rudderPos;                     // current position of rudder
 static int stickX;                       // current stick x and y position
 static int stickY;
 
+// control recording and playback. Every frame is stored in four bytes: the
+// control key states above as a bit mask, followed by the flight model time
+// slice in ms, both little endian. Replaying a recording reproduces a flight
+// exactly, regardless of the speed of the machine it is replayed on.
+
+static const char CTL_MAGIC[4] = { 'F', 'O', 'F', 'R' };
+
+enum {
+	CTL_AILERON_LEFT = 1 << 0, CTL_AILERON_RIGHT = 1 << 1,
+	CTL_ELEVATOR_UP = 1 << 2, CTL_ELEVATOR_DOWN = 1 << 3,
+	CTL_RUDDER_RIGHT = 1 << 4, CTL_RUDDER_LEFT = 1 << 5,
+	CTL_THROTTLE_UP = 1 << 6, CTL_THROTTLE_DOWN = 1 << 7,
+	CTL_IGNITION = 1 << 8, CTL_BRAKE = 1 << 9,
+	CTL_VIEW_FORWARD = 1 << 10, CTL_VIEW_RIGHT = 1 << 11,
+	CTL_VIEW_LEFT = 1 << 12, CTL_VIEW_REAR = 1 << 13
+};
+
+static FILE *recordFile;                  // file being recorded to, if any
+static FILE *replayFile;                  // file being replayed, if any
+static unsigned short ctlKeys;            // control keys seen this frame
+static unsigned long replayFrames;        // number of frames replayed
+static unsigned long replayStart;         // performance counter at replay start
+
 // this function provides a dump of the aircraft state vector values (see the
 // struct definition in AIRCRAFT.H). If debug is true it is output
 // with the proper header and footer for a realtime dump. If debug is false
@@ -40,9 +63,9 @@ void VectorDump(state_vect *tSV)
 	printf("engine on:     %i       \n", tSV->engine_on);
 	printf("prop rpm:      %i       \n", tSV->rpm);
 	printf("fuel level:    %i       \n", tSV->fuel);
-	printf("x coordinate:  %i       \n", tSV->x_pos);
-	printf("y coordinate:  %i       \n", tSV->y_pos);
-	printf("z coordinate:  %i       \n", tSV->z_pos);
+	printf("x coordinate:  %lld       \n", tSV->x_pos);
+	printf("y coordinate:  %lld       \n", tSV->y_pos);
+	printf("z coordinate:  %lld       \n", tSV->z_pos);
 	printf("pitch:         %f       \n", tSV->pitch);
 	printf("effect. pitch: %f       \n", tSV->efAOF);
 	printf("roll:          %f       \n", tSV->roll);
@@ -88,6 +111,109 @@ void CheckKeys(state_vect *tSV)
 	}
 }
 
+// packs the control key states into a CTL_* bit mask
+unsigned short PackKeys()
+{
+	return (aileron_left ? CTL_AILERON_LEFT : 0) | (aileron_right ? CTL_AILERON_RIGHT : 0) |
+		(elevator_up ? CTL_ELEVATOR_UP : 0) | (elevator_down ? CTL_ELEVATOR_DOWN : 0) |
+		(rudder_right ? CTL_RUDDER_RIGHT : 0) | (rudder_left ? CTL_RUDDER_LEFT : 0) |
+		(throttle_up ? CTL_THROTTLE_UP : 0) | (throttle_down ? CTL_THROTTLE_DOWN : 0) |
+		(ignition_change ? CTL_IGNITION : 0) | (brake_tog ? CTL_BRAKE : 0) |
+		(view_forward ? CTL_VIEW_FORWARD : 0) | (view_right ? CTL_VIEW_RIGHT : 0) |
+		(view_left ? CTL_VIEW_LEFT : 0) | (view_rear ? CTL_VIEW_REAR : 0);
+}
+
+// sets the control key states from a CTL_* bit mask
+void UnpackKeys(unsigned short keys)
+{
+	aileron_left = keys & CTL_AILERON_LEFT;
+	aileron_right = keys & CTL_AILERON_RIGHT;
+	elevator_up = keys & CTL_ELEVATOR_UP;
+	elevator_down = keys & CTL_ELEVATOR_DOWN;
+	rudder_right = keys & CTL_RUDDER_RIGHT;
+	rudder_left = keys & CTL_RUDDER_LEFT;
+	throttle_up = keys & CTL_THROTTLE_UP;
+	throttle_down = keys & CTL_THROTTLE_DOWN;
+	ignition_change = keys & CTL_IGNITION;
+	brake_tog = keys & CTL_BRAKE;
+	view_forward = keys & CTL_VIEW_FORWARD;
+	view_right = keys & CTL_VIEW_RIGHT;
+	view_left = keys & CTL_VIEW_LEFT;
+	view_rear = keys & CTL_VIEW_REAR;
+}
+
+// opens filename for recording the flight controls
+void StartRecording(const char *filename)
+{
+	if ((recordFile = fopen(filename, "wb")) == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", filename);
+	}
+	fwrite(CTL_MAGIC, sizeof(CTL_MAGIC), 1, recordFile);
+}
+
+// opens filename for replaying the flight controls in place of the keyboard
+void StartReplay(const char *filename)
+{
+	char magic[sizeof(CTL_MAGIC)];
+
+	if ((replayFile = fopen(filename, "rb")) == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", filename);
+	}
+	if (fread(magic, sizeof(magic), 1, replayFile) != 1 || memcmp(magic, CTL_MAGIC, sizeof(magic))) {
+		RETRO_RageQuit("Cannot read file: %s\n", filename);
+	}
+}
+
+// closes any recording or replay, and reports the replay speed
+void StopRecording()
+{
+	if (recordFile) {
+		fclose(recordFile);
+		recordFile = NULL;
+	}
+	if (replayFile) {
+		fclose(replayFile);
+		replayFile = NULL;
+		if (replayFrames) {
+			double seconds = (double)(SDL_GetPerformanceCounter() - replayStart) / SDL_GetPerformanceFrequency();
+			printf("Replayed %lu frames in %.3f s (%.1f fps)\n", replayFrames, seconds, replayFrames / seconds);
+		}
+	}
+}
+
+// This function is called from GetControls() in place of CheckKeys() when
+// replaying. It loads the next recorded frame, and fixes the flight model
+// time slice to the recorded one. At the end of the recording it asks the
+// main loop to quit.
+void ReplayKeys()
+{
+	unsigned char frame[4];
+
+	if (fread(frame, sizeof(frame), 1, replayFile) != 1) {
+		UnpackKeys(0);
+		SDL_AtomicSet(&RETRO.quit, 1);
+		return;
+	}
+	if (!replayFrames++) {
+		replayStart = SDL_GetPerformanceCounter();
+	}
+	UnpackKeys(frame[0] | (frame[1] << 8));
+	SetLoopTime(frame[2] | (frame[3] << 8));
+}
+
+// This function is called from the main program after RunFModel(). It
+// appends this frame's controls and flight model time slice to the
+// recording, if there is one.
+void RecordControls()
+{
+	if (recordFile) {
+		unsigned char frame[4] = {
+			(unsigned char)ctlKeys, (unsigned char)(ctlKeys >> 8),
+			(unsigned char)loopTime, (unsigned char)(loopTime >> 8) };
+		fwrite(frame, sizeof(frame), 1, recordFile);
+	}
+}
+
 // This function is called from GetControls(). It checks the state of all
 // the flight control keys, and adjusts the values which would normally be
 // mapped to the joystick if it was in use. GetControls() only calls this
@@ -225,7 +351,12 @@ void ReduceIndices(state_vect *tSV)
 // state of the control interface.
 void GetControls(state_vect *tSV)
 {
-	CheckKeys(tSV);
+	if (replayFile) {
+		ReplayKeys();
+	} else {
+		CheckKeys(tSV);
+	}
+	ctlKeys = PackKeys();
 	CalcKeyControls();                   // no, get the keyboard controls
 	CalcStndControls(tSV);                 // go get the standard controls
 	CheckViewControls(tSV);
@@ -24,6 +24,8 @@ void __attribute__((weak)) DEMO_Initialize(void);
 void __attribute__((weak)) DEMO_Deinitialize(void);
 void __attribute__((weak)) DEMO_Render(double deltatime);
 void __attribute__((weak)) DEMO_Render2(double deltatime);
+struct RETRO_Option *__attribute__((weak)) DEMO_Options(void);
+void __attribute__((weak)) DEMO_Option(const char *name, const char *arg);
 
 // *******************************************************************
 // Private dynamic functions
@@ -40,7 +42,11 @@ void __attribute__((weak)) RETRO_Deinitialize_3D(void);
 #define RETRO_HEIGHT 200
 #define RETRO_COLORS 256
 
-#define RETRO_MAX_IMAGES 10
+#define RETRO_IMAGE_BUDGET (32 * 1024 * 1024)
+#define RETRO_PACK_VERSION 1
+#define RETRO_PACK_NAME 64
+#define RETRO_PACK_ENTRY (RETRO_PACK_NAME + 24)
+#define RETRO_MAX_DIRTY 32
 
 #define RETRO_SINCOS_ANGLE 256
 
@@ -69,11 +75,60 @@ struct RETRO_Palette {
 	unsigned char r, g, b;
 };
 
+struct RETRO_Option {
+	const char *name;
+	int has_arg;
+	const char *usage;
+};
+
+// A run of opaque pixels within one image row
+struct RETRO_Span {
+	unsigned short x;
+	unsigned short length;
+};
+
+// Run-length list of the opaque pixels of an image, row by row. The spans of
+// row y are span[row[y]] up to span[row[y + 1]].
+struct RETRO_Spans {
+	int *row;
+	RETRO_Span *span;
+	int count;
+	int width;
+	int height;
+};
+
 struct RETRO_Image {
 	RETRO_Palette palette[256];
 	unsigned char *data;
 	int width;
 	int height;
+	RETRO_Spans *spans;
+	char *path;          // file the image was loaded from, NULL if derived
+	int entry;           // asset pack entry it is decoded from, -1 if none
+	int source;          // image this one is copied from, -1 if none
+	bool mirror;         // copy is mirrored left to right
+	unsigned long used;  // RETRO.imageclock at the last use
+	int pins;            // holders of its pixels, which keep it from eviction
+};
+
+// Lock-free triple buffer. One thread writes into Back() and calls Publish(),
+// another calls Update() and reads Front(), which always holds the most
+// recently published value. Neither side ever waits for the other.
+template <typename T> struct RETRO_TripleBuffer {
+	T buffer[3];
+	int back = 0;
+	int front = 1;
+	SDL_atomic_t middle = { 2 };  // index of spare buffer, bit 2 set if fresh
+
+	T *Back(void) { return &buffer[back]; }
+	T *Front(void) { return &buffer[front]; }
+	void Publish(void) { back = SDL_AtomicSet(&middle, back | 4) & 3; }
+	bool Update(void)
+	{
+		if (!(SDL_AtomicGet(&middle) & 4)) return false;
+		front = SDL_AtomicSet(&middle, front) & 3;
+		return true;
+	}
 };
 
 // *******************************************************************
@@ -90,17 +145,33 @@ struct {
 	bool showcursor;
 	bool showfps;
 	int fpscap;
-	bool quit;
+	bool pipeline;
+	SDL_atomic_t quit;               // set by any thread to end the main loop
 	SDL_Window *window = NULL;
 	SDL_Renderer *renderer = NULL;
 	SDL_Texture *renderbuffer = NULL;
 	unsigned char *framebuffer = NULL;
 	unsigned int palette[RETRO_COLORS];
-	RETRO_Image *image[RETRO_MAX_IMAGES];
-	int images = 0;
-	const unsigned char *keystate;
-	bool keydown[256];
+	bool palettechanged = true;
+	bool dirtyrects = false;
+	int dirtycount = -1;  // -1 if the whole framebuffer is dirty
+	SDL_Rect dirty[RETRO_MAX_DIRTY];
+	RETRO_Image **image = NULL;
+	int images = 0;                  // number of image ids handed out
+	int imagecapacity = 0;
+	unsigned long imagebytes = 0;    // size of the decoded pixels in memory
+	unsigned long imagebudget = RETRO_IMAGE_BUDGET;
+	unsigned long imageclock = 0;    // counts image uses
+	unsigned long imageframe = 0;    // imageclock at the start of the frame
+	const unsigned char *keystate;   // read by the main thread only
+	bool keyheld[256];               // keystate when last published
+	SDL_atomic_t keydown[256];       // published keystate, for any thread
+	SDL_atomic_t keypresses[256];    // times each key has gone down
 	int yoffset[RETRO_HEIGHT];
+	FILE *hashlog = NULL;
+	FILE *hashcheck = NULL;
+	unsigned long frames = 0;
+	unsigned long hashmismatch = 0;
 } RETRO = { .mode = RETRO_MODE_FULLSCREEN, .vsync = true, .showfps = true };
 
 // *******************************************************************
@@ -139,6 +210,7 @@ RETRO_Palette RETRO_Get6bitColor(int color)
 void RETRO_SetColor(int color, unsigned char r, unsigned char g, unsigned char b)
 {
 	RETRO.palette[color] = (r << 16) | (g << 8) | (b);
+	RETRO.palettechanged = true;
 }
 
 void RETRO_Set6bitColor(int color, unsigned char r, unsigned char g, unsigned char b)
@@ -147,6 +219,7 @@ void RETRO_Set6bitColor(int color, unsigned char r, unsigned char g, unsigned ch
 	g = (g & 63) << 2;
 	b = (b & 63) << 2;
 	RETRO.palette[color] = (r << 16) | (g << 8) | (b);
+	RETRO.palettechanged = true;
 }
 
 void RETRO_SetPalette(RETRO_Palette *palette, int colors = RETRO_COLORS)
@@ -192,120 +265,1062 @@ void RETRO_BitBlit(unsigned char *src, int size = RETRO_WIDTH * RETRO_HEIGHT, un
 	}
 }
 
+// Same result as RETRO_BitBlit() over rows y1 to y2, but copies the opaque
+// runs of a precomputed span list with memcpy instead of testing each pixel
+void RETRO_SpanBlit(RETRO_Spans *spans, unsigned char *src, int y1 = 0, int y2 = RETRO_HEIGHT - 1, unsigned char *dest = RETRO.framebuffer)
+{
+	for (int y = y1; y <= y2; y++) {
+		int offset = y * spans->width;
+		for (int i = spans->row[y]; i < spans->row[y + 1]; i++) {
+			memcpy(&dest[offset + spans->span[i].x], &src[offset + spans->span[i].x], spans->span[i].length);
+		}
+	}
+}
+
+unsigned long long RETRO_Hash(const void *src, int size, unsigned long long seed = 0)
+{
+	// 64-bit xxHash (XXH64)
+	const unsigned long long P1 = 11400714785074694791ULL;
+	const unsigned long long P2 = 14029467366897019727ULL;
+	const unsigned long long P3 = 1609587929392839161ULL;
+	const unsigned long long P4 = 9650029242287828579ULL;
+	const unsigned long long P5 = 2870177450012600261ULL;
+	const unsigned char *p = (const unsigned char *)src;
+	const unsigned char *end = p + size;
+	unsigned long long h, k;
+	unsigned int k32;
+
+	#define RETRO_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+	#define RETRO_XXROUND(acc, in) (RETRO_ROTL64((acc) + (in) * P2, 31) * P1)
+
+	if (size >= 32) {
+		unsigned long long v1 = seed + P1 + P2;
+		unsigned long long v2 = seed + P2;
+		unsigned long long v3 = seed;
+		unsigned long long v4 = seed - P1;
+		while (p <= end - 32) {
+			memcpy(&k, p, 8); v1 = RETRO_XXROUND(v1, k); p += 8;
+			memcpy(&k, p, 8); v2 = RETRO_XXROUND(v2, k); p += 8;
+			memcpy(&k, p, 8); v3 = RETRO_XXROUND(v3, k); p += 8;
+			memcpy(&k, p, 8); v4 = RETRO_XXROUND(v4, k); p += 8;
+		}
+		h = RETRO_ROTL64(v1, 1) + RETRO_ROTL64(v2, 7) + RETRO_ROTL64(v3, 12) + RETRO_ROTL64(v4, 18);
+		h = (h ^ RETRO_XXROUND(0, v1)) * P1 + P4;
+		h = (h ^ RETRO_XXROUND(0, v2)) * P1 + P4;
+		h = (h ^ RETRO_XXROUND(0, v3)) * P1 + P4;
+		h = (h ^ RETRO_XXROUND(0, v4)) * P1 + P4;
+	} else {
+		h = seed + P5;
+	}
+	h += size;
+
+	while (p + 8 <= end) {
+		memcpy(&k, p, 8);
+		h ^= RETRO_XXROUND(0, k);
+		h = RETRO_ROTL64(h, 27) * P1 + P4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		memcpy(&k32, p, 4);
+		h ^= k32 * P1;
+		h = RETRO_ROTL64(h, 23) * P2 + P3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= *p++ * P5;
+		h = RETRO_ROTL64(h, 11) * P1;
+	}
+
+	#undef RETRO_XXROUND
+	#undef RETRO_ROTL64
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+bool RETRO_EnableDirtyRects(bool state = true)
+{
+	// With dirty rectangles the framebuffer is no longer cleared before
+	// each frame, and RETRO_Flip() only converts and uploads the parts
+	// marked with RETRO_MarkDirty(). This needs the framebuffer to persist
+	// between frames, which it does not in pipelined mode.
+	RETRO.dirtyrects = state && !RETRO.pipeline;
+	RETRO.dirtycount = -1;
+	return RETRO.dirtyrects;
+}
+
+void RETRO_MarkAllDirty(void)
+{
+	RETRO.dirtycount = -1;
+}
+
+void RETRO_MarkDirty(int x1, int y1, int x2, int y2)
+{
+	// Mark the rectangle bounded by (x1,y1) and (x2,y2) as changed
+	if (RETRO.dirtycount < 0) {
+		return;
+	}
+	if (RETRO.dirtycount == RETRO_MAX_DIRTY) {
+		RETRO_MarkAllDirty();
+		return;
+	}
+	x1 = CLAMPWIDTH(x1);
+	y1 = CLAMPHEIGHT(y1);
+	x2 = CLAMPWIDTH(x2);
+	y2 = CLAMPHEIGHT(y2);
+	if (x1 <= x2 && y1 <= y2) {
+		RETRO.dirty[RETRO.dirtycount++] = { x1, y1, x2 - x1 + 1, y2 - y1 + 1 };
+	}
+}
+
 int *RETRO_Yoffset(void)
 {
 	return RETRO.yoffset;
 }
 
-unsigned char *RETRO_ImageData(int id = 0)
+// *******************************************************************
+// Frame arena
+//
+// Scratch memory for data that only lives for one frame. RETRO_ArenaAlloc()
+// bumps a pointer through a single block, and RETRO_ResetArena() releases
+// everything at once. Should a frame need more than the block holds, the
+// rest comes from overflow blocks, which the next reset replaces with one
+// block large enough for that frame, so that steady state frames never
+// touch the heap.
+// *******************************************************************
+
+#define RETRO_ARENA_ALIGN 16
+
+struct RETRO_ArenaBlock {
+	RETRO_ArenaBlock *next;
+	size_t size;
+};
+
+struct {
+	unsigned char *block;
+	size_t size;
+	size_t used;                    // bytes used in the frame, overflow included
+	RETRO_ArenaBlock *overflow;     // blocks allocated since the last reset
+	size_t overflowused;            // bytes used in the newest overflow block
+} RETRO_ARENA;
+
+// Counting heap allocations is a debug aid. Build with RETRO_DEBUG_ALLOCS
+// defined to have the main loop check that frames after the first
+// RETRO_ALLOC_WARMUP ones render without allocating from the heap. Images
+// decoded again after eviction count as allocations too.
+#define RETRO_ALLOC_WARMUP 2
+
+#ifdef RETRO_DEBUG_ALLOCS
+#include <assert.h>
+
+static thread_local unsigned long RETRO_ALLOCS;  // heap allocations by this thread
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
 {
-	return RETRO.image[id] != NULL ? RETRO.image[id]->data : NULL;
+	RETRO_ALLOCS++;
+	return __libc_malloc(size);
 }
 
-RETRO_Palette *RETRO_ImagePalette(int id = 0)
+extern "C" void *calloc(size_t count, size_t size)
 {
-	return RETRO.image[id] != NULL ? RETRO.image[id]->palette : NULL;
+	RETRO_ALLOCS++;
+	return __libc_calloc(count, size);
 }
 
-RETRO_Image *RETRO_AllocateImage(void)
+extern "C" void *realloc(void *ptr, size_t size)
 {
-	RETRO.image[RETRO.images] = (RETRO_Image *)malloc(sizeof(RETRO_Image));
-	if (RETRO.image[RETRO.images] == NULL) {
-		RETRO_RageQuit("Cannot allocate image memory\n");
+	RETRO_ALLOCS++;
+	return __libc_realloc(ptr, size);
+}
+#else
+#include <new> // std::bad_alloc
+
+void *operator new(size_t size)
+{
+	RETRO_ALLOCS++;
+	void *ptr = malloc(size);
+	if (ptr == NULL) {
+		throw std::bad_alloc();
 	}
-	return RETRO.image[RETRO.images++];
+	return ptr;
 }
 
-void RETRO_FreeImage(int id = 0)
+void *operator new[](size_t size)
 {
-	if (RETRO.image[id]) {
-		if (RETRO.image[id]->data) {
-			free(RETRO.image[id]->data);
-			RETRO.image[id]->data = NULL;
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+#endif
+
+unsigned long RETRO_CountAllocs(void)
+{
+	return RETRO_ALLOCS;
+}
+
+void RETRO_CheckAllocs(unsigned long start, unsigned long frame)
+{
+	// Assert that nothing was allocated since RETRO_CountAllocs() returned START
+	unsigned long allocs = RETRO_ALLOCS - start;
+	if (frame >= RETRO_ALLOC_WARMUP && allocs) {
+		printf("Frame %lu: %lu heap allocations\n", frame, allocs);
+		fflush(stdout);
+		assert(allocs == 0);
+	}
+}
+#else
+unsigned long RETRO_CountAllocs(void)
+{
+	return 0;
+}
+
+void RETRO_CheckAllocs(unsigned long start, unsigned long frame)
+{
+}
+#endif
+
+void RETRO_ReserveArena(size_t size)
+{
+	// Make the arena block hold at least SIZE bytes. Only call this between
+	// frames, since it invalidates all memory handed out by the arena.
+	size = (size + RETRO_ARENA_ALIGN - 1) & ~(size_t)(RETRO_ARENA_ALIGN - 1);
+	if (size > RETRO_ARENA.size) {
+		free(RETRO_ARENA.block);
+		RETRO_ARENA.block = (unsigned char *)malloc(size);
+		if (RETRO_ARENA.block == NULL) {
+			RETRO_RageQuit("Cannot allocate arena memory\n");
 		}
-		free(RETRO.image[id]);
-		RETRO.image[id] = NULL;
-		RETRO.images--;
+		RETRO_ARENA.size = size;
 	}
 }
 
-RETRO_Image *RETRO_LoadImage(const char *filename)
+void RETRO_ResetArena(void)
 {
-	RETRO_Image *image = RETRO_AllocateImage();
+	// Release all memory handed out since the last reset
+	if (RETRO_ARENA.overflow) {
+		while (RETRO_ARENA.overflow) {
+			RETRO_ArenaBlock *next = RETRO_ARENA.overflow->next;
+			free(RETRO_ARENA.overflow);
+			RETRO_ARENA.overflow = next;
+		}
+		RETRO_ReserveArena(RETRO_ARENA.used);
+	}
+	RETRO_ARENA.used = 0;
+	RETRO_ARENA.overflowused = 0;
+}
+
+void *RETRO_ArenaAlloc(size_t size)
+{
+	size = (size + RETRO_ARENA_ALIGN - 1) & ~(size_t)(RETRO_ARENA_ALIGN - 1);
+
+	void *ptr;
+	if (!RETRO_ARENA.overflow && RETRO_ARENA.used + size <= RETRO_ARENA.size) {
+		ptr = RETRO_ARENA.block + RETRO_ARENA.used;
+	} else {
+		// The header takes up RETRO_ARENA_ALIGN bytes to keep the alignment
+		RETRO_ArenaBlock *block = RETRO_ARENA.overflow;
+		if (block == NULL || RETRO_ARENA.overflowused + size > block->size) {
+			size_t blocksize = MAX(size, RETRO_ARENA.size / 2 + 4096);
+			block = (RETRO_ArenaBlock *)malloc(RETRO_ARENA_ALIGN + blocksize);
+			if (block == NULL) {
+				RETRO_RageQuit("Cannot allocate arena memory\n");
+			}
+			block->next = RETRO_ARENA.overflow;
+			block->size = blocksize;
+			RETRO_ARENA.overflow = block;
+			RETRO_ARENA.overflowused = 0;
+		}
+		ptr = (unsigned char *)block + RETRO_ARENA_ALIGN + RETRO_ARENA.overflowused;
+		RETRO_ARENA.overflowused += size;
+	}
+	RETRO_ARENA.used += size;
+	return ptr;
+}
+
+void RETRO_FreeArena(void)
+{
+	RETRO_ResetArena();
+	free(RETRO_ARENA.block);
+	RETRO_ARENA.block = NULL;
+	RETRO_ARENA.size = 0;
+}
 
-	// Open file
+// *******************************************************************
+// Images
+//
+// Image ids index an unbounded table. Images that can be rebuilt, because
+// they come from a file, an asset pack or another image, are decoded when
+// first accessed through RETRO_ImageData() or RETRO_ImagePalette(). When
+// the decoded pixels exceed RETRO.imagebudget bytes, the least recently used
+// of them that have not been used in the current frame are evicted, to be
+// decoded again on their next access. Do not modify the pixels of such images
+// in place. Code that keeps the pixels beyond the current frame gets them
+// through RETRO_PinImage() instead, which exempts the image from eviction
+// until RETRO_UnpinImage().
+// *******************************************************************
+
+// An image in an asset pack. On disk, a pack starts with the magic "RPAK",
+// the format version and the number of entries as 32-bit little-endian
+// values, followed by the index and the compressed blobs.
+struct RETRO_PackEntry {
+	char name[RETRO_PACK_NAME];  // path the image is found by
+	unsigned long long offset;   // file offset of the compressed blob
+	unsigned int packed;         // compressed size of the blob
+	unsigned int size;           // size of the blob: width and height as
+	                             // 16-bit values, palette, pixels
+	unsigned long long hash;     // RETRO_Hash() of the uncompressed blob
+	FILE *fp;                    // pack file, not stored on disk
+};
+
+struct {
+	RETRO_PackEntry *entry;
+	int entries;
+} RETRO_PACKS;
+
+struct {
+	int *queue;
+	int queued;
+	int capacity;
+	int *decode;
+	int decodes;
+	SDL_atomic_t next;
+} RETRO_ASSETS;
+
+unsigned int RETRO_Read16(const unsigned char *src)
+{
+	return src[0] | (src[1] << 8);
+}
+
+unsigned int RETRO_Read32(const unsigned char *src)
+{
+	return src[0] | (src[1] << 8) | (src[2] << 16) | ((unsigned int)src[3] << 24);
+}
+
+unsigned long long RETRO_Read64(const unsigned char *src)
+{
+	return RETRO_Read32(src) | ((unsigned long long)RETRO_Read32(src + 4) << 32);
+}
+
+// Decompresses an LZ4 style block: sequences of a token byte holding a literal
+// length and a match length less 4, each extended by further bytes while they
+// are 255, the literals, and a 16-bit match offset. The last sequence has
+// literals only. Returns the number of bytes written, or -1 if src is corrupt.
+int RETRO_Unpack(const unsigned char *src, int srcsize, unsigned char *dest, int destsize)
+{
+	const unsigned char *end = src + srcsize;
+	unsigned char *out = dest;
+	unsigned char *outend = dest + destsize;
+
+	while (src < end) {
+		int token = *src++;
+		int length = token >> 4;
+		if (length == 15) {
+			int more;
+			do {
+				if (src >= end) {
+					return -1;
+				}
+				more = *src++;
+				length += more;
+			} while (more == 255);
+		}
+		if (length > end - src || length > outend - out) {
+			return -1;
+		}
+		memcpy(out, src, length);
+		out += length;
+		src += length;
+		if (src == end) {
+			break;
+		}
+
+		if (end - src < 2) {
+			return -1;
+		}
+		int offset = RETRO_Read16(src);
+		src += 2;
+		length = (token & 15) + 4;
+		if ((token & 15) == 15) {
+			int more;
+			do {
+				if (src >= end) {
+					return -1;
+				}
+				more = *src++;
+				length += more;
+			} while (more == 255);
+		}
+		if (offset == 0 || offset > out - dest || length > outend - out) {
+			return -1;
+		}
+		for (unsigned char *match = out - offset; length > 0; length--) {
+			*out++ = *match++;
+		}
+	}
+	return out - dest;
+}
+
+// Adds the images of an asset pack. Images are looked up in packs in the
+// order the packs were opened, before loose files. Returns false if the pack
+// cannot be opened.
+bool RETRO_OpenPack(const char *filename)
+{
 	FILE *fp = fopen(filename, "rb");
 	if (fp == NULL) {
-		RETRO_RageQuit("Cannot open file: %s\n", filename);
+		return false;
 	}
 
+	unsigned char header[12];
+	if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, "RPAK", 4) || RETRO_Read32(header + 4) != RETRO_PACK_VERSION) {
+		RETRO_RageQuit("Cannot read file: %s\n", filename);
+	}
+	int count = RETRO_Read32(header + 8);
+
+	RETRO_PACKS.entry = (RETRO_PackEntry *)realloc(RETRO_PACKS.entry, (RETRO_PACKS.entries + count) * sizeof(RETRO_PackEntry));
+	if (RETRO_PACKS.entry == NULL) {
+		RETRO_RageQuit("Cannot allocate pack memory\n");
+	}
+	for (int i = 0; i < count; i++) {
+		unsigned char index[RETRO_PACK_ENTRY];
+		if (fread(index, sizeof(index), 1, fp) != 1) {
+			RETRO_RageQuit("Cannot read file: %s\n", filename);
+		}
+		RETRO_PackEntry *entry = &RETRO_PACKS.entry[RETRO_PACKS.entries++];
+		memcpy(entry->name, index, RETRO_PACK_NAME);
+		entry->name[RETRO_PACK_NAME - 1] = 0;
+		entry->offset = RETRO_Read64(index + RETRO_PACK_NAME);
+		entry->packed = RETRO_Read32(index + RETRO_PACK_NAME + 8);
+		entry->size = RETRO_Read32(index + RETRO_PACK_NAME + 12);
+		entry->hash = RETRO_Read64(index + RETRO_PACK_NAME + 16);
+		entry->fp = fp;
+	}
+	return true;
+}
+
+int RETRO_FindPackEntry(const char *name)
+{
+	for (int i = 0; i < RETRO_PACKS.entries; i++) {
+		if (strcmp(RETRO_PACKS.entry[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void RETRO_ClosePacks(void)
+{
+	for (int i = 0; i < RETRO_PACKS.entries; i++) {
+		if (i == 0 || RETRO_PACKS.entry[i].fp != RETRO_PACKS.entry[i - 1].fp) {
+			fclose(RETRO_PACKS.entry[i].fp);
+		}
+	}
+	free(RETRO_PACKS.entry);
+	RETRO_PACKS.entry = NULL;
+	RETRO_PACKS.entries = 0;
+}
+
+RETRO_Image *RETRO_AllocateImage(void)
+{
+	if (RETRO.images == RETRO.imagecapacity) {
+		RETRO.imagecapacity = MAX(RETRO.imagecapacity * 2, 16);
+		RETRO.image = (RETRO_Image **)realloc(RETRO.image, RETRO.imagecapacity * sizeof(RETRO_Image *));
+		if (RETRO.image == NULL) {
+			RETRO_RageQuit("Cannot allocate image memory\n");
+		}
+	}
+	RETRO_Image *image = (RETRO_Image *)malloc(sizeof(RETRO_Image));
+	if (image == NULL) {
+		RETRO_RageQuit("Cannot allocate image memory\n");
+	}
+	image->data = NULL;
+	image->width = 0;
+	image->height = 0;
+	image->spans = NULL;
+	image->path = NULL;
+	image->entry = -1;
+	image->source = -1;
+	image->mirror = false;
+	image->used = ++RETRO.imageclock;
+	image->pins = 0;
+	RETRO.image[RETRO.images] = image;
+	return RETRO.image[RETRO.images++];
+}
+
+// Decodes a PCX file held in memory
+void RETRO_DecodeImage(RETRO_Image *image, const unsigned char *file, long size, const char *filename)
+{
 	// Read header
-	unsigned char header[128];
-	fread(header, 128, 1, fp);
-	if (header[0] != 10) {
+	if (size < 128 + 768 || file[0] != 10) {
 		RETRO_RageQuit("Cannot read file: %s\n", filename);
 	}
 
 	// From header data, build some image info
-	int xmin = (header[4] + (header[5] << 8));
-	int ymin = (header[6] + (header[7] << 8));
-	int xmax = (header[8] + (header[9] << 8));
-	int ymax = (header[10] + (header[11] << 8));
+	int xmin = (file[4] + (file[5] << 8));
+	int ymin = (file[6] + (file[7] << 8));
+	int xmax = (file[8] + (file[9] << 8));
+	int ymax = (file[10] + (file[11] << 8));
 
 	// Calculate the size of image
 	image->width = xmax - xmin + 1;
 	image->height = ymax - ymin + 1;
+	int size_data = image->width * image->height;
 
 	// Reserve memory
-	image->data = (unsigned char *)malloc(image->width * image->height);
+	image->data = (unsigned char *)malloc(size_data);
 	if (image->data == NULL) {
 		RETRO_RageQuit("Cannot allocate image data memory\n");
 	}
 
 	// Unpack image
+	const unsigned char *src = file + 128;
+	const unsigned char *end = file + size - 768;
 	int index = 0;
-	while (index < image->width * image->height) {
-		unsigned char data = getc(fp);
+	while (index < size_data && src < end) {
+		unsigned char data = *src++;
 		if (data < 192) {
 			image->data[index++] = data;
+		} else if (src < end) {
+			int num = MIN(data - 192, size_data - index);
+			memset(&image->data[index], *src++, num);
+			index += num;
 		} else {
-			unsigned char num = data - 192;
-			data = getc(fp);
-			while (num-- > 0) {
-				image->data[index++] = data;
-			}
+			break;
 		}
 	}
+	memset(&image->data[index], 0, size_data - index);
 
 	// Read palette from end of file
-	fseek(fp, -768, SEEK_END);
-	for (int i = 0; i < 256; i++) {
-		image->palette[i].r = fgetc(fp);
-		image->palette[i].g = fgetc(fp);
-		image->palette[i].b = fgetc(fp);
-	}
+	memcpy(image->palette, end, 768);
+}
 
-	// Close file
+// Reads a whole file into memory
+unsigned char *RETRO_ReadFile(const char *filename, long *size)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", filename);
+	}
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	unsigned char *buffer = (unsigned char *)malloc(MAX(*size, 1L));
+	if (buffer == NULL) {
+		RETRO_RageQuit("Cannot allocate file memory\n");
+	}
+	if (fread(buffer, 1, *size, fp) != (size_t)*size) {
+		RETRO_RageQuit("Cannot read file: %s\n", filename);
+	}
 	fclose(fp);
+	return buffer;
+}
 
+// Decodes an image from its asset pack entry, checking its content hash
+void RETRO_DecodePackImage(RETRO_Image *image)
+{
+	RETRO_PackEntry *entry = &RETRO_PACKS.entry[image->entry];
+	unsigned char *packed = (unsigned char *)malloc(MAX(entry->packed, 1U));
+	unsigned char *blob = (unsigned char *)malloc(MAX(entry->size, 1U));
+	if (packed == NULL || blob == NULL) {
+		RETRO_RageQuit("Cannot allocate pack memory\n");
+	}
+	if (fseek(entry->fp, entry->offset, SEEK_SET) || fread(packed, 1, entry->packed, entry->fp) != entry->packed) {
+		RETRO_RageQuit("Cannot read image: %s\n", entry->name);
+	}
+	if (RETRO_Unpack(packed, entry->packed, blob, entry->size) != (int)entry->size || RETRO_Hash(blob, entry->size) != entry->hash) {
+		RETRO_RageQuit("Corrupt image: %s\n", entry->name);
+	}
+	free(packed);
+
+	image->width = RETRO_Read16(blob);
+	image->height = RETRO_Read16(blob + 2);
+	if (entry->size != 4 + 768 + (unsigned int)(image->width * image->height)) {
+		RETRO_RageQuit("Corrupt image: %s\n", entry->name);
+	}
+	memcpy(image->palette, blob + 4, 768);
+	image->data = blob;
+	memmove(image->data, blob + 4 + 768, image->width * image->height);
+}
+
+// Evicts the least recently used images that can be decoded again, except
+// keep, until the decoded pixels fit the budget
+void RETRO_EvictImages(int keep = -1)
+{
+	while (RETRO.imagebytes > RETRO.imagebudget) {
+		int lru = -1;
+		for (int i = 0; i < RETRO.images; i++) {
+			RETRO_Image *image = RETRO.image[i];
+			if (i == keep || image == NULL || image->data == NULL || image->pins || image->used > RETRO.imageframe) {
+				continue;
+			}
+			if (image->path == NULL && image->entry < 0 && image->source < 0) {
+				continue;
+			}
+			if (lru < 0 || image->used < RETRO.image[lru]->used) {
+				lru = i;
+			}
+		}
+		if (lru < 0) {
+			break;
+		}
+		free(RETRO.image[lru]->data);
+		RETRO.image[lru]->data = NULL;
+		RETRO.imagebytes -= RETRO.image[lru]->width * RETRO.image[lru]->height;
+	}
+}
+
+RETRO_Image *RETRO_UseImage(int id);
+
+// Copies an image from its source, mirrored left to right if asked to
+void RETRO_DeriveImage(RETRO_Image *image)
+{
+	RETRO_Image *source = RETRO_UseImage(image->source);
+
+	image->width = source->width;
+	image->height = source->height;
+	memcpy(image->palette, source->palette, sizeof(image->palette));
+	image->data = (unsigned char *)malloc(image->width * image->height);
+	if (image->data == NULL) {
+		RETRO_RageQuit("Cannot allocate image data memory\n");
+	}
+	if (image->mirror) {
+		for (int y = 0; y < image->height; y++) {
+			unsigned char *src = &source->data[y * image->width];
+			unsigned char *dest = &image->data[y * image->width];
+			for (int x = 0; x < image->width; x++) {
+				dest[x] = src[image->width - 1 - x];
+			}
+		}
+	} else {
+		memcpy(image->data, source->data, image->width * image->height);
+	}
+}
+
+// Returns image id, decoding it first if it is not in memory
+RETRO_Image *RETRO_UseImage(int id)
+{
+	if (id < 0 || id >= RETRO.images || RETRO.image[id] == NULL) {
+		return NULL;
+	}
+	RETRO_Image *image = RETRO.image[id];
+	image->used = ++RETRO.imageclock;
+	if (image->data == NULL) {
+		if (image->entry >= 0) {
+			RETRO_DecodePackImage(image);
+		} else if (image->source >= 0) {
+			RETRO_DeriveImage(image);
+		} else if (image->path != NULL) {
+			long size;
+			unsigned char *file = RETRO_ReadFile(image->path, &size);
+			RETRO_DecodeImage(image, file, size, image->path);
+			free(file);
+		} else {
+			return image;
+		}
+		RETRO.imagebytes += image->width * image->height;
+		RETRO_EvictImages(id);
+	}
 	return image;
 }
 
-void RETRO_Flip(void)
+unsigned char *RETRO_ImageData(int id = 0)
+{
+	RETRO_Image *image = RETRO_UseImage(id);
+	return image != NULL ? image->data : NULL;
+}
+
+RETRO_Palette *RETRO_ImagePalette(int id = 0)
+{
+	RETRO_Image *image = RETRO_UseImage(id);
+	return image != NULL ? image->palette : NULL;
+}
+
+// Returns the pixels of image id like RETRO_ImageData(), keeping them in
+// memory until as many RETRO_UnpinImage() calls
+unsigned char *RETRO_PinImage(int id = 0)
+{
+	RETRO_Image *image = RETRO_UseImage(id);
+	if (image == NULL) {
+		return NULL;
+	}
+	image->pins++;
+	return image->data;
+}
+
+void RETRO_UnpinImage(int id = 0)
+{
+	if (id >= 0 && id < RETRO.images && RETRO.image[id] && RETRO.image[id]->pins) {
+		RETRO.image[id]->pins--;
+	}
+}
+
+RETRO_Spans *RETRO_ImageSpans(int id = 0)
+{
+	if (id < 0 || id >= RETRO.images || RETRO.image[id] == NULL) {
+		return NULL;
+	}
+	return RETRO.image[id]->spans;
+}
+
+void RETRO_SetImageBudget(unsigned long bytes)
+{
+	RETRO.imagebudget = bytes;
+	RETRO_EvictImages();
+}
+
+void RETRO_FreeSpans(int id = 0)
+{
+	if (id >= 0 && id < RETRO.images && RETRO.image[id] && RETRO.image[id]->spans) {
+		free(RETRO.image[id]->spans->row);
+		free(RETRO.image[id]->spans->span);
+		free(RETRO.image[id]->spans);
+		RETRO.image[id]->spans = NULL;
+	}
+}
+
+// Builds the span list of the pixels of image id that are not alpha. Call it
+// again if the image data changes.
+RETRO_Spans *RETRO_CreateSpans(int id = 0, int alpha = 0)
+{
+	RETRO_Image *image = RETRO_UseImage(id);
+	if (image == NULL || image->data == NULL) {
+		return NULL;
+	}
+	RETRO_FreeSpans(id);
+
+	RETRO_Spans *spans = (RETRO_Spans *)malloc(sizeof(RETRO_Spans));
+	if (spans == NULL) {
+		RETRO_RageQuit("Cannot allocate span memory\n");
+	}
+	spans->width = image->width;
+	spans->height = image->height;
+
+	// Count runs, then fill them in
+	for (int pass = 0; pass < 2; pass++) {
+		int count = 0;
+		for (int y = 0; y < image->height; y++) {
+			unsigned char *line = &image->data[y * image->width];
+			if (pass) {
+				spans->row[y] = count;
+			}
+			for (int x = 0; x < image->width; x++) {
+				if (line[x] != alpha && (x == 0 || line[x - 1] == alpha)) {
+					if (pass) {
+						spans->span[count].x = x;
+						spans->span[count].length = 0;
+					}
+					count++;
+				}
+				if (pass && line[x] != alpha) {
+					spans->span[count - 1].length++;
+				}
+			}
+		}
+		if (pass) {
+			spans->row[image->height] = count;
+		} else {
+			spans->count = count;
+			spans->row = (int *)malloc((image->height + 1) * sizeof(int));
+			spans->span = (RETRO_Span *)malloc(MAX(count, 1) * sizeof(RETRO_Span));
+			if (spans->row == NULL || spans->span == NULL) {
+				RETRO_RageQuit("Cannot allocate span memory\n");
+			}
+		}
+	}
+
+	image->spans = spans;
+	return spans;
+}
+
+void RETRO_FreeImage(int id = 0)
+{
+	RETRO_FreeSpans(id);
+	if (RETRO.image[id]) {
+		if (RETRO.image[id]->data) {
+			free(RETRO.image[id]->data);
+			RETRO.image[id]->data = NULL;
+			RETRO.imagebytes -= RETRO.image[id]->width * RETRO.image[id]->height;
+		}
+		free(RETRO.image[id]->path);
+		free(RETRO.image[id]);
+		RETRO.image[id] = NULL;
+	}
+}
+
+// *******************************************************************
+// Asset loading
+//
+// Images are queued with RETRO_QueueImage() and RETRO_QueueMirror(), which
+// return the image id right away. RETRO_LoadQueuedImages() decodes loose
+// files together on a pool of threads. Images found in an asset pack, and
+// copies and mirrors of other images, are left to be decoded on first use. A
+// path that is already loaded or queued is decoded only once; later images
+// of the same path are copies of the first.
+// *******************************************************************
+
+int RETRO_FindImage(const char *filename)
+{
+	for (int i = 0; i < RETRO.images; i++) {
+		if (RETRO.image[i] && RETRO.image[i]->path && strcmp(RETRO.image[i]->path, filename) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int RETRO_EnqueueImage(void)
+{
+	int id = RETRO.images;
+	RETRO_AllocateImage();
+	if (RETRO_ASSETS.queued == RETRO_ASSETS.capacity) {
+		RETRO_ASSETS.capacity = MAX(RETRO_ASSETS.capacity * 2, 16);
+		RETRO_ASSETS.queue = (int *)realloc(RETRO_ASSETS.queue, RETRO_ASSETS.capacity * sizeof(int));
+		if (RETRO_ASSETS.queue == NULL) {
+			RETRO_RageQuit("Cannot allocate image memory\n");
+		}
+	}
+	RETRO_ASSETS.queue[RETRO_ASSETS.queued++] = id;
+	return id;
+}
+
+int RETRO_QueueImage(const char *filename)
+{
+	int source = RETRO_FindImage(filename);
+	int id = RETRO_EnqueueImage();
+	RETRO.image[id]->path = strdup(filename);
+	RETRO.image[id]->source = source;
+	if (source < 0) {
+		RETRO.image[id]->entry = RETRO_FindPackEntry(filename);
+	}
+	return id;
+}
+
+// Queues a left to right mirror image of image source
+int RETRO_QueueMirror(int source)
+{
+	int id = RETRO_EnqueueImage();
+	RETRO.image[id]->source = source;
+	RETRO.image[id]->mirror = true;
+	return id;
+}
+
+int RETRO_AssetThread(void *data)
+{
+	int i;
+	while ((i = SDL_AtomicAdd(&RETRO_ASSETS.next, 1)) < RETRO_ASSETS.decodes) {
+		RETRO_Image *image = RETRO.image[RETRO_ASSETS.decode[i]];
+		long size;
+		unsigned char *file = RETRO_ReadFile(image->path, &size);
+		RETRO_DecodeImage(image, file, size, image->path);
+		free(file);
+	}
+	return 0;
+}
+
+void RETRO_LoadQueuedImages(void)
+{
+	RETRO_ASSETS.decode = (int *)malloc(MAX(RETRO_ASSETS.queued, 1) * sizeof(int));
+	if (RETRO_ASSETS.decode == NULL) {
+		RETRO_RageQuit("Cannot allocate image memory\n");
+	}
+	RETRO_ASSETS.decodes = 0;
+	for (int i = 0; i < RETRO_ASSETS.queued; i++) {
+		RETRO_Image *image = RETRO.image[RETRO_ASSETS.queue[i]];
+		if (image->source < 0 && image->entry < 0) {
+			RETRO_ASSETS.decode[RETRO_ASSETS.decodes++] = RETRO_ASSETS.queue[i];
+		}
+	}
+	SDL_AtomicSet(&RETRO_ASSETS.next, 0);
+
+	int threads = MIN(RETRO_ASSETS.decodes, SDL_GetCPUCount()) - 1;
+	SDL_Thread **thread = (SDL_Thread **)malloc(MAX(threads, 1) * sizeof(SDL_Thread *));
+	if (thread == NULL) {
+		RETRO_RageQuit("Cannot allocate thread memory\n");
+	}
+	for (int i = 0; i < threads; i++) {
+		if ((thread[i] = SDL_CreateThread(RETRO_AssetThread, "assets", NULL)) == NULL) {
+			RETRO_RageQuit("SDL_CreateThread failed: %s\n", SDL_GetError());
+		}
+	}
+	RETRO_AssetThread(NULL);
+	for (int i = 0; i < threads; i++) {
+		SDL_WaitThread(thread[i], NULL);
+	}
+	free(thread);
+
+	for (int i = 0; i < RETRO_ASSETS.decodes; i++) {
+		RETRO_Image *image = RETRO.image[RETRO_ASSETS.decode[i]];
+		RETRO.imagebytes += image->width * image->height;
+		image->used = ++RETRO.imageclock;
+	}
+	free(RETRO_ASSETS.decode);
+	RETRO_ASSETS.decode = NULL;
+	RETRO_ASSETS.queued = 0;
+	RETRO_EvictImages();
+}
+
+RETRO_Image *RETRO_LoadImage(const char *filename)
+{
+	int id = RETRO_QueueImage(filename);
+	RETRO_LoadQueuedImages();
+	return RETRO_UseImage(id);
+}
+
+// Converts count palette indices to pixels of the texture format
+void RETRO_PaletteConvert(const unsigned char *src, unsigned int *dest, int count)
+{
+	for (int i = 0; i < count; i++) {
+		dest[i] = RETRO.palette[src[i]];
+	}
+}
+
+void RETRO_Flip(unsigned char *buffer = RETRO.framebuffer)
 {
-	// Copy framebuffer
 	unsigned int *pixels, pitch;
-	SDL_LockTexture(RETRO.renderbuffer, NULL, (void **)&pixels, (int *)&pitch);
-	for (int i = 0; i < RETRO_WIDTH * RETRO_HEIGHT; i++) {
-		pixels[i] = RETRO.palette[RETRO.framebuffer[i]];
+	if (!RETRO.dirtyrects || RETRO.dirtycount < 0 || RETRO.palettechanged) {
+		// Copy framebuffer
+		SDL_LockTexture(RETRO.renderbuffer, NULL, (void **)&pixels, (int *)&pitch);
+		RETRO_PaletteConvert(buffer, pixels, RETRO_WIDTH * RETRO_HEIGHT);
+		SDL_UnlockTexture(RETRO.renderbuffer);
+	} else {
+		// Copy dirty rectangles only
+		for (int r = 0; r < RETRO.dirtycount; r++) {
+			SDL_Rect *rect = &RETRO.dirty[r];
+			SDL_LockTexture(RETRO.renderbuffer, rect, (void **)&pixels, (int *)&pitch);
+			for (int y = 0; y < rect->h; y++) {
+				RETRO_PaletteConvert(&buffer[RETRO.yoffset[rect->y + y] + rect->x], (unsigned int *)((unsigned char *)pixels + y * pitch), rect->w);
+			}
+			SDL_UnlockTexture(RETRO.renderbuffer);
+		}
 	}
-	SDL_UnlockTexture(RETRO.renderbuffer);
+	RETRO.dirtycount = 0;
+	RETRO.palettechanged = false;
 
 	SDL_RenderClear(RETRO.renderer);
 	SDL_RenderCopy(RETRO.renderer, RETRO.renderbuffer, NULL, NULL);
 	SDL_RenderPresent(RETRO.renderer);
 }
 
+void RETRO_HashFrame(unsigned char *buffer = RETRO.framebuffer)
+{
+	// Log and/or check the framebuffer hash of the current frame
+	unsigned long long hash = RETRO_Hash(buffer, RETRO_WIDTH * RETRO_HEIGHT);
+
+	if (RETRO.hashlog) {
+		fprintf(RETRO.hashlog, "%lu %016llx\n", RETRO.frames, hash);
+	}
+
+	if (RETRO.hashcheck) {
+		unsigned long frame;
+		unsigned long long expected;
+		if (fscanf(RETRO.hashcheck, "%lu %llx", &frame, &expected) != 2) {
+			printf("Frame %lu: no reference hash\n", RETRO.frames);
+			fclose(RETRO.hashcheck);
+			RETRO.hashcheck = NULL;
+		} else if (frame != RETRO.frames) {
+			// The rest of the log belongs to other frames, so stop checking
+			printf("Frame %lu: reference log is out of step at frame %lu\n", RETRO.frames, frame);
+			fclose(RETRO.hashcheck);
+			RETRO.hashcheck = NULL;
+			RETRO.hashmismatch++;
+		} else if (hash != expected) {
+			if (!RETRO.hashmismatch) {
+				printf("Frame %lu: hash %016llx differs from reference %016llx\n", RETRO.frames, hash, expected);
+			}
+			RETRO.hashmismatch++;
+		}
+	}
+
+	RETRO.frames++;
+}
+
+// Frame pacer for --capfps. Each frame has a deadline on the performance
+// counter. The pacer sleeps until shortly before the deadline and spins for
+// the remaining slack, since SDL_Delay() may oversleep by a millisecond or
+// more. Deadlines advance by exactly one period, so the frame rate does not
+// drift, unless a frame was so late that the pacer has to resynchronize.
+struct RETRO_FrameStats {
+	unsigned long frames;   // number of paced frames
+	unsigned long misses;   // frames that finished after their deadline
+	double mean;            // mean frame time in ms
+	double jitter;          // standard deviation of frame time in ms
+	double max;             // longest frame time in ms
+};
+
+struct {
+	double slack = 2.0;             // ms to spin instead of sleep
+	unsigned long long period;      // counter ticks per frame
+	unsigned long long deadline;    // counter value the frame is due at
+	unsigned long long last;        // counter value at the previous frame
+	unsigned long frames, misses;
+	double sum, sumsq, max;
+} RETRO_PACER;
+
+void RETRO_PaceFrame(void)
+{
+	unsigned long long freq = SDL_GetPerformanceFrequency();
+	unsigned long long now = SDL_GetPerformanceCounter();
+
+	if (RETRO.fpscap) {
+		if (!RETRO_PACER.period) {
+			RETRO_PACER.period = freq / RETRO.fpscap;
+			RETRO_PACER.deadline = now + RETRO_PACER.period;
+		}
+
+		if (now > RETRO_PACER.deadline) {
+			RETRO_PACER.misses++;
+			if (now - RETRO_PACER.deadline > RETRO_PACER.period) {
+				RETRO_PACER.deadline = now;
+			}
+		} else {
+			unsigned long long slack = RETRO_PACER.slack * freq / 1000;
+			if (RETRO_PACER.deadline - now > slack) {
+				SDL_Delay((RETRO_PACER.deadline - now - slack) * 1000 / freq);
+			}
+			while ((now = SDL_GetPerformanceCounter()) < RETRO_PACER.deadline);
+		}
+		RETRO_PACER.deadline += RETRO_PACER.period;
+	}
+
+	// Collect frame time statistics
+	if (RETRO_PACER.last) {
+		double ms = (double)(now - RETRO_PACER.last) * 1000 / freq;
+		RETRO_PACER.frames++;
+		RETRO_PACER.sum += ms;
+		RETRO_PACER.sumsq += ms * ms;
+		if (ms > RETRO_PACER.max) {
+			RETRO_PACER.max = ms;
+		}
+	}
+	RETRO_PACER.last = now;
+}
+
+RETRO_FrameStats RETRO_GetFrameStats(void)
+{
+	RETRO_FrameStats stats = { RETRO_PACER.frames, RETRO_PACER.misses, 0, 0, RETRO_PACER.max };
+	if (stats.frames) {
+		stats.mean = RETRO_PACER.sum / stats.frames;
+		stats.jitter = sqrt(MAX(RETRO_PACER.sumsq / stats.frames - stats.mean * stats.mean, 0.0));
+	}
+	return stats;
+}
+
 void RETRO_Initialize(void)
 {
 	// Initialize SDL
@@ -379,9 +1394,31 @@ void RETRO_Deinitialize(void)
 {
 	if (RETRO_Deinitialize_3D != NULL) RETRO_Deinitialize_3D();
 
-	for (int i = 0; i < RETRO_MAX_IMAGES; i++) {
+	if (RETRO.fpscap) {
+		RETRO_FrameStats stats = RETRO_GetFrameStats();
+		printf("Frame pacing: %lu frames, mean %.3f ms, jitter %.3f ms, max %.3f ms, %lu missed deadlines\n",
+			stats.frames, stats.mean, stats.jitter, stats.max, stats.misses);
+	}
+
+	for (int i = 0; i < RETRO.images; i++) {
 		RETRO_FreeImage(i);
 	}
+	free(RETRO.image);
+	RETRO.image = NULL;
+	RETRO.images = 0;
+	free(RETRO_ASSETS.queue);
+	RETRO_ClosePacks();
+	RETRO_FreeArena();
+
+	if (RETRO.hashlog) {
+		fclose(RETRO.hashlog);
+	}
+	if (RETRO.hashcheck || RETRO.hashmismatch) {
+		printf("Checked %lu frames, %lu differ from reference\n", RETRO.frames, RETRO.hashmismatch);
+		if (RETRO.hashcheck) {
+			fclose(RETRO.hashcheck);
+		}
+	}
 
 	if (RETRO.framebuffer) {
 		free(RETRO.framebuffer);
@@ -410,33 +1447,50 @@ double RETRO_DeltaTime(void)
 	return (double)(now - old) / SDL_GetPerformanceFrequency();
 }
 
+// Key states are read by the main thread along with the events, and
+// published through atomics, so that the threads of pipelined mode can
+// check them while the main thread pumps events
 bool RETRO_KeyState(SDL_Scancode key)
 {
-	return RETRO.keystate[key];
+	if (key > 255) return false;
+	return SDL_AtomicGet(&RETRO.keydown[key]);
 }
 
+// Returns true once for every time key has gone down, in each thread
 bool RETRO_KeyPressed(SDL_Scancode key)
 {
+	static thread_local int seen[256];
 	if (key > 255) return false;
-	if (RETRO.keystate[key]) {
-		if (RETRO.keydown[key]) {
-			return false;
-		} else {
-			RETRO.keydown[key] = true;
-			return true;
-		}
+	int presses = SDL_AtomicGet(&RETRO.keypresses[key]);
+	if (presses != seen[key]) {
+		seen[key] = presses;
+		return true;
 	}
-	RETRO.keydown[key] = false;
 	return false;
 }
 
+void RETRO_PublishKeys(void)
+{
+	for (int key = 0; key < 256; key++) {
+		bool down = RETRO.keystate[key];
+		if (down != RETRO.keyheld[key]) {
+			RETRO.keyheld[key] = down;
+			SDL_AtomicSet(&RETRO.keydown[key], down);
+			if (down) {
+				SDL_AtomicAdd(&RETRO.keypresses[key], 1);
+			}
+		}
+	}
+}
+
 bool RETRO_QuitRequested(void)
 {
 	SDL_PumpEvents();
 	RETRO.keystate = SDL_GetKeyboardState(NULL);
+	RETRO_PublishKeys();
 	if (SDL_QuitRequested()) {
 		return true;
-	} else if (RETRO.quit) {
+	} else if (SDL_AtomicGet(&RETRO.quit)) {
 		return true;
 	} else if (RETRO.keystate[SDL_SCANCODE_ESCAPE]) {
 		return true;
@@ -450,8 +1504,121 @@ bool RETRO_QuitRequested(void)
 // Private functions
 // *******************************************************************
 
+void RETRO_ShowFPS(void)
+{
+	// Show FPS once a second
+	if (RETRO.showfps) {
+		static unsigned long int fpsticks = SDL_GetTicks64();
+		static int fpscount = 0;
+		if (fpsticks < SDL_GetTicks64() - 1000UL) {
+			char title[128];
+			snprintf(title, 128, "RETRO - %s - FPS: %d", RETRO.basename, fpscount);
+			SDL_SetWindowTitle(RETRO.window, title);
+			fpsticks = SDL_GetTicks();
+			fpscount = 0;
+		}
+		fpscount++;
+	}
+}
+
+// In pipelined mode frames are rendered on a separate thread into one of two
+// framebuffers, while the main thread converts and presents the other one.
+struct {
+	unsigned char *framebuffer[2];
+	SDL_sem *free;        // framebuffers the render thread may draw into
+	SDL_sem *ready;       // framebuffers waiting to be presented
+	SDL_Thread *thread;
+	SDL_atomic_t quit;
+} RETRO_PIPELINE;
+
+int RETRO_RenderThread(void *data)
+{
+	int i = 0;
+	unsigned long frame = 0;
+	while (true) {
+		SDL_SemWait(RETRO_PIPELINE.free);
+		if (SDL_AtomicGet(&RETRO_PIPELINE.quit)) {
+			break;
+		}
+
+		// Pause
+		while (RETRO_KeyState(SDL_SCANCODE_SPACE) && !SDL_AtomicGet(&RETRO_PIPELINE.quit)) {
+			SDL_Delay(10);
+		}
+
+		// Render scene into the free framebuffer
+		double deltatime = RETRO_DeltaTime();
+		RETRO.imageframe = RETRO.imageclock;
+		RETRO_EvictImages();
+		RETRO.framebuffer = RETRO_PIPELINE.framebuffer[i];
+		RETRO_Clear();
+		unsigned long allocs = RETRO_CountAllocs();
+		DEMO_Render(deltatime);
+		RETRO_CheckAllocs(allocs, frame++);
+		if (RETRO.hashlog || RETRO.hashcheck) {
+			RETRO_HashFrame();
+		}
+
+		SDL_SemPost(RETRO_PIPELINE.ready);
+		i ^= 1;
+	}
+	return 0;
+}
+
+void RETRO_PipelinedMainloop(void)
+{
+	// The framebuffer from RETRO_Initialize() holds the last frame drawn
+	// by DEMO_Initialize() and becomes the first of the two framebuffers
+	RETRO_PIPELINE.framebuffer[0] = RETRO.framebuffer;
+	RETRO_PIPELINE.framebuffer[1] = (unsigned char *)malloc(RETRO_WIDTH * RETRO_HEIGHT);
+	if (RETRO_PIPELINE.framebuffer[1] == NULL) {
+		RETRO_RageQuit("Cannot allocate framebuffer memory\n");
+	}
+	memcpy(RETRO_PIPELINE.framebuffer[1], RETRO_PIPELINE.framebuffer[0], RETRO_WIDTH * RETRO_HEIGHT);
+
+	RETRO_PIPELINE.free = SDL_CreateSemaphore(2);
+	RETRO_PIPELINE.ready = SDL_CreateSemaphore(0);
+	SDL_AtomicSet(&RETRO_PIPELINE.quit, 0);
+
+	RETRO_QuitRequested();
+	RETRO_PIPELINE.thread = SDL_CreateThread(RETRO_RenderThread, "render", NULL);
+	if (RETRO_PIPELINE.thread == NULL) {
+		RETRO_RageQuit("SDL_CreateThread failed: %s\n", SDL_GetError());
+	}
+
+	int i = 0;
+	while (!RETRO_QuitRequested()) {
+		if (SDL_SemWaitTimeout(RETRO_PIPELINE.ready, 10) != 0) {
+			continue;
+		}
+
+		// Present the frame rendered last, then hand its framebuffer back
+		RETRO_Flip(RETRO_PIPELINE.framebuffer[i]);
+		SDL_SemPost(RETRO_PIPELINE.free);
+		i ^= 1;
+
+		RETRO_PaceFrame();
+		RETRO_ShowFPS();
+	}
+
+	SDL_AtomicSet(&RETRO_PIPELINE.quit, 1);
+	SDL_SemPost(RETRO_PIPELINE.free);
+	SDL_WaitThread(RETRO_PIPELINE.thread, NULL);
+	SDL_DestroySemaphore(RETRO_PIPELINE.free);
+	SDL_DestroySemaphore(RETRO_PIPELINE.ready);
+
+	RETRO.framebuffer = RETRO_PIPELINE.framebuffer[0];
+	free(RETRO_PIPELINE.framebuffer[1]);
+}
+
 void RETRO_Mainloop(void)
 {
+	if (RETRO.pipeline && DEMO_Render != NULL) {
+		RETRO_PipelinedMainloop();
+		return;
+	}
+
+	unsigned long frame = 0;
 	while (!RETRO_QuitRequested()) {
 		double deltatime = RETRO_DeltaTime();
 
@@ -460,35 +1627,26 @@ void RETRO_Mainloop(void)
 			continue;
 		}
 
-		// Render scene
-		unsigned long int start = SDL_GetTicks64();
+		// Render scene, keeping the images it uses in memory
+		RETRO.imageframe = RETRO.imageclock;
+		RETRO_EvictImages();
 		if (DEMO_Render != NULL) {
-			RETRO_Clear();
+			if (!RETRO.dirtyrects) {
+				RETRO_Clear();
+			}
+			unsigned long allocs = RETRO_CountAllocs();
 			DEMO_Render(deltatime);
+			RETRO_CheckAllocs(allocs, frame++);
+			if (RETRO.hashlog || RETRO.hashcheck) {
+				RETRO_HashFrame();
+			}
 			RETRO_Flip();
 		} else if (DEMO_Render2 != NULL) {
 			DEMO_Render2(deltatime);
 		}
-		unsigned long int stop = SDL_GetTicks64();
-
-		// Limit FPS
-		if (RETRO.fpscap && ((stop - start) < 1000UL / RETRO.fpscap)) {
-			SDL_Delay((1000 / RETRO.fpscap) - (stop - start));
-		}
 
-		// Show FPS once a second
-		if (RETRO.showfps) {
-			static unsigned long int fpsticks = SDL_GetTicks64();
-			static int fpscount = 0;
-			if (fpsticks < SDL_GetTicks64() - 1000UL) {
-				char title[128];
-				snprintf(title, 128, "RETRO - %s - FPS: %d", RETRO.basename, fpscount);
-				SDL_SetWindowTitle(RETRO.window, title);
-				fpsticks = SDL_GetTicks();
-				fpscount = 0;
-			}
-			fpscount++;
-		}
+		RETRO_PaceFrame();
+		RETRO_ShowFPS();
 	}
 }
 
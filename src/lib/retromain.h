@@ -26,14 +26,41 @@ void RETRO_ParseArguments(int argc, char *argv[])
 		{"showfps", no_argument, 0, 0},
 		{"nofps", no_argument, 0, 0},
 		{"capfps", required_argument, 0, 0},
+		{"paceslack", required_argument, 0, 0},
+		{"pipeline", no_argument, 0, 0},
+		{"hashlog", required_argument, 0, 0},
+		{"hashcheck", required_argument, 0, 0},
+		{"pack", required_argument, 0, 0},
 		{0, 0, 0, 0} };
+	const int retro_options = sizeof(long_options) / sizeof(long_options[0]) - 1;
+
+	// Append demo specific options
+	RETRO_Option *demo_options = DEMO_Options != NULL ? DEMO_Options() : NULL;
+	int demo_count = 0;
+	while (demo_options && demo_options[demo_count].name) {
+		demo_count++;
+	}
+	struct option *all_options = (struct option *)malloc((retro_options + demo_count + 1) * sizeof(struct option));
+	if (all_options == NULL) {
+		RETRO_RageQuit("Cannot allocate option memory\n");
+	}
+	memcpy(all_options, long_options, retro_options * sizeof(struct option));
+	for (int i = 0; i < demo_count; i++) {
+		all_options[retro_options + i] = { demo_options[i].name, demo_options[i].has_arg, 0, 0 };
+	}
+	all_options[retro_options + demo_count] = { 0, 0, 0, 0 };
+
 	bool usage = false;
 	int c;
 	int option_index = 0;
-	while ((c = getopt_long(argc, argv, ":hwflcv", long_options, &option_index)) != -1) {
+	while ((c = getopt_long(argc, argv, ":hwflcv", all_options, &option_index)) != -1) {
 		switch (c) {
 		case 0:
-			if (strcmp("fullwindow", long_options[option_index].name) == 0) {
+			if (option_index >= retro_options) {
+				if (DEMO_Option != NULL) {
+					DEMO_Option(all_options[option_index].name, optarg);
+				}
+			} else if (strcmp("fullwindow", long_options[option_index].name) == 0) {
 				RETRO.mode = RETRO_MODE_FULLWINDOW;
 			} else if (strcmp("novsync", long_options[option_index].name) == 0) {
 				RETRO.vsync = false;
@@ -47,6 +74,22 @@ void RETRO_ParseArguments(int argc, char *argv[])
 				RETRO.showfps = false;
 			} else if (strcmp("capfps", long_options[option_index].name) == 0) {
 				RETRO.fpscap = atoi(optarg);
+			} else if (strcmp("paceslack", long_options[option_index].name) == 0) {
+				RETRO_PACER.slack = atof(optarg);
+			} else if (strcmp("pipeline", long_options[option_index].name) == 0) {
+				RETRO.pipeline = true;
+			} else if (strcmp("hashlog", long_options[option_index].name) == 0) {
+				if ((RETRO.hashlog = fopen(optarg, "w")) == NULL) {
+					RETRO_RageQuit("Cannot open file: %s\n", optarg);
+				}
+			} else if (strcmp("hashcheck", long_options[option_index].name) == 0) {
+				if ((RETRO.hashcheck = fopen(optarg, "r")) == NULL) {
+					RETRO_RageQuit("Cannot open file: %s\n", optarg);
+				}
+			} else if (strcmp("pack", long_options[option_index].name) == 0) {
+				if (!RETRO_OpenPack(optarg)) {
+					RETRO_RageQuit("Cannot open file: %s\n", optarg);
+				}
 			}
 			break;
 		case 'h':
@@ -100,8 +143,17 @@ void RETRO_ParseArguments(int argc, char *argv[])
 		printf("     --showfps        Show frame rate in window title\n");
 		printf("     --nofps          Hide frame rate\n");
 		printf("     --capfps=VALUE   Limit frame rate to the specified VALUE\n");
+		printf("     --paceslack=MS   Spin instead of sleep for the last MS of a capped frame\n");
+		printf("     --pipeline       Render on a separate thread while presenting\n");
+		printf("     --hashlog=FILE   Write a hash of every rendered frame to FILE\n");
+		printf("     --hashcheck=FILE Compare the hash of every rendered frame to FILE\n");
+		printf("     --pack=FILE      Load images from asset pack FILE first\n");
+		for (int i = 0; i < demo_count; i++) {
+			printf("%s\n", demo_options[i].usage);
+		}
 		exit(1);
 	}
+	free(all_options);
 }
 
 int main(int argc, char *argv[])
@@ -115,7 +167,7 @@ int main(int argc, char *argv[])
 	if (DEMO_Deinitialize != NULL) DEMO_Deinitialize();
 	RETRO_Deinitialize();
 
-	return 0;
+	return RETRO.hashmismatch ? 2 : 0;
 }
 
 #endif
@@ -9,12 +9,14 @@ char nextchar(FILE *f)
 	// Return next character in file f
 	// Ignore spaces and comments
 
-	char ch;
+	int ch;
 
 	while (!feof(f)) {
 		while (isspace(ch = fgetc(f)));
 		if (ch == '*') {
-			while ((ch = fgetc(f)) != '\n');
+			while ((ch = fgetc(f)) != '\n' && ch != EOF);
+		} else if (ch == EOF) {
+			break;
 		} else {
 			return(ch);
 		}
@@ -22,14 +24,14 @@ char nextchar(FILE *f)
 	return(0);
 }
 
-int getnumber(FILE *f)
+long long getnumber(FILE *f)
 {
 	// Return next number in file f
 
 	char ch;
 	int sign = 1;
 
-	int num = 0;
+	long long num = 0;
 	if ((ch = nextchar(f)) == '-') {
 		sign = -1;
 		ch = nextchar(f);
@@ -41,20 +43,208 @@ int getnumber(FILE *f)
 	return(num * sign);
 }
 
-int loadpoly(world_type *world, const char *filename)
+void loaderror(const char **error, const char *message)
 {
-	// Load polygon-fill objects into a data structure of type WORLD_TYPE from disk file FILENAME
+	// Quit with MESSAGE about the world being loaded, or keep the first
+	//  one in ERROR for a caller that must not quit, such as a loader thread
 
-	FILE *f;
-	int num, objnum, vertnum, polynum;
+	if (error == NULL) {
+		RETRO_RageQuit(message);
+	}
+	if (*error == NULL) {
+		*error = message;
+	}
+}
 
-	f = fopen(filename, "rt");  // Open file
+int getcount(FILE *f, long limit, const char **error)
+{
+	// Return the next number in file F as a count of things, or 0 if it
+	//  is negative or more than LIMIT, leaving why in ERROR
+
+	long long count = getnumber(f);
+	if (count < 0 || count > limit) {
+		loaderror(error, "Count out of range\n");
+		return(0);
+	}
+	return(count);
+}
+
+long countlimit(FILE *f)
+{
+	// Return the most things the rest of file F could list, two
+	//  characters a number at least, to tell corrupt counts from large ones
+
+	long here = ftell(f);
+	if (here < 0 || fseek(f, 0, SEEK_END)) {
+		return(LONG_MAX);
+	}
+	long limit = (ftell(f) - here) / 2;
+	fseek(f, here, SEEK_SET);
+	return(limit);
+}
+
+int loadmesh(mesh_type *mesh, FILE *f, long limit, const char **error)
+{
+	// Load the vertices and polygons of one mesh into MESH from the
+	//  current position of file F, returning the number of polygons.
+	//  Counts over LIMIT are taken for corrupt, see countlimit(), and a
+	//  mesh that does not hold together is cut short at the first bad
+	//  polygon, with the reason left in ERROR as for loadobjects().
+
+	int vertnum, polynum;
+
+	// Get number of vertices in mesh:
+	long long vertices = getnumber(f);
+	if (vertices < -limit || vertices > limit) {
+		loaderror(error, "Count out of range\n");
+		vertices = 0;
+	}
+	mesh->number_of_vertices = vertices;
+	mesh->pixels = 0;
+	mesh->pointers = 0;
+
+	// A negative number refers to a mesh of the library instead, see loadobjects():
+	if (mesh->number_of_vertices < 0) {
+		mesh->number_of_polygons = 0;
+		mesh->vertex = NULL;
+		mesh->polygon = NULL;
+		return(0);
+	}
+
+	// Allocate memory for vertex array:
+	mesh->vertex = new vertex_type[mesh->number_of_vertices];
+
+	// Load vertices into VERTEX_TYPE array:
+	for (vertnum = 0; vertnum < mesh->number_of_vertices; vertnum++) {
+		// Assign pointer CURVERT to current vertex:
+		vertex_type *curvert = &mesh->vertex[vertnum];
+
+		// Get local coordinates of vertex:
+		curvert->lx = getnumber(f); // Get local x coordinate
+		curvert->ly = getnumber(f); // Get local y coordinate
+		curvert->lz = getnumber(f); // Get local z coordinate
+		curvert->lt = 1; // Initialize dummy coordinates...
+		curvert->wt = 1; // ...to 1
+		curvert->stamp = 0; // Not aligned yet
+	}
+
+	// Get number of polygons in mesh:
+	mesh->number_of_polygons = getcount(f, limit, error);
+
+	// Assign memory for polygon array:
+	mesh->polygon = new polygon_type[mesh->number_of_polygons];
+
+	// Load polygons into POLYGON_TYPE array:
+	for (polynum = 0; polynum < mesh->number_of_polygons; polynum++) {
+		// Assign pointer CURPOLY to current polygon:
+		polygon_type *curpoly = &mesh->polygon[polynum];
+
+		// Get number of vertices in current polygon:
+		curpoly->number_of_vertices = getnumber(f);
+		if (curpoly->number_of_vertices < 3 || curpoly->number_of_vertices > POLY_VERTICES) {
+			loaderror(error, "Polygon with too few or too many vertices\n");
+			mesh->number_of_polygons = polynum;
+			break;
+		}
+
+		// Calculate number of clipped vertices in current polygon:
+		curpoly->number_of_clipped_vertices = curpoly->number_of_vertices + 4;
+		mesh->pointers += curpoly->number_of_vertices;
+
+		// Assign memory for vertex array:
+		curpoly->vertex = new vertex_type * [curpoly->number_of_vertices];
+
+		// Create array of pointers to vertices:
+		for (vertnum = 0; vertnum < curpoly->number_of_vertices; vertnum++) {
+			// Allocate memory for pointer and point it at vertex in vertex array:
+			long long index = getnumber(f);
+			if (index < 0 || index >= mesh->number_of_vertices) {
+				loaderror(error, "Polygon vertex out of range\n");
+				break;
+			}
+			curpoly->vertex[vertnum] = &mesh->vertex[index];
+		}
+		if (vertnum < curpoly->number_of_vertices) {
+			delete[] curpoly->vertex;
+			mesh->pointers -= curpoly->number_of_vertices;
+			mesh->number_of_polygons = polynum;
+			break;
+		}
+
+		// Get color of current polygon:
+		curpoly->color = getnumber(f);
+		if (curpoly->color < 0 || curpoly->color > 255) {
+			loaderror(error, "Polygon color out of range\n");
+			curpoly->color = 0;
+		}
+
+		// Initialize sort flag and light level to zero:
+		curpoly->sortflag = 0;
+		curpoly->light = 0;
+	}
+
+	// Find the planes of its polygons, for backface removal:
+	find_planes(mesh);
+
+	return(mesh->number_of_polygons);
+}
+
+void freemesh(mesh_type *mesh)
+{
+	// Free the vertices and polygons of MESH
+
+	for (int polynum = 0; polynum < mesh->number_of_polygons; polynum++) {
+		delete[] mesh->polygon[polynum].vertex;
+	}
+	delete[] mesh->polygon;
+	delete[] mesh->vertex;
+}
+
+long meshradius(mesh_type *mesh)
+{
+	// Return the distance of the farthest vertex of MESH from its origin
+
+	double radius = 0;
+	for (int vertnum = 0; vertnum < mesh->number_of_vertices; vertnum++) {
+		vertex_type *curvert = &mesh->vertex[vertnum];
+		radius = MAX(radius, sqrt((double)curvert->lx * curvert->lx + (double)curvert->ly * curvert->ly + (double)curvert->lz * curvert->lz));
+	}
+	return ceil(radius);
+}
+
+void addlod(object_type *object, mesh_type *mesh)
+{
+	// Add MESH to the levels of detail of OBJECT, after the ones it has
+
+	int lods = object->number_of_lods ? object->number_of_lods : 1;
+	mesh_type *lod = new mesh_type[lods + 1];
+	if (object->number_of_lods) {
+		memcpy(lod, object->lod, lods * sizeof(mesh_type));
+		delete[] object->lod;
+	} else {
+		// Its own mesh is the first level, drawn at any size:
+		getmesh(object, &lod[0]);
+	}
+	lod[lods] = *mesh;
+	object->lod = lod;
+	object->number_of_lods = lods + 1;
+}
+
+int loadobjects(world_type *world, FILE *f, const char **error = NULL)
+{
+	// Load polygon-fill objects into a data structure of type WORLD_TYPE,
+	//  reading them from the current position of file F. If ERROR is
+	//  given, a world that does not hold together is loaded as far as it
+	//  does and the reason left there, instead of quitting.
+
+	int num, objnum;
 
 	// Initialize polygon count:
 	int polycount = 0;
 
 	// Get number of objects from file:
-	world->number_of_objects = getnumber(f);
+	long limit = countlimit(f);
+	world->number_of_objects = getcount(f, limit, error);
 
 	// Allocate memory for objects:
 	world->obj = new object_type[world->number_of_objects];
@@ -81,71 +271,255 @@ int loadpoly(world_type *world, const char *filename)
 		curobj->yscale = curobj->xscale;
 		curobj->zscale = curobj->xscale;
 
-		// Get number of vertices in current object:
-		curobj->number_of_vertices = getnumber(f);
+		// Get vertices and polygons of object:
+		mesh_type mesh;
+		polycount += loadmesh(&mesh, f, limit, error);
+		setmesh(curobj, &mesh);
+		curobj->number_of_lods = 0;
+		curobj->lod = NULL;
+		curobj->level = 0;
+		curobj->shared = NULL;
+		curobj->radius = meshradius(&mesh) * curobj->xscale;
 
-		// Allocate memory for vertex array:
-		curobj->vertex = new vertex_type[curobj->number_of_vertices];
+		// Is backface removal needed?
+		curobj->convex = getnumber(f);
 
-		// Load vertices into VERTEX_TYPE array:
-		for (vertnum = 0; vertnum < curobj->number_of_vertices; vertnum++) {
-			// Assign pointer CURVERT to current vertex:
-			vertex_type *curvert = &curobj->vertex[vertnum];
+		// Set update flag:
+		curobj->update = 1;
+		curobj->stamp = 0;
+		curobj->sequence = objnum;
+	}
 
-			// Get local coordinates of vertex:
-			curvert->lx = getnumber(f); // Get local x coordinate
-			curvert->ly = getnumber(f); // Get local y coordinate
-			curvert->lz = getnumber(f); // Get local z coordinate
-			curvert->lt = 1; // Initialize dummy coordinates...
-			curvert->wt = 1; // ...to 1
+	// Get levels of detail, if any follow the objects. Each is the number
+	//  of its object, the size in pixels below which it is drawn instead,
+	//  and its vertices and polygons:
+	int lods = getcount(f, limit, error);
+	for (int lodnum = 0; lodnum < lods; lodnum++) {
+		objnum = getnumber(f);
+		int pixels = getnumber(f);
+		mesh_type mesh;
+		loadmesh(&mesh, f, limit, error);
+		mesh.pixels = pixels;
+		if (objnum < 0 || objnum >= world->number_of_objects) {
+			loaderror(error, "Level of detail for a missing object\n");
+			freemesh(&mesh);
+		} else if (world->obj[objnum].number_of_vertices < 0) {
+			loaderror(error, "Level of detail for an instance of a library mesh\n");
+			freemesh(&mesh);
+		} else {
+			addlod(&world->obj[objnum], &mesh);
 		}
+	}
 
-		// Get number of polygons in object:
-		curobj->number_of_polygons = getnumber(f);
+	// Get the library of meshes, if one follows. Objects with a negative
+	//  number of vertices, -1 for the first mesh and so on, are instances
+	//  of these, sharing their vertices and polygons:
+	world->number_of_meshes = getcount(f, limit, error);
+	world->mesh = new mesh_type[world->number_of_meshes];
+	for (int meshnum = 0; meshnum < world->number_of_meshes; meshnum++) {
+		loadmesh(&world->mesh[meshnum], f, limit, error);
+		if (world->mesh[meshnum].number_of_vertices < 0) {
+			loaderror(error, "Library mesh refers to another\n");
+			world->mesh[meshnum].number_of_vertices = 0;
+		}
+	}
+	for (objnum = 0; objnum < world->number_of_objects; objnum++) {
+		object_type *curobj = &world->obj[objnum];
+		if (curobj->number_of_vertices < 0) {
+			int meshnum = -curobj->number_of_vertices - 1;
+			if (meshnum >= world->number_of_meshes) {
+				loaderror(error, "Instance of a missing library mesh\n");
+				curobj->number_of_vertices = 0;
+				continue;
+			}
+			curobj->shared = &world->mesh[meshnum];
+			curobj->number_of_vertices = 0;
+			curobj->radius = meshradius(curobj->shared) * curobj->xscale;
+			polycount += curobj->shared->number_of_polygons;
+		}
+	}
 
-		// Add to polygon count:
-		polycount += curobj->number_of_polygons;
+	return(polycount);
+}
 
-		// Assign memory for polygon array:
-		curobj->polygon = new polygon_type[curobj->number_of_polygons];
+int loadpoly(world_type *world, const char *filename)
+{
+	// Load polygon-fill objects into a data structure of type WORLD_TYPE from disk file FILENAME
 
-		// Load polygons into POLYGON_TYPE array:
-		for (polynum = 0; polynum < curobj->number_of_polygons; polynum++) {
-			// Assign pointer CURPOLY to current polygon:
-			polygon_type *curpoly = &curobj->polygon[polynum];
+	FILE *f;
 
-			// Get number of vertices in current polygon:
-			curpoly->number_of_vertices = getnumber(f);
+	f = fopen(filename, "rt");  // Open file
+	if (f == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", filename);
+	}
+
+	int polycount = loadobjects(world, f);
 
-			// Calculate number of clipped vertices in current polygon:
-			curpoly->number_of_clipped_vertices = curpoly->number_of_vertices + 4;
+	// Close up shop and return:
+	fclose(f);  // Close file
+	return(polycount);  // Job done!
+}
 
-			// Assign memory for vertex array:
-			curpoly->vertex = new vertex_type * [curpoly->number_of_vertices];
+mesh_type *getmeshes(object_type *object, mesh_type *own, int *count)
+{
+	// Return the meshes of OBJECT and put their number in COUNT. OWN holds
+	//  its mesh if it has no levels of detail.
 
-			// Create array of pointers to vertices:
-			for (vertnum = 0; vertnum < curpoly->number_of_vertices; vertnum++) {
-				// Allocate memory for pointer and point it at vertex in vertex array:
-				curpoly->vertex[vertnum] = &curobj->vertex[getnumber(f)];
-			}
+	if (object->number_of_lods) {
+		*count = object->number_of_lods;
+		return object->lod;
+	}
+	getmesh(object, own);
+	*count = 1;
+	return own;
+}
 
-			// Get color of current polygon:
-			curpoly->color = getnumber(f);
+void unloadpoly(world_type *world)
+{
+	// Free the objects of WORLD, leaving it empty
 
-			// Initialize sort flag to zero:
-			curpoly->sortflag = 0;
+	for (int objnum = 0; objnum < world->number_of_objects; objnum++) {
+		object_type *curobj = &world->obj[objnum];
+		if (curobj->shared) {
+			continue;
+		}
+		mesh_type own;
+		int count;
+		mesh_type *mesh = getmeshes(curobj, &own, &count);
+		for (int m = 0; m < count; m++) {
+			freemesh(&mesh[m]);
 		}
+		delete[] curobj->lod;
+	}
+	for (int meshnum = 0; meshnum < world->number_of_meshes; meshnum++) {
+		mesh_type *mesh = &world->mesh[meshnum];
+		freemesh(mesh);
+	}
+	delete[] world->obj;
+	delete[] world->mesh;
+	world->obj = NULL;
+	world->mesh = NULL;
+	world->number_of_objects = 0;
+	world->number_of_meshes = 0;
+}
 
-		// Is backface removal needed?
-		curobj->convex = getnumber(f);
+long meshbytes(mesh_type *mesh)
+{
+	// Return the memory taken by the vertices and polygons of MESH
 
-		// Set update flag:
-		curobj->update = 1;
+	return mesh->number_of_vertices * sizeof(vertex_type) + mesh->number_of_polygons * sizeof(polygon_type) + mesh->pointers * sizeof(vertex_type *);
+}
+
+long polybytes(world_type *world)
+{
+	// Return the memory taken by the objects of WORLD as loaded, leaving out the instances drawn from its library
+
+	long bytes = world->number_of_objects * sizeof(object_type) + world->number_of_meshes * sizeof(mesh_type);
+	for (int objnum = 0; objnum < world->number_of_objects; objnum++) {
+		object_type *curobj = &world->obj[objnum];
+		if (curobj->shared) {
+			continue;
+		}
+		mesh_type own;
+		int count;
+		mesh_type *mesh = getmeshes(curobj, &own, &count);
+		bytes += curobj->number_of_lods * sizeof(mesh_type);
+		for (int m = 0; m < count; m++) {
+			bytes += meshbytes(&mesh[m]);
+		}
 	}
+	for (int meshnum = 0; meshnum < world->number_of_meshes; meshnum++) {
+		bytes += meshbytes(&world->mesh[meshnum]);
+	}
+	return bytes;
+}
 
-	// Close up shop and return:
-	fclose(f);  // Close file
-	return(polycount);  // Job done!
+void savemesh(mesh_type *mesh, FILE *f)
+{
+	// Write the vertices and polygons of MESH to file F
+
+	fprintf(f, "\t%d,\t\t* Number of vertices\n", mesh->number_of_vertices);
+	for (int vertnum = 0; vertnum < mesh->number_of_vertices; vertnum++) {
+		vertex_type *curvert = &mesh->vertex[vertnum];
+		fprintf(f, "\t\t%ld,%ld,%ld,\n", curvert->lx, curvert->ly, curvert->lz);
+	}
+	fprintf(f, "\t%d,\t\t* Number of polygons\n", mesh->number_of_polygons);
+	for (int polynum = 0; polynum < mesh->number_of_polygons; polynum++) {
+		polygon_type *curpoly = &mesh->polygon[polynum];
+		fprintf(f, "\t\t%d,", curpoly->number_of_vertices);
+		for (int vertnum = 0; vertnum < curpoly->number_of_vertices; vertnum++) {
+			fprintf(f, " %d,", (int)(curpoly->vertex[vertnum] - mesh->vertex));
+		}
+		fprintf(f, " %d,\n", curpoly->color);
+	}
+}
+
+void saveobject(object_type *curobj, mesh_type *library, FILE *f)
+{
+	// Write object CUROBJ to file F in the format loadobjects() reads,
+	//  with its own mesh whatever level of detail it is drawn at. An
+	//  instance refers to its mesh in LIBRARY instead.
+
+	mesh_type own;
+	int count;
+	mesh_type *mesh = getmeshes(curobj, &own, &count);
+	fprintf(f, "\t%lld,%lld,%lld,\t\t* X,Y,Z coordinates of object's local origin\n", curobj->x, curobj->y, curobj->z);
+	fprintf(f, "\t%d,%d,%d,\t\t* X,Y,Z rotation of object\n", curobj->xangle, curobj->yangle, curobj->zangle);
+	fprintf(f, "\t%d,\t\t* Scale factor of object\n", curobj->xscale);
+	if (curobj->shared) {
+		fprintf(f, "\t%d,\t\t* Instance of library mesh %d\n", (int)-(curobj->shared - library + 1), (int)(curobj->shared - library));
+	} else {
+		savemesh(&mesh[0], f);
+	}
+	fprintf(f, "\t%d,\t\t* Backplanes removed\n\n", curobj->convex);
+}
+
+void savelods(world_type *world, FILE *f)
+{
+	// Write the levels of detail of the objects of WORLD to file F, to
+	//  follow the objects themselves
+
+	int lods = 0;
+	for (int objnum = 0; objnum < world->number_of_objects; objnum++) {
+		lods += MAX(world->obj[objnum].number_of_lods - 1, 0);
+	}
+	fprintf(f, "%d,\t\t* Number of levels of detail\n\n", lods);
+	for (int objnum = 0; objnum < world->number_of_objects; objnum++) {
+		object_type *curobj = &world->obj[objnum];
+		for (int m = 1; m < curobj->number_of_lods; m++) {
+			fprintf(f, "\t%d,\t\t* Object\n", objnum);
+			fprintf(f, "\t%d,\t\t* Drawn below this many pixels\n", curobj->lod[m].pixels);
+			savemesh(&curobj->lod[m], f);
+			fprintf(f, "\n");
+		}
+	}
+}
+
+void savemeshes(world_type *world, FILE *f)
+{
+	// Write the library of meshes of WORLD to file F, to follow the levels
+	//  of detail
+
+	fprintf(f, "%d,\t\t* Number of library meshes\n\n", world->number_of_meshes);
+	for (int meshnum = 0; meshnum < world->number_of_meshes; meshnum++) {
+		fprintf(f, "\t\t\t* Library mesh %d\n", meshnum);
+		savemesh(&world->mesh[meshnum], f);
+		fprintf(f, "\n");
+	}
+}
+
+void saveworld(world_type *world, FILE *f)
+{
+	// Write WORLD to file F in the format loadpoly() reads
+
+	fprintf(f, "*** World definition file ***\n\n");
+	fprintf(f, "%d,\t\t* Number of objects in file\n\n", world->number_of_objects);
+	for (int objnum = 0; objnum < world->number_of_objects; objnum++) {
+		fprintf(f, "* OBJECT #%d:\n\n", objnum);
+		saveobject(&world->obj[objnum], world->mesh, f);
+	}
+	savelods(world, f);
+	savemeshes(world, f);
 }
 
 #endif
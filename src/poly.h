@@ -2,6 +2,8 @@
 #ifndef _POLY_H_
 #define _POLY_H_
 
+#define POLY_VERTICES 16    // most vertices a polygon may have, so that it fits clip_type once clipped
+
 // Variable structures to hold shape data:
 
 struct vertex_type {				// Structure for individual vertices
@@ -9,6 +11,7 @@ struct vertex_type {				// Structure for individual vertices
 	long wx, wy, wz, wt;          // World coordinates of vertex
 	long ax, ay, az, at;          // World coordinates aligned with view
 	long sx, sy, st;		    			// Screen coordinates of vertex
+	unsigned long stamp;          // Frame the aligned coordinates are from
 };
 
 struct clip_type {
@@ -19,7 +22,7 @@ struct clip_type {
 struct clipped_polygon_type {
 	int number_of_vertices;
 	int color;
-	clip_type vertex[20];
+	clip_type vertex[POLY_VERTICES + 4];
 	int	zmax, zmin;					// Maximum and minimum z coordinates of polygon
 	int xmax, xmin;
 	int ymax, ymin;
@@ -34,24 +37,48 @@ struct	polygon_type {
 	int ymax, ymin;
 	long double distance;
 	vertex_type **vertex;		// List of vertices
+	int light;              // Shade table for the polygon's angle to the sun
+	double a, b, c, d;      // Plane equation in object coordinates, positive in front
 	int	sortflag;						// For hidden surface sorts
 };
 
+struct mesh_type {          // Vertices and polygons of one level of detail, or of a library mesh
+	int number_of_vertices;
+	int number_of_polygons;
+	vertex_type *vertex;
+	polygon_type *polygon;
+	int pixels;             // Drawn while the object is smaller on screen than this
+	int pointers;           // Vertex pointers in all its polygons
+};
+
 struct object_type {
 	int number_of_vertices;	// Number of vertices in object
 	int number_of_polygons;	// Number of polygons in object
-	int x, y, z;							// World coordinates of object's local origin
+	long long x, y, z;				// World coordinates of object's local origin
 	int xangle, yangle, zangle; // Orientation of object in space
 	int xscale, yscale, zscale;
+	int orient[3][3];       // Rotation and scale from object to world, see update()
 	polygon_type *polygon;		// List of polygons in object
 	vertex_type *vertex;			// Array of vertices in object
 	int convex;							// Is it a convex polyhedron?
 	int update;             // Has position been updated?
+	long wxmin, wxmax;      // World x and z extent of object
+	long wzmin, wzmax;
+	int cx1, cz1, cx2, cz2; // Grid cells the object is filed under
+	unsigned long stamp;    // Grid query that last found the object
+	unsigned long long sequence; // Place in the world as loaded, for a steady drawing order
+	long radius;            // Distance of its farthest vertex from its origin
+	int number_of_lods;     // Levels of detail, 0 if it only has its own mesh
+	mesh_type *lod;         // The levels, the first one its own mesh
+	int level;              // Level it is drawn at
+	mesh_type *shared;      // Library mesh it is an instance of, if any
 };
 
 struct world_type {
 	int number_of_objects;
 	object_type *obj;
+	int number_of_meshes;   // Library of meshes shared by instances
+	mesh_type *mesh;
 };
 
 struct polygon_list_type {
@@ -64,6 +91,12 @@ struct view_type {
 	int xangle, yangle, zangle;
 };
 
+struct mask_type {         // Part of each screen line left visible by an overlay
+	int xstart[200];           // First visible x on each line
+	int xend[200];             // Last visible x on each line, < xstart if none
+	int ylast;                 // Last line with any visible pixels
+};
+
 // Global transformation arrays:
 
 int matrix[4][4];          // Master transformation matrix
@@ -76,11 +109,13 @@ int tmat[4][4];            // Translation matrix
 
 void matmult(int result[4][4], int mat1[4][4], int mat2[4][4])
 {
-	// Multiply matrix MAT1 by matrix MAT2, returning the result in RESULT
+	// Multiply matrix MAT1 by matrix MAT2, returning the result in RESULT.
+	// Products are summed in 64 bits, since translations are already
+	// shifted left by SHIFT
 
 	for (int i = 0; i < 4; i++) {
 		for (int j = 0; j < 4; j++) {
-			result[i][j] = ((mat1[i][0] * mat2[0][j]) + (mat1[i][1] * mat2[1][j]) + (mat1[i][2] * mat2[2][j]) + (mat1[i][3] * mat2[3][j])) >> SHIFT;
+			result[i][j] = (((long long)mat1[i][0] * mat2[0][j]) + ((long long)mat1[i][1] * mat2[1][j]) + ((long long)mat1[i][2] * mat2[2][j]) + ((long long)mat1[i][3] * mat2[3][j])) >> SHIFT;
 		}
 	}
 }
@@ -96,6 +131,60 @@ void matcopy(int dest[4][4], int source[4][4])
 	}
 }
 
+inline void setmesh(object_type *object, mesh_type *mesh)
+{
+	// Make MESH the vertices and polygons OBJECT is drawn with
+
+	object->number_of_vertices = mesh->number_of_vertices;
+	object->number_of_polygons = mesh->number_of_polygons;
+	object->vertex = mesh->vertex;
+	object->polygon = mesh->polygon;
+}
+
+inline void getmesh(object_type *object, mesh_type *mesh)
+{
+	// Put the vertices and polygons OBJECT is drawn with in MESH
+
+	mesh->number_of_vertices = object->number_of_vertices;
+	mesh->number_of_polygons = object->number_of_polygons;
+	mesh->vertex = object->vertex;
+	mesh->polygon = object->polygon;
+	mesh->pixels = INT_MAX;
+	mesh->pointers = 0;
+	for (int p = 0; p < mesh->number_of_polygons; p++) {
+		mesh->pointers += mesh->polygon[p].number_of_vertices;
+	}
+}
+
+void find_planes(mesh_type *mesh)
+{
+	// Find the plane equation of every polygon in MESH from the local
+	//  coordinates of its first three vertices. These stay valid however
+	//  the objects drawn with the mesh move. The normals are made unit
+	//  length, for lighting.
+
+	for (int p = 0; p < mesh->number_of_polygons; p++) {
+		polygon_type *poly = &mesh->polygon[p];
+		vertex_type *v0 = poly->vertex[0];
+		vertex_type *v1 = poly->vertex[1];
+		vertex_type *v2 = poly->vertex[2];
+
+		// Normal is the cross product of the first two edges:
+		double ax = v1->lx - v0->lx, ay = v1->ly - v0->ly, az = v1->lz - v0->lz;
+		double bx = v2->lx - v0->lx, by = v2->ly - v0->ly, bz = v2->lz - v0->lz;
+		poly->a = ay * bz - az * by;
+		poly->b = az * bx - ax * bz;
+		poly->c = ax * by - ay * bx;
+		double length = sqrt(poly->a * poly->a + poly->b * poly->b + poly->c * poly->c);
+		if (length > 0) {
+			poly->a /= length;
+			poly->b /= length;
+			poly->c /= length;
+		}
+		poly->d = -(poly->a * v0->lx + poly->b * v0->ly + poly->c * v0->lz);
+	}
+}
+
 // Transformation functions:
 void inittrans()
 {
@@ -201,6 +290,15 @@ void transform(object_type *object)
 	}
 }
 
+inline void align(vertex_type *vptr)
+{
+	// Multiply VPTR with master transformation matrix:
+
+	vptr->ax = ((int)vptr->wx * matrix[0][0] + (int)vptr->wy * matrix[1][0] + (int)vptr->wz * matrix[2][0] + matrix[3][0]) >> SHIFT;
+	vptr->ay = ((int)vptr->wx * matrix[0][1] + (int)vptr->wy * matrix[1][1] + (int)vptr->wz * matrix[2][1] + matrix[3][1]) >> SHIFT;
+	vptr->az = ((int)vptr->wx * matrix[0][2] + (int)vptr->wy * matrix[1][2] + (int)vptr->wz * matrix[2][2] + matrix[3][2]) >> SHIFT;
+}
+
 void atransform(object_type *object)
 {
 	// Multiply all vertices in OBJECT with master transformation matrix:
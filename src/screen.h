@@ -52,7 +52,7 @@ void PutImage(int x1, int y1, int x2, int y2, unsigned char *buffer)
 // make graphSeg and graphOff global to the program by removing the static
 // storage specifier, but this should only be done if the overhead of the
 // extra far call involved in using this gateway is proven to be significant.
-void Line(int x1, int y1, int x2, int y2, char color)
+void Line(int x1, int y1, int x2, int y2, char color, unsigned char *buffer = RETRO.framebuffer)
 {
 	int y_unit, x_unit; // Variables for amount of change in x and y
 
@@ -78,7 +78,7 @@ void Line(int x1, int y1, int x2, int y2, char color)
 	if (xdiff > ydiff) {		// If difference is bigger in x dimension
 		int length = xdiff + 1;	// ...prepare to count off in x direction
 		for (int i = 0; i < length; i++) {  // Loop through points in x direction
-			RETRO.framebuffer[offset] = color;	// Set the next pixel in the line to COLOR
+			buffer[offset] = color;	// Set the next pixel in the line to COLOR
 			offset += x_unit;				// Move offset to next pixel in x direction
 			error_term += ydiff;		// Check to see if move required in y direction
 			if (error_term > xdiff) {	// If so...
@@ -89,7 +89,7 @@ void Line(int x1, int y1, int x2, int y2, char color)
 	} else {								// If difference is bigger in y dimension
 		int length = ydiff + 1;	// ...prepare to count off in y direction
 		for (int i = 0; i < length; i++) {	// Loop through points in y direction
-			RETRO.framebuffer[offset] = color;	// Set the next pixel in the line to COLOR
+			buffer[offset] = color;	// Set the next pixel in the line to COLOR
 			offset += y_unit;				// Move offset to next pixel in y direction
 			error_term += xdiff;    // Check to see if move required in x direction
 			if (error_term > 0) {		// If so...
@@ -0,0 +1,299 @@
+#ifndef _TILES_H_
+#define _TILES_H_
+
+// Streams a tiled world, written by foftile, in and out of the grid. The
+// world is cut into square cells of ground, and the objects whose origins
+// lie in a cell are stored together as one block of .wld text that can be
+// loaded on its own. A loader thread loads and frees tiles, so the render
+// thread only ever files ready tiles in the grid and takes them out again.
+
+#include "view.h"
+#include "loadpoly.h"
+
+#define TILE_VERSION 4
+#define TILE_HEADER 40         // bytes in the file header
+#define TILE_ENTRY 24          // bytes in each index entry
+#define TILE_INFLIGHT 4        // most tiles queued for the loader at once
+#define TILE_LINKS 2           // most loaded tiles filed in the grid per frame
+
+enum { TILE_EMPTY, TILE_QUEUED, TILE_READY, TILE_LIVE, TILE_FREEING, TILE_FAILED };
+
+struct tile_type {
+	unsigned long long offset; // Where the tile's block starts in the file
+	unsigned int size;         // Bytes in the block, 0 if the tile is empty
+	unsigned int polygons;     // Number of polygons in the tile
+	unsigned int bytes;        // Memory the tile takes when loaded
+	SDL_atomic_t state;        // TILE_EMPTY, and so on
+	world_type world;          // Objects of the tile while loaded
+};
+
+struct tileset_type {          // A tiled world being streamed
+	FILE *fp;
+	int cell;                  // Side of a tile in world units
+	long long x0, z0;          // World coordinates of the first tile's corner
+	int columns, rows;         // Number of tiles along x and z
+	tile_type *tile;
+	int *resident;             // Tiles that are not empty, or not yet known to be
+	int residents;
+	int *queue;                // Tiles for the loader to load or free
+	unsigned int queued;
+	SDL_sem *work;             // Posted once for each queued tile
+	SDL_Thread *thread;
+	bool quit;
+	const char *error;         // Why the loader failed to load a tile
+	float radius;              // Distance around the look-ahead point to load
+	long budget;               // Memory the resident tiles may take
+	long used;
+};
+
+tileset_type tileset;
+
+int tile_loader(void *data)
+{
+	// Loader thread. The render thread queues tiles in TILE_QUEUED or
+	//  TILE_FREEING state and leaves them alone until they change state.
+	//  A tile that cannot be read becomes TILE_FAILED, for the render
+	//  thread to quit over, since quitting here would pull the world from
+	//  under it.
+
+	unsigned int next = 0;
+	while (true) {
+		SDL_SemWait(tileset.work);
+		if (tileset.quit) {
+			break;
+		}
+		tile_type *tile = &tileset.tile[tileset.queue[next++ % (tileset.columns * tileset.rows)]];
+		if (SDL_AtomicGet(&tile->state) == TILE_QUEUED) {
+			const char *error = NULL;
+			if (fseek(tileset.fp, tile->offset, SEEK_SET)) {
+				error = "Cannot read tile\n";
+			} else {
+				loadobjects(&tile->world, tileset.fp, &error);
+			}
+			if (error) {
+				unloadpoly(&tile->world);
+				tileset.error = error;
+				SDL_AtomicSet(&tile->state, TILE_FAILED);
+			} else {
+				SDL_AtomicSet(&tile->state, TILE_READY);
+			}
+		} else {
+			unloadpoly(&tile->world);
+			SDL_AtomicSet(&tile->state, TILE_EMPTY);
+		}
+	}
+	return 0;
+}
+
+void queue_tile(int t, int state)
+{
+	// Hand tile T to the loader thread, to load or to free it
+
+	SDL_AtomicSet(&tileset.tile[t].state, state);
+	tileset.queue[tileset.queued++ % (tileset.columns * tileset.rows)] = t;
+	SDL_SemPost(tileset.work);
+}
+
+int opentiles(const char *filename, float radius, long budget)
+{
+	// Open tiled world FILENAME, make a grid covering it and start the
+	//  loader thread. Tiles within RADIUS of the viewer are loaded as long
+	//  as they fit in BUDGET bytes. Returns an estimate of the polygons
+	//  resident at once, for sizing the polygon list.
+
+	tileset.fp = fopen(filename, "rb");
+	if (tileset.fp == NULL) {
+		RETRO_RageQuit("Cannot open file: %s\n", filename);
+	}
+	unsigned char header[TILE_HEADER];
+	if (fread(header, sizeof(header), 1, tileset.fp) != 1 || memcmp(header, "RWLT", 4) || RETRO_Read32(header + 4) != TILE_VERSION) {
+		RETRO_RageQuit("Cannot read file: %s\n", filename);
+	}
+	tileset.cell = RETRO_Read32(header + 8);
+	tileset.columns = RETRO_Read32(header + 12);
+	tileset.rows = RETRO_Read32(header + 16);
+	tileset.x0 = RETRO_Read64(header + 24);
+	tileset.z0 = RETRO_Read64(header + 32);
+
+	int tiles = tileset.columns * tileset.rows;
+	tileset.tile = (tile_type *)calloc(tiles, sizeof(tile_type));
+	tileset.resident = (int *)malloc(tiles * sizeof(int));
+	tileset.queue = (int *)malloc(tiles * sizeof(int));
+	if (tileset.tile == NULL || tileset.resident == NULL || tileset.queue == NULL) {
+		RETRO_RageQuit("Cannot allocate tile memory\n");
+	}
+	unsigned int polygons = 0;
+	for (int t = 0; t < tiles; t++) {
+		unsigned char entry[TILE_ENTRY];
+		if (fread(entry, sizeof(entry), 1, tileset.fp) != 1) {
+			RETRO_RageQuit("Cannot read file: %s\n", filename);
+		}
+		tile_type *tile = &tileset.tile[t];
+		tile->offset = RETRO_Read64(entry);
+		tile->size = RETRO_Read32(entry + 8);
+		tile->polygons = RETRO_Read32(entry + 16);
+		tile->bytes = RETRO_Read32(entry + 20);
+		polygons = MAX(polygons, tile->polygons);
+	}
+	tileset.radius = radius;
+	tileset.budget = budget;
+
+	long x1 = tileset.x0 - origin_x, z1 = tileset.z0 - origin_z;
+	makegrid(x1, z1, x1 + (long)tileset.columns * tileset.cell, z1 + (long)tileset.rows * tileset.cell);
+
+	tileset.work = SDL_CreateSemaphore(0);
+	if ((tileset.thread = SDL_CreateThread(tile_loader, "tiles", NULL)) == NULL) {
+		RETRO_RageQuit("SDL_CreateThread failed: %s\n", SDL_GetError());
+	}
+
+	// The tiles within the radius, and the ones on the way out:
+	int across = 2 * (int)(radius * 1.25 / tileset.cell) + 2;
+	return polygons * MIN(across * across, tiles);
+}
+
+void closetiles()
+{
+	// Stop the loader thread and free every tile
+
+	tileset.quit = true;
+	SDL_SemPost(tileset.work);
+	SDL_WaitThread(tileset.thread, NULL);
+	SDL_DestroySemaphore(tileset.work);
+	for (int t = 0; t < tileset.columns * tileset.rows; t++) {
+		unloadpoly(&tileset.tile[t].world);
+	}
+	fclose(tileset.fp);
+	free(tileset.tile);
+	free(tileset.resident);
+	free(tileset.queue);
+}
+
+double tile_distance(int t, double x, double z)
+{
+	// Distance from world point X,Z to the nearest point of tile T
+
+	double x1 = tileset.x0 + (double)(t % tileset.columns) * tileset.cell;
+	double z1 = tileset.z0 + (double)(t / tileset.columns) * tileset.cell;
+	double dx = MAX(MAX(x1 - x, x - x1 - tileset.cell), 0.0);
+	double dz = MAX(MAX(z1 - z, z - z1 - tileset.cell), 0.0);
+	return sqrt(dx * dx + dz * dz);
+}
+
+void unlink_tile(int t)
+{
+	// Take the objects of live tile T out of the grid and hand it back to
+	//  the loader
+
+	world_type *world = &tileset.tile[t].world;
+	for (int o = 0; o < world->number_of_objects; o++) {
+		grid_remove(&world->obj[o]);
+	}
+	queue_tile(t, TILE_FREEING);
+}
+
+void stream_tiles(long long x, long long z, double heading)
+{
+	// Load the tiles around a point ahead of the viewer at world X,Z,
+	//  facing HEADING degrees, and free the ones left behind. Never waits
+	//  for the loader; tiles appear in the grid when they are ready.
+
+	// The flight model moves along -sin and +cos of the heading:
+	double lx = x - tileset.radius / 4 * sin(heading * M_PI / 180);
+	double lz = z + tileset.radius / 4 * cos(heading * M_PI / 180);
+	float keep = tileset.radius * 1.25;
+
+	// File loaded tiles in the grid, a few per frame, and hand the ones
+	//  that have fallen out of range back to the loader:
+	int links = 0, inflight = 0;
+	for (int i = 0; i < tileset.residents; i++) {
+		int t = tileset.resident[i];
+		tile_type *tile = &tileset.tile[t];
+		float d = tile_distance(t, lx, lz);
+		switch (SDL_AtomicGet(&tile->state)) {
+		case TILE_EMPTY:
+			tileset.used -= tile->bytes;
+			tileset.resident[i--] = tileset.resident[--tileset.residents];
+			break;
+		case TILE_QUEUED:
+			inflight++;
+			break;
+		case TILE_READY:
+			if (d > keep) {
+				queue_tile(t, TILE_FREEING);
+			} else if (links < TILE_LINKS) {
+				for (int o = 0; o < tile->world.number_of_objects; o++) {
+					object_type *object = &tile->world.obj[o];
+					object->sequence = (unsigned long long)t << 32 | o;
+					update(object);
+					find_extent(object);
+					grid_insert(object);
+				}
+				SDL_AtomicSet(&tile->state, TILE_LIVE);
+				links++;
+			}
+			break;
+		case TILE_LIVE:
+			if (d > keep) {
+				unlink_tile(t);
+			}
+			break;
+		case TILE_FAILED:
+			// Never queue it again, and end the main loop:
+			printf("%s", tileset.error);
+			tile->size = 0;
+			SDL_AtomicSet(&tile->state, TILE_EMPTY);
+			SDL_AtomicSet(&RETRO.quit, 1);
+			break;
+		}
+	}
+
+	// Queue the nearest missing tiles within the radius, as long as they
+	//  fit in the budget, or the farthest live tile is farther away:
+	int r = tileset.radius / tileset.cell + 1;
+	int cx = (lx - tileset.x0) / tileset.cell;
+	int cz = (lz - tileset.z0) / tileset.cell;
+	while (inflight < TILE_INFLIGHT) {
+		int nearest = -1;
+		float nearestd = tileset.radius;
+		for (int tz = MAX(cz - r, 0); tz <= MIN(cz + r, tileset.rows - 1); tz++) {
+			for (int tx = MAX(cx - r, 0); tx <= MIN(cx + r, tileset.columns - 1); tx++) {
+				int t = tz * tileset.columns + tx;
+				tile_type *tile = &tileset.tile[t];
+				if (tile->size && SDL_AtomicGet(&tile->state) == TILE_EMPTY) {
+					float d = tile_distance(t, lx, lz);
+					if (d < nearestd) {
+						nearest = t;
+						nearestd = d;
+					}
+				}
+			}
+		}
+		if (nearest < 0) {
+			break;
+		}
+		tile_type *tile = &tileset.tile[nearest];
+		if (tileset.used + tile->bytes > tileset.budget) {
+			int farthest = -1;
+			float farthestd = nearestd;
+			for (int i = 0; i < tileset.residents; i++) {
+				int t = tileset.resident[i];
+				float d = tile_distance(t, lx, lz);
+				if (SDL_AtomicGet(&tileset.tile[t].state) == TILE_LIVE && d > farthestd) {
+					farthest = t;
+					farthestd = d;
+				}
+			}
+			if (farthest < 0) {
+				break;
+			}
+			unlink_tile(farthest);
+			break;
+		}
+		tileset.used += tile->bytes;
+		tileset.resident[tileset.residents++] = nearest;
+		queue_tile(nearest, TILE_QUEUED);
+		inflight++;
+	}
+}
+
+#endif
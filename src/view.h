@@ -4,13 +4,67 @@
 
 #include "drawpoly.h"
 
+#define RAMP_LEVELS 16         // maximum number of sky and ground ramp colors
+#define FOG_LEVELS 8           // maximum number of fog shade tables
+#define SHADE_LEVELS 16        // maximum number of light levels
+#define GRID_CELL 2048         // side of a grid cell in world units
+#define GRID_FAR 32767         // distance beyond which nothing is drawn
+#define LOD_BAND 0.15          // fraction of a switch size an object must pass it by
+
 int xorigin, yorigin;
 int xmin, ymin, xmax, ymax;
+mask_type *overlay;            // parts of the window hidden by an overlay
 int distance, ground, sky;
 unsigned char *screen_buffer;
 
 int screen_width, screen_height;
-polygon_list_type polylist;
+int polygon_count;             // number of polygons in the world
+unsigned long align_stamp;     // stamp of vertices aligned this frame
+polygon_list_type polylist;    // allocated from the frame arena by display()
+long long origin_x, origin_y, origin_z;  // where world coordinates are measured from
+
+unsigned char sky_ramp[RAMP_LEVELS];     // sky colors from the horizon up
+unsigned char ground_ramp[RAMP_LEVELS];  // ground colors from the horizon down
+int ramp_levels;               // number of ramp colors, 0 for flat sky and ground
+float ramp_angle;              // angle above or below the horizon per ramp color
+
+unsigned char fog_table[FOG_LEVELS][256];  // polygon colors for each depth
+int fog_levels;                // number of fog tables, 0 for no fog
+int fog_near, fog_far;         // depth range over which the fog thickens
+
+unsigned char shade_table[SHADE_LEVELS][256];  // polygon colors for each light level
+int shade_levels;              // number of light levels, 0 for unlit polygons
+float sun_x, sun_y, sun_z;     // unit vector towards the sun in world coordinates
+float ambient;                 // light level of polygons facing away from the sun
+
+struct grid_link {             // One object filed under one grid cell
+	object_type *object;
+	int next;                  // Next link in the cell, -1 for none
+};
+
+struct grid_type {             // Uniform grid over the world's x/z plane
+	long x0, z0;               // World coordinates of the grid's corner
+	int width, depth;          // Number of cells along x and z
+	int *cell;                 // First link of each cell, -1 for none
+	grid_link *link;           // Links, unused ones chained from free
+	int links, free;
+	int objects;               // Number of objects filed
+	unsigned long stamp;       // Counts queries, to report objects once
+	object_type **moved;       // Objects to refile at the next display()
+	int moves, moveroom;
+};
+
+grid_type grid;
+
+enum { STAGE_CLEAR, STAGE_QUERY, STAGE_UPDATE, STAGE_LIST, STAGE_SORT, STAGE_DRAW, STAGES };
+
+unsigned long long stage_ticks[STAGES];  // performance counter ticks display() spent in each stage
+unsigned long long stage_start;
+
+struct sort_key {
+	long double distance;
+	int index;
+};
 
 void setview(int xo, int yo, int xmn, int ymn, int xmx, int ymx, int dist, int grnd, int sk, unsigned char *screen_buf)
 {
@@ -28,11 +82,87 @@ void setview(int xo, int yo, int xmn, int ymn, int xmx, int ymx, int dist, int g
 	screen_buffer = screen_buf; // Buffer address for screen
 	screen_width = (xmax - xmin) / 2;
 	screen_height = (ymax - ymin) / 2;
+	overlay = NULL;
+}
+
+void setmask(mask_type *mask)
+{
+	// Skip drawing the parts of the window outside the visible ranges of
+	// MASK, which will be covered by an overlay such as the cockpit
+
+	overlay = mask;
+}
+
+void setramps(const unsigned char *skyramp, const unsigned char *groundramp, int levels, float degrees)
+{
+	// Shade sky and ground with LEVELS palette colors each, starting at
+	// the horizon, and changing color every DEGREES away from it
+
+	ramp_levels = MIN(levels, RAMP_LEVELS);
+	for (int i = 0; i < ramp_levels; i++) {
+		sky_ramp[i] = skyramp[i];
+		ground_ramp[i] = groundramp[i];
+	}
+	ramp_angle = degrees * M_PI / 180;
+}
+
+void setfog(unsigned char table[][256], int levels, int nearz, int farz)
+{
+	// Recolor polygons with the shade tables in TABLE, from the first for
+	// polygons up to NEARZ away to the last for polygons FARZ or more away
+
+	fog_levels = MIN(levels, FOG_LEVELS);
+	memcpy(fog_table, table, fog_levels * 256);
+	fog_near = nearz;
+	fog_far = farz;
+}
+
+void setlight(unsigned char table[][256], int levels, float sx, float sy, float sz, float amb)
+{
+	// Light polygons from direction SX,SY,SZ with LEVELS shade tables in
+	// TABLE, from the darkest to the full polygon color. AMB is the part of
+	// full light that reaches polygons facing away from the sun.
+
+	shade_levels = MIN(levels, SHADE_LEVELS);
+	memcpy(shade_table, table, shade_levels * 256);
+	float length = sqrtf(sx * sx + sy * sy + sz * sz);
+	sun_x = sx / length;
+	sun_y = sy / length;
+	sun_z = sz / length;
+	ambient = amb;
+}
+
+void object_sun(object_type *object, float sun[3])
+{
+	// Find the direction towards the sun in the coordinates of OBJECT,
+	//  by undoing its rotation: its rows, made unit length, are the
+	//  rotation's inverse
+
+	for (int i = 0; i < 3; i++) {
+		int *row = object->orient[i];
+		float length = sqrtf((float)row[0] * row[0] + (float)row[1] * row[1] + (float)row[2] * row[2]);
+		sun[i] = length > 0 ? (row[0] * sun_x + row[1] * sun_y + row[2] * sun_z) / length : 0;
+	}
+}
+
+int light_level(polygon_type *poly, float sun[3])
+{
+	// Find the light level of POLY from the angle between the unit normal
+	//  of its plane and SUN, both in the coordinates of its object
+
+	// Lambertian diffuse light on top of the ambient light:
+	float diffuse = MAX(poly->a * sun[0] + poly->b * sun[1] + poly->c * sun[2], 0.0);
+	float light = ambient + (1 - ambient) * diffuse;
+	return CLAMP(light * shade_levels, 0, shade_levels);
 }
 
 void initworld(int polycount)
 {
-	polylist.polygon = new polygon_type[polycount];
+	// Reserve frame arena memory for the polygon list, its sorted copy and
+	// the sort keys with their merge buffer, the visible objects with
+	// theirs, and the vertices of instances with the pointers to them:
+	polygon_count = polycount;
+	RETRO_ReserveArena(1024 + polycount * (2 * sizeof(polygon_type) + 2 * sizeof(sort_key) + 2 * sizeof(object_type *) + sizeof(vertex_type) + 4 * sizeof(vertex_type *) + 6 * RETRO_ARENA_ALIGN));
 }
 
 void cproject(clipped_polygon_type *clip)
@@ -261,22 +391,50 @@ void xyclip(clipped_polygon_type *clip)
 
 void z_sort(polygon_list_type *polylist)
 {
-	int swapflag = -1;
-	while (swapflag) {
-		swapflag = 0;
-		for (int i = 0; i < (polylist->number_of_polygons - 1); i++) {
-			if (polylist->polygon[i].distance
-				< polylist->polygon[i + 1].distance) {
-				polygon_type temp = polylist->polygon[i];
-				polylist->polygon[i] = polylist->polygon[i + 1];
-				polylist->polygon[i + 1] = temp;
-				swapflag = -1;
+	// Sort polygons from farthest to nearest. This is a stable merge sort
+	//  of distance keys, so polygons at equal distances keep their order:
+
+	int count = polylist->number_of_polygons;
+	sort_key *key = (sort_key *)RETRO_ArenaAlloc(count * sizeof(sort_key));
+	sort_key *merged = (sort_key *)RETRO_ArenaAlloc(count * sizeof(sort_key));
+	for (int i = 0; i < count; i++) {
+		key[i].distance = polylist->polygon[i].distance;
+		key[i].index = i;
+	}
+
+	// Merge runs of doubling width until one run is left:
+	for (int width = 1; width < count; width *= 2) {
+		for (int left = 0; left < count; left += 2 * width) {
+			int mid = MIN(left + width, count);
+			int right = MIN(left + 2 * width, count);
+			int i = left, j = mid, k = left;
+			while (i < mid && j < right) {
+				// Take from the right run only if strictly farther:
+				if (key[i].distance < key[j].distance) {
+					merged[k++] = key[j++];
+				} else {
+					merged[k++] = key[i++];
+				}
+			}
+			while (i < mid) {
+				merged[k++] = key[i++];
+			}
+			while (j < right) {
+				merged[k++] = key[j++];
 			}
 		}
+		SWAP(key, merged);
+	}
+
+	// Gather the polygons in sorted order:
+	polygon_type *sorted = (polygon_type *)RETRO_ArenaAlloc(count * sizeof(polygon_type));
+	for (int i = 0; i < count; i++) {
+		sorted[i] = polylist->polygon[key[i].index];
 	}
+	polylist->polygon = sorted;
 }
 
-int z_overlap(polygon_type poly1, polygon_type poly2)
+int z_overlap(polygon_type *poly1, polygon_type *poly2)
 {
 	// Check for overlap in the z extent between POLY1 and
 	//  POLY2.
@@ -286,7 +444,7 @@ int z_overlap(polygon_type poly1, polygon_type poly2)
 	//  equal to or greater than the maximum z or POLY1 then
 	//  return zero, indicating no overlap in the z extent:
 
-	if ((poly1.zmin >= poly2.zmax) || (poly2.zmin >= poly1.zmax)) {
+	if ((poly1->zmin >= poly2->zmax) || (poly2->zmin >= poly1->zmax)) {
 		return 0;
 	}
 
@@ -294,18 +452,18 @@ int z_overlap(polygon_type poly1, polygon_type poly2)
 	return -1;
 }
 
-int xy_overlap(polygon_type poly1, polygon_type poly2)
+int xy_overlap(polygon_type *poly1, polygon_type *poly2)
 {
 	// Check for overlap in the x and y extents, return
 	//  non-zero if both are found, otherwise return zero.
 
 	// If no overlap in the x extent, return zero:
-	if ((poly1.xmin > poly2.xmax) || (poly2.xmin > poly1.xmax)) {
+	if ((poly1->xmin > poly2->xmax) || (poly2->xmin > poly1->xmax)) {
 		return 0;
 	}
 
 	// If no overlap in the y extent, return zero:
-	if ((poly1.ymin > poly2.ymax) || (poly2.ymin > poly1.ymax)) {
+	if ((poly1->ymin > poly2->ymax) || (poly2->ymin > poly1->ymax)) {
 		return 0;
 	}
 
@@ -313,121 +471,55 @@ int xy_overlap(polygon_type poly1, polygon_type poly2)
 	return -1;
 }
 
-int surface_outside(polygon_type poly1, polygon_type poly2)
+int backface(polygon_type *p, double eye[3])
 {
-	// Check to see if poly2 is inside the surface of poly1.
-
-	long double surface;
-
-	// Determine the coefficients of poly2:
-	float x1 = poly2.vertex[0]->ax;
-	float y1 = poly2.vertex[0]->ay;
-	float z1 = poly2.vertex[0]->az;
-	float x2 = poly2.vertex[1]->ax;
-	float y2 = poly2.vertex[1]->ay;
-	float z2 = poly2.vertex[1]->az;
-	float x3 = poly2.vertex[2]->ax;
-	float y3 = poly2.vertex[2]->ay;
-	float z3 = poly2.vertex[2]->az;
-	float a = y1 * (z2 - z3) + y2 * (z3 - z1) + y3 * (z1 - z2);
-	float b = z1 * (x2 - x3) + z2 * (x3 - x1) + z3 * (x1 - x2);
-	float c = x1 * (y2 - y3) + x2 * (y3 - y1) + x3 * (y1 - y2);
-	float d = -x1 * (y2 * z3 - y3 * z2) - x2 * (y3 * z1 - y1 * z3) - x3 * (y1 * z2 - y2 * z1);
-
-	// Plug the vertices of poly1 into the plane equation of poly2, one by one:
-	int flunked = 0;
-	for (int v = 0; v < poly1.number_of_vertices; v++) {
-		if ((surface = a * (poly1.vertex[v]->ax) + b * (poly1.vertex[v]->ay)
-			+ c * (poly1.vertex[v]->az) + d) < 0) {
-			flunked = -1; // If less than 0, we flunked
-			break;
-		}
-		int zz = 1;
-	}
+	// 	 Returns 0 if POLYGON is visible, -1 if not.
+	//   POLYGON must be part of a convex polyhedron, and EYE the viewer
+	//   in the coordinates of its object
 
-	// Return 0 if flunked, -1 if not flunked.
-	return !flunked;
+	// The polygon faces away if the viewer is behind its plane:
+	return (p->a * eye[0] + p->b * eye[1] + p->c * eye[2] + p->d) < 0;
 }
 
-int surface_inside(polygon_type poly1, polygon_type poly2)
+void object_eye(object_type *object, view_type *view, double eye[3])
 {
-	// Determine the coefficients of poly1:
-
-	float surface;
-
-	float x1 = poly1.vertex[0]->ax;
-	float y1 = poly1.vertex[0]->ay;
-	float z1 = poly1.vertex[0]->az;
-	float x2 = poly1.vertex[1]->ax;
-	float y2 = poly1.vertex[1]->ay;
-	float z2 = poly1.vertex[1]->az;
-	float x3 = poly1.vertex[2]->ax;
-	float y3 = poly1.vertex[2]->ay;
-	float z3 = poly1.vertex[2]->az;
-	float a = y1 * (z2 - z3) + y2 * (z3 - z1) + y3 * (z1 - z2);
-	float b = z1 * (x2 - x3) + z2 * (x3 - x1) + z3 * (x1 - x2);
-	float c = x1 * (y2 - y3) + x2 * (y3 - y1) + x3 * (y1 - y2);
-	float d = -x1 * (y2 * z3 - y3 * z2) - x2 * (y3 * z1 - y1 * z3) - x3 * (y1 * z2 - y2 * z1);
-
-	// Plug the vertices of poly2 into the plane equation of poly1, one by one:
-	int flunked = 0;
-	for (int v = 0; v < poly2.number_of_vertices; v++) {
-		if ((surface = a * (poly2.vertex[v]->ax) + b * (poly2.vertex[v]->ay)
-			+ c * (poly2.vertex[v]->az) + d) > 0) {
-			flunked = -1;  // If greater than 0, we flunked
-			break;
-		}
-		int zz = 1;
+	// Find where the viewer of VIEW is in the coordinates of OBJECT, by
+	//  undoing its move and then its rotation and scale. The rows of its
+	//  orientation are at right angles, so transposing them and dividing
+	//  out their lengths inverts it.
+
+	double x = view->copx - (object->x - origin_x);
+	double y = view->copy - (object->y - origin_y);
+	double z = view->copz - (object->z - origin_z);
+	for (int i = 0; i < 3; i++) {
+		int *row = object->orient[i];
+		double length = (double)row[0] * row[0] + (double)row[1] * row[1] + (double)row[2] * row[2];
+		eye[i] = length > 0 ? ONE * (x * row[0] + y * row[1] + z * row[2]) / length : 0;
 	}
-
-	// Return 0 if flunked, -1 if not flunked.
-	return !flunked;
-}
-
-int should_be_swapped(polygon_type poly1, polygon_type poly2)
-{
-	// Check to see if POLY1 and POLY2 are in the wrong order for the Painter's Algorithm.
-
-	// Check for overlap in the x and/or y extents:
-	if (!xy_overlap(poly1, poly2)) return 0;
-
-	// Check to see if poly1 is on the correct side of poly2:
-	if (surface_outside(poly1, poly2)) return 0;
-
-	// Check to see if poly2 is on the correct side of poly1:
-	if (surface_inside(poly1, poly2)) return 0;
-
-	// If we've made it this far, all tests have been flunked, so return non-zero.
-	return -1;
 }
 
-int	backface(polygon_type p)
+vertex_type *place_instance(object_type *object)
 {
-	// 	 Returns 0 if POLYGON is visible, -1 if not.
-	//   POLYGON must be part of a convex polyhedron
-
-	vertex_type *v0, *v1, *v2;  // Pointers to three vertices
-
-	// Point to vertices:
-	v0 = p.vertex[0];
-	v1 = p.vertex[1];
-	v2 = p.vertex[2];
-	float x1 = v0->ax;
-	float x2 = v1->ax;
-	float x3 = v2->ax;
-	float y1 = v0->ay;
-	float y2 = v1->ay;
-	float y3 = v2->ay;
-	float z1 = v0->az;
-	float z2 = v1->az;
-	float z3 = v2->az;
-
-	// Calculate dot product:
-	float c = (x3 * ((z1 * y2) - (y1 * z2))) + (y3 * ((x1 * z2) - (z1 * x2))) + (z3 * ((y1 * x2) - (x1 * y2)));
-	return(c < 0);
+	// Transform the vertices of the library mesh of instance OBJECT the
+	//  way update() transforms those of other objects, into frame arena
+	//  memory, and return them
+
+	mesh_type *mesh = object->shared;
+	vertex_type *vertex = (vertex_type *)RETRO_ArenaAlloc(mesh->number_of_vertices * sizeof(vertex_type));
+	long ox = object->x - origin_x, oy = object->y - origin_y, oz = object->z - origin_z;
+	int (*m)[3] = object->orient;
+	for (int v = 0; v < mesh->number_of_vertices; v++) {
+		vertex_type *lptr = &mesh->vertex[v];
+		vertex_type *vptr = &vertex[v];
+		vptr->wx = (((int)lptr->lx * m[0][0] + (int)lptr->ly * m[1][0] + (int)lptr->lz * m[2][0]) >> SHIFT) + ox;
+		vptr->wy = (((int)lptr->lx * m[0][1] + (int)lptr->ly * m[1][1] + (int)lptr->lz * m[2][1]) >> SHIFT) + oy;
+		vptr->wz = (((int)lptr->lx * m[0][2] + (int)lptr->ly * m[1][2] + (int)lptr->lz * m[2][2]) >> SHIFT) + oz;
+		vptr->stamp = 0;
+	}
+	return vertex;
 }
 
-void alignview(world_type *world, view_type view)
+void alignview(view_type view)
 {
 	// Initialize transformation matrices:
 	inittrans();
@@ -438,10 +530,9 @@ void alignview(world_type *world, view_type view)
 	// Rotate all objects in universe around origin:
 	rotate(-view.xangle, -view.yangle, -view.zangle);
 
-	// Now perform the transformation on every object in the universe:
-	for (int i = 0; i < world->number_of_objects; i++) {
-		atransform(&world->obj[i]);  // Transform object i
-	}
+	// Vertices are aligned on demand by make_polygon_list(), so start
+	//  a new frame's worth of them:
+	align_stamp++;
 }
 
 void update(object_type *object)
@@ -456,38 +547,61 @@ void update(object_type *object)
 		// Create rotation matrix:
 		rotate(object->xangle, object->yangle, object->zangle);
 
-		// Create translation matrix:
-		translate(object->x, object->y, object->z);
+		// Keep it, to take the viewer into object coordinates for
+		//  backface removal:
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++) {
+				object->orient[i][j] = matrix[i][j];
+			}
+		}
+
+		// Light its polygons from its new orientation. Instances share
+		//  their polygons, so make_polygon_list() lights those instead:
+		if (shade_levels && !object->shared) {
+			float sun[3];
+			object_sun(object, sun);
+			for (int p = 0; p < object->number_of_polygons; p++) {
+				object->polygon[p].light = light_level(&object->polygon[p], sun);
+			}
+		}
 
 		// Transform OBJECT with master transformation matrix:
 		transform(object);
 
+		// Move it to its place relative to the world origin in use. This
+		//  is the translation matrix's job, done in 64 bits so that objects
+		//  far from the origin do not overflow:
+		long ox = object->x - origin_x, oy = object->y - origin_y, oz = object->z - origin_z;
+		for (int v = 0; v < object->number_of_vertices; v++) {
+			object->vertex[v].wx += ox;
+			object->vertex[v].wy += oy;
+			object->vertex[v].wz += oz;
+		}
+
 		// Indicate update complete:
 		object->update = 0;
 	}
 }
 
+int ramp_color(unsigned char *ramp, int color, int x, int y, float yleft, float slope, float perpendicular)
+{
+	// Pick the ramp color for a span of sky or ground centered on X, from the
+	//  angle between the horizon line and the direction to that point
+
+	if (!ramp_levels) {
+		return color;
+	}
+	float d = fabsf(y - (yleft + slope * (x - xmin))) * perpendicular;
+	int level = atanf(d / distance) / ramp_angle;
+	return ramp[MIN(level, ramp_levels - 1)];
+}
+
 void draw_horizon(int xangle, int yangle, int zangle, unsigned char *screen)
 {
 	long rx1, rx2, temp_rx1, temp_rx2;
 	long ry1, ry2, temp_ry1, temp_ry2;
 	long rz1, rz2, temp_rz1, temp_rz2;
 
-	vertex_type vert[4];
-	polygon_type hpoly;
-	clipped_polygon_type hclip;
-
-	// Allocate memory for polygon and vertices
-	hpoly.vertex = new vertex_type * [4];
-	hpoly.vertex[0] = &vert[0];
-	hpoly.vertex[1] = &vert[1];
-	hpoly.vertex[2] = &vert[2];
-	hpoly.vertex[3] = &vert[3];
-	vert[0].az = distance;
-	vert[1].az = distance;
-	vert[2].az = distance;
-	vert[3].az = distance;
-
 	// Map rotation angle to remove backward wrap-around:
 	int flip = 0;
 	xangle &= 255;
@@ -536,75 +650,376 @@ void draw_horizon(int xangle, int yangle, int zangle, unsigned char *screen)
 	rx2 = (float)distance * ((float)rx2 / (float)z) + xorigin;
 	ry2 = (float)distance * ((float)ry2 / (float)z) + yorigin;
 
-	// Create sky and ground polygons, then clip to screen window
+	// Fill the window with sky and ground, one scanline at a time, instead
+	//  of clipping and drawing two huge polygons over a cleared window
 
 	// Obtain delta x and delta y:
 	int dx = rx2 - rx1; int dy = ry2 - ry1;
-	int line_ready = 0;
-	hpoly.number_of_vertices = 4;
 
 	// Cheat to avoid divide error:
 	if (!dx) {
 		dx++;
 	}
 
-	// Obtain slope of line:
+	// Obtain slope of line and where it crosses the left edge of the window:
 	float slope = (float)dy / (float)dx;
+	float yleft = slope * (xmin - rx1) + ry1;
+
+	// Pixels on or below the line get the ground color, unless flipped:
+	int below = (flip & 1) ? sky : ground;
+	int above = (flip & 1) ? ground : sky;
+	unsigned char *belowramp = (flip & 1) ? sky_ramp : ground_ramp;
+	unsigned char *aboveramp = (flip & 1) ? ground_ramp : sky_ramp;
+
+	// Scale from vertical distance to distance from the line:
+	float perpendicular = 1 / sqrtf(1 + slope * slope);
+
+	int ylast = overlay ? MIN(ymax, overlay->ylast) : ymax;
+	for (int y = ymin; y <= ylast; y++) {
+		// Find the first and last pixel of the row below the line:
+		int x1 = xmin, x2 = xmax;
+		if (slope > 0) {
+			// Line descends to the right, so the left part is below it
+			float x = xmin + (y - yleft) / slope;
+			x2 = (x < xmin) ? xmin - 1 : (x > xmax) ? xmax : (int)x;
+		} else if (slope < 0) {
+			// Line ascends to the right, so the right part is below it
+			float x = ceilf(xmin + (y - yleft) / slope);
+			x1 = (x < xmin) ? xmin : (x > xmax) ? xmax + 1 : (int)x;
+		} else if (y < yleft) {
+			x1 = xmax + 1;
+		}
+
+		// Draw the row as a span above the line and a span below it:
+		int offset = 320 * y;
+		if (x1 > x2) {
+			drawspan(screen, offset + xmin, xmax - xmin, y, ramp_color(aboveramp, above, (xmin + xmax) / 2, y, yleft, slope, perpendicular), overlay);
+		} else {
+			if (x1 > xmin) {
+				drawspan(screen, offset + xmin, x1 - 1 - xmin, y, ramp_color(aboveramp, above, (xmin + x1 - 1) / 2, y, yleft, slope, perpendicular), overlay);
+			}
+			drawspan(screen, offset + x1, x2 - x1, y, ramp_color(belowramp, below, (x1 + x2) / 2, y, yleft, slope, perpendicular), overlay);
+			if (x2 < xmax) {
+				drawspan(screen, offset + x2 + 1, xmax - x2 - 1, y, ramp_color(aboveramp, above, (x2 + 1 + xmax) / 2, y, yleft, slope, perpendicular), overlay);
+			}
+		}
+	}
+}
+
+void grid_cells(object_type *object)
+{
+	// Find the range of grid cells covered by OBJECT's world extent,
+	//  clamped to the grid, so objects off the grid go in its border cells
+
+	object->cx1 = CLAMP((object->wxmin - grid.x0) / GRID_CELL, 0, grid.width);
+	object->cx2 = CLAMP((object->wxmax - grid.x0) / GRID_CELL, 0, grid.width);
+	object->cz1 = CLAMP((object->wzmin - grid.z0) / GRID_CELL, 0, grid.depth);
+	object->cz2 = CLAMP((object->wzmax - grid.z0) / GRID_CELL, 0, grid.depth);
+}
+
+void grid_insert(object_type *object)
+{
+	// File OBJECT under every grid cell its extent covers
+
+	grid_cells(object);
+	grid.objects++;
+	for (int cz = object->cz1; cz <= object->cz2; cz++) {
+		for (int cx = object->cx1; cx <= object->cx2; cx++) {
+			if (grid.free < 0) {
+				// Double the links, chaining the new ones as free:
+				int links = grid.links ? grid.links * 2 : 256;
+				grid.link = (grid_link *)realloc(grid.link, links * sizeof(grid_link));
+				if (grid.link == NULL) {
+					RETRO_RageQuit("Cannot allocate grid memory\n");
+				}
+				for (int i = grid.links; i < links; i++) {
+					grid.link[i].object = NULL;
+					grid.link[i].next = (i + 1 < links) ? i + 1 : -1;
+				}
+				grid.free = grid.links;
+				grid.links = links;
+			}
+			int l = grid.free;
+			int *cell = &grid.cell[cz * grid.width + cx];
+			grid.free = grid.link[l].next;
+			grid.link[l].object = object;
+			grid.link[l].next = *cell;
+			*cell = l;
+		}
+	}
+}
 
-	// Calculate line of horizon:
-	vert[0].ax = xmin;
-	vert[0].ay = slope * (xmin - rx1) + ry1;
-	vert[1].ax = xmax;
-	vert[1].ay = slope * (xmax - rx1) + ry1;
+void grid_remove(object_type *object)
+{
+	// Take OBJECT out of the grid cells it is filed under
+
+	grid.objects--;
+	for (int cz = object->cz1; cz <= object->cz2; cz++) {
+		for (int cx = object->cx1; cx <= object->cx2; cx++) {
+			int *prev = &grid.cell[cz * grid.width + cx];
+			while (*prev >= 0 && grid.link[*prev].object != object) {
+				prev = &grid.link[*prev].next;
+			}
+			if (*prev >= 0) {
+				int l = *prev;
+				*prev = grid.link[l].next;
+				grid.link[l].object = NULL;
+				grid.link[l].next = grid.free;
+				grid.free = l;
+			}
+		}
+	}
+}
 
-	// Create ground polygon:
-	if (flip & 1) {
-		hpoly.color = sky;
-	} else {     // If flipped, it's the sky polygon:
-		hpoly.color = ground;
+void find_extent(object_type *object)
+{
+	// Find the world x and z extent of OBJECT's vertices. An instance
+	//  is not always transformed, so its extent is a square around its
+	//  origin instead.
+
+	if (object->shared) {
+		object->wxmin = object->x - origin_x - object->radius;
+		object->wxmax = object->x - origin_x + object->radius;
+		object->wzmin = object->z - origin_z - object->radius;
+		object->wzmax = object->z - origin_z + object->radius;
+		return;
+	}
+	object->wxmin = object->wzmin = LONG_MAX;
+	object->wxmax = object->wzmax = LONG_MIN;
+	for (int v = 0; v < object->number_of_vertices; v++) {
+		vertex_type *vptr = &object->vertex[v];
+		object->wxmin = MIN(object->wxmin, vptr->wx);
+		object->wxmax = MAX(object->wxmax, vptr->wx);
+		object->wzmin = MIN(object->wzmin, vptr->wz);
+		object->wzmax = MAX(object->wzmax, vptr->wz);
 	}
+}
 
-	// Set vertex coordinates:
-	vert[2].ax = 32767;
-	vert[2].ay = 32767;
-	vert[3].ax = -32767;
-	vert[3].ay = 32767;
+void makegrid(long x1, long z1, long x2, long z2)
+{
+	// Set up an empty grid covering world x from X1 to X2 and z from Z1 to Z2
+
+	grid.x0 = x1;
+	grid.z0 = z1;
+	grid.width = (x2 - x1) / GRID_CELL + 1;
+	grid.depth = (z2 - z1) / GRID_CELL + 1;
+	grid.cell = (int *)malloc(grid.width * grid.depth * sizeof(int));
+	if (grid.cell == NULL) {
+		RETRO_RageQuit("Cannot allocate grid memory\n");
+	}
+	for (int c = 0; c < grid.width * grid.depth; c++) {
+		grid.cell[c] = -1;
+	}
+	grid.free = -1;
+	grid.objects = 0;
+}
 
-	// Clip ground polygon:
-	zclip(&hpoly, &hclip);
-	xyclip(&hclip);
+void initgrid(world_type *world)
+{
+	// Transform every object into world coordinates, then build a grid
+	//  over their extent and file each object under the cells it covers
 
-	// Draw ground polygon:
-	if (hclip.number_of_vertices) {
-		drawpoly(&hclip, screen);
+	long x1 = LONG_MAX, z1 = LONG_MAX, x2 = LONG_MIN, z2 = LONG_MIN;
+	for (int i = 0; i < world->number_of_objects; i++) {
+		object_type *object = &world->obj[i];
+		update(object);
+		find_extent(object);
+		x1 = MIN(x1, object->wxmin);
+		z1 = MIN(z1, object->wzmin);
+		x2 = MAX(x2, object->wxmax);
+		z2 = MAX(z2, object->wzmax);
+	}
+	if (x1 > x2) {
+		x1 = x2 = z1 = z2 = 0;
 	}
 
-	// Create sky polygon:
-	if (flip & 1) hpoly.color = ground;
+	makegrid(x1, z1, x2, z2);
+	for (int i = 0; i < world->number_of_objects; i++) {
+		grid_insert(&world->obj[i]);
+	}
+}
 
-	// If flipped it's the ground polygon:
-	else hpoly.color = sky;
+void freegrid()
+{
+	// Free the grid, before unloading the world it was made for
+
+	free(grid.cell);
+	free(grid.link);
+	grid.cell = NULL;
+	grid.link = NULL;
+	grid.links = 0;
+	grid.objects = 0;
+	grid.moves = 0;
+}
 
-	// Set vertex coordinates:
-	vert[2].ax = 32767;
-	vert[2].ay = -32767;
-	vert[3].ax = -32767;
-	vert[3].ay = -32767;
+void regrid(object_type *object)
+{
+	// Move OBJECT to its new place after changing its position, rotation
+	//  or scale, and setting its update flag
+
+	object->update = 1;
+	update(object);
+	find_extent(object);
+	grid_remove(object);
+	grid_insert(object);
+}
 
-	// Clip sky polygon:
-	zclip(&hpoly, &hclip);
-	xyclip(&hclip);
+void move_object(object_type *object)
+{
+	// Have display() refile OBJECT in the grid after changing its position,
+	//  rotation or scale, whether or not it is in view
+
+	if (object->update) {
+		return;
+	}
+	object->update = 1;
+	if (grid.moves == grid.moveroom) {
+		grid.moveroom = grid.moveroom ? grid.moveroom * 2 : 64;
+		grid.moved = (object_type **)realloc(grid.moved, grid.moveroom * sizeof(object_type *));
+		if (grid.moved == NULL) {
+			RETRO_RageQuit("Cannot allocate grid memory\n");
+		}
+	}
+	grid.moved[grid.moves++] = object;
+}
+
+void rebase(long long x, long long y, long long z)
+{
+	// Move the origin of world coordinates to X,Y,Z, so that they stay
+	//  small around a viewer far from the world's own origin. Everything
+	//  already in world coordinates shifts along with it.
+
+	long dx = x - origin_x, dy = y - origin_y, dz = z - origin_z;
+	origin_x = x;
+	origin_y = y;
+	origin_z = z;
+
+	grid.x0 -= dx;
+	grid.z0 -= dz;
+	grid.stamp++;
+	for (int l = 0; l < grid.links; l++) {
+		object_type *object = grid.link[l].object;
+		if (object == NULL || object->stamp == grid.stamp) {
+			continue;
+		}
+		object->stamp = grid.stamp;
+		for (int v = 0; v < object->number_of_vertices; v++) {
+			object->vertex[v].wx -= dx;
+			object->vertex[v].wy -= dy;
+			object->vertex[v].wz -= dz;
+		}
+		object->wxmin -= dx;
+		object->wxmax -= dx;
+		object->wzmin -= dz;
+		object->wzmax -= dz;
+	}
+}
+
+void select_lod(object_type *object, view_type *view)
+{
+	// Pick the level of detail OBJECT is drawn at from its size on the
+	//  screen. An object has to get LOD_BAND smaller than the size a
+	//  level switches at before it switches, and as much larger before
+	//  it switches back, so objects near that size do not flicker.
+
+	double dx = object->x - origin_x - view->copx;
+	double dy = object->y - origin_y - view->copy;
+	double dz = object->z - origin_z - view->copz;
+	double d = sqrt(dx * dx + dy * dy + dz * dz);
+	double pixels = (d > 1) ? 2 * object->radius * distance / d : INT_MAX;
+
+	int level = object->level;
+	while (level + 1 < object->number_of_lods && pixels < object->lod[level + 1].pixels * (1 - LOD_BAND)) {
+		level++;
+	}
+	while (level > 0 && pixels > object->lod[level].pixels * (1 + LOD_BAND)) {
+		level--;
+	}
+	if (level != object->level) {
+		setmesh(object, &object->lod[level]);
+		object->level = level;
+		object->update = 1;
+	}
+}
+
+int query_grid(view_type *view, object_type **visible)
+{
+	// Put the objects in grid cells that the view volume, up to GRID_FAR
+	//  away, may overlap into VISIBLE and return how many there are.
+	//  Needs the view matrix from alignview().
+
+	// Widest view angles from the window and the viewer distance:
+	float tx = (float)MAX(xorigin - xmin, xmax - xorigin) / distance;
+	float ty = (float)MAX(yorigin - ymin, ymax - yorigin) / distance;
+
+	// Bound the viewer and the far corners of the view volume in x and z.
+	//  The transpose of the view rotation takes aligned back to world:
+	long x1 = view->copx, x2 = view->copx, z1 = view->copz, z2 = view->copz;
+	for (int corner = 0; corner < 4; corner++) {
+		float ax = ((corner & 1) ? tx : -tx) * GRID_FAR;
+		float ay = ((corner & 2) ? ty : -ty) * GRID_FAR;
+		float az = GRID_FAR;
+		long wx = view->copx + (ax * matrix[0][0] + ay * matrix[0][1] + az * matrix[0][2]) / ONE;
+		long wz = view->copz + (ax * matrix[2][0] + ay * matrix[2][1] + az * matrix[2][2]) / ONE;
+		x1 = MIN(x1, wx);
+		x2 = MAX(x2, wx);
+		z1 = MIN(z1, wz);
+		z2 = MAX(z2, wz);
+	}
 
-	// Draw sky polygon:
-	if (hclip.number_of_vertices) {
-		drawpoly(&hclip, screen);
+	// Collect the objects of the cells in range that overlap it, once:
+	int cx1 = CLAMP((x1 - grid.x0) / GRID_CELL, 0, grid.width);
+	int cx2 = CLAMP((x2 - grid.x0) / GRID_CELL, 0, grid.width);
+	int cz1 = CLAMP((z1 - grid.z0) / GRID_CELL, 0, grid.depth);
+	int cz2 = CLAMP((z2 - grid.z0) / GRID_CELL, 0, grid.depth);
+	int count = 0;
+	grid.stamp++;
+	for (int cz = cz1; cz <= cz2; cz++) {
+		for (int cx = cx1; cx <= cx2; cx++) {
+			for (int l = grid.cell[cz * grid.width + cx]; l >= 0; l = grid.link[l].next) {
+				object_type *object = grid.link[l].object;
+				if (object->stamp != grid.stamp && object->wxmax >= x1 && object->wxmin <= x2 && object->wzmax >= z1 && object->wzmin <= z2) {
+					object->stamp = grid.stamp;
+					visible[count++] = object;
+				}
+			}
+		}
 	}
 
-	// Release memory used for polygons:
-	free(hpoly.vertex);
+	// Keep world order, so that polygons at equal distances keep their
+	//  drawing order. Go by load order rather than address, which
+	//  depends on the heap. This merges runs of doubling width like
+	//  z_sort(), as qsort() may take its buffer from the heap:
+	object_type **merged = (object_type **)RETRO_ArenaAlloc(count * sizeof(object_type *));
+	object_type **sorted = visible;
+	for (int width = 1; width < count; width *= 2) {
+		for (int left = 0; left < count; left += 2 * width) {
+			int mid = MIN(left + width, count);
+			int right = MIN(left + 2 * width, count);
+			int i = left, j = mid, k = left;
+			while (i < mid && j < right) {
+				if (sorted[j]->sequence < sorted[i]->sequence) {
+					merged[k++] = sorted[j++];
+				} else {
+					merged[k++] = sorted[i++];
+				}
+			}
+			while (i < mid) {
+				merged[k++] = sorted[i++];
+			}
+			while (j < right) {
+				merged[k++] = sorted[j++];
+			}
+		}
+		SWAP(sorted, merged);
+	}
+	if (sorted != visible) {
+		memcpy(visible, sorted, count * sizeof(object_type *));
+	}
+	return count;
 }
 
-void make_polygon_list(world_type *world, polygon_list_type *polylist)
+void make_polygon_list(object_type **objects, int number_of_objects, view_type *view, polygon_list_type *polylist)
 {
 	// Create a list of all polygons potentially visible in
 	//  the viewport, removing backfaces and polygons outside
@@ -612,20 +1027,65 @@ void make_polygon_list(world_type *world, polygon_list_type *polylist)
 
 	int count = 0;  // Determine number of polygons in list
 
-	// Loop through all objects in world:
-	for (int objnum = 0; objnum < world->number_of_objects; objnum++) {
+	// Allocate room for every polygon of the objects:
+	int polycount = 0;
+	for (int objnum = 0; objnum < number_of_objects; objnum++) {
+		object_type *objptr = objects[objnum];
+		polycount += objptr->shared ? objptr->shared->number_of_polygons : objptr->number_of_polygons;
+	}
+	polylist->polygon = (polygon_type *)RETRO_ArenaAlloc(polycount * sizeof(polygon_type));
+
+	// Loop through all objects in list:
+	for (int objnum = 0; objnum < number_of_objects; objnum++) {
 
 		// Create pointer to current object:
-		object_type *objptr = &world->obj[objnum];
+		object_type *objptr = objects[objnum];
+
+		// Find the viewer in its coordinates, where its planes are:
+		double eye[3];
+		object_eye(objptr, view, eye);
+
+		// An instance draws the polygons of its library mesh, with the
+		//  vertices transformed for it this frame, and lit for it from
+		//  the sun in its coordinates:
+		int polygons = objptr->number_of_polygons;
+		polygon_type *polygon = objptr->polygon;
+		vertex_type *vertex = objptr->vertex;
+		float sun[3];
+		if (objptr->shared) {
+			polygons = objptr->shared->number_of_polygons;
+			polygon = objptr->shared->polygon;
+			vertex = place_instance(objptr);
+			if (shade_levels) {
+				object_sun(objptr, sun);
+			}
+		}
 
 		// Loop through all polygons in current object:
-		for (int polynum = 0; polynum < objptr->number_of_polygons; polynum++) {
+		for (int polynum = 0; polynum < polygons; polynum++) {
 
 			// Create pointer to current polygon:
-			polygon_type *polyptr = &objptr->polygon[polynum];
+			polygon_type *polyptr = &polygon[polynum];
 
 			// If polygon isn't a backface, consider it for list:
-			if (!backface(*polyptr)) {
+			if (!backface(polyptr, eye)) {
+				// Point an instance's polygon at its own vertices:
+				vertex_type **corner = polyptr->vertex;
+				if (objptr->shared) {
+					corner = (vertex_type **)RETRO_ArenaAlloc(polyptr->number_of_vertices * sizeof(vertex_type *));
+					for (int v = 0; v < polyptr->number_of_vertices; v++) {
+						corner[v] = vertex + (polyptr->vertex[v] - objptr->shared->vertex);
+					}
+				}
+
+				// Align the vertices this frame hasn't aligned yet:
+				for (int v = 0; v < polyptr->number_of_vertices; v++) {
+					if (corner[v]->stamp != align_stamp) {
+						align(corner[v]);
+						corner[v]->stamp = align_stamp;
+					}
+				}
+
 				// Find maximum & minimum coordinates for polygon:
 				int pxmax = -32767;  // Initialize all mins & maxes
 				int pxmin = 32767;   //  to highest and lowest
@@ -638,43 +1098,50 @@ void make_polygon_list(world_type *world, polygon_list_type *polylist)
 				//  ones with higher and lower coordinates than
 				//  current min & max:
 				for (int v = 0; v < polyptr->number_of_vertices; v++) {
-					if (polyptr->vertex[v]->ax > pxmax) {
-						pxmax = polyptr->vertex[v]->ax;
+					if (corner[v]->ax > pxmax) {
+						pxmax = corner[v]->ax;
 					}
-					if (polyptr->vertex[v]->ax < pxmin) {
-						pxmin = polyptr->vertex[v]->ax;
+					if (corner[v]->ax < pxmin) {
+						pxmin = corner[v]->ax;
 					}
-					if (polyptr->vertex[v]->ay > pymax) {
-						pymax = polyptr->vertex[v]->ay;
+					if (corner[v]->ay > pymax) {
+						pymax = corner[v]->ay;
 					}
-					if (polyptr->vertex[v]->ay < pymin) {
-						pymin = polyptr->vertex[v]->ay;
+					if (corner[v]->ay < pymin) {
+						pymin = corner[v]->ay;
 					}
-					if (polyptr->vertex[v]->az > pzmax) {
-						pzmax = polyptr->vertex[v]->az;
+					if (corner[v]->az > pzmax) {
+						pzmax = corner[v]->az;
 					}
-					if (polyptr->vertex[v]->az < pzmin) {
-						pzmin = polyptr->vertex[v]->az;
+					if (corner[v]->az < pzmin) {
+						pzmin = corner[v]->az;
 					}
 				}
 
-				// Put mins & maxes in polygon descriptor:
-				polyptr->xmin = pxmin;
-				polyptr->xmax = pxmax;
-				polyptr->ymin = pymin;
-				polyptr->ymax = pymax;
-				polyptr->zmin = pzmin;
-				polyptr->zmax = pzmax;
-
-				// Calculate center of polygon z extent:
-				float xcen = (pxmin + pxmax) / 2.0;
-				float ycen = (pymin + pymax) / 2.0;
-				float zcen = (pzmin + pzmax) / 2.0;
-				polyptr->distance = xcen * xcen + ycen * ycen + zcen * zcen;
-
 				// If polygon is in front of the view plane, add it to the polygon list:
 				if (pzmax > 1) {
-					polylist->polygon[count++] = *polyptr;
+					polygon_type *entry = &polylist->polygon[count++];
+					*entry = *polyptr;
+					entry->vertex = corner;
+
+					// Put mins & maxes in polygon descriptor:
+					entry->xmin = pxmin;
+					entry->xmax = pxmax;
+					entry->ymin = pymin;
+					entry->ymax = pymax;
+					entry->zmin = pzmin;
+					entry->zmax = pzmax;
+
+					// Calculate center of polygon z extent:
+					float xcen = (pxmin + pxmax) / 2.0;
+					float ycen = (pymin + pymax) / 2.0;
+					float zcen = (pzmin + pzmax) / 2.0;
+					entry->distance = xcen * xcen + ycen * ycen + zcen * zcen;
+
+					// Light an instance's polygon for it:
+					if (objptr->shared && shade_levels) {
+						entry->light = light_level(polyptr, sun);
+					}
 				}
 			}
 		}
@@ -695,6 +1162,17 @@ void draw_polygon_list(polygon_list_type *polylist, unsigned char *screen)
 		// Clip against front of view volume:
 		zclip(&polylist->polygon[i], &clip_array);
 
+		// Shade polygon by its angle to the sun:
+		if (shade_levels) {
+			clip_array.color = shade_table[polylist->polygon[i].light][clip_array.color];
+		}
+
+		// Fade distant polygons into the haze:
+		if (fog_levels) {
+			int level = (sqrtf(polylist->polygon[i].distance) - fog_near) * fog_levels / (fog_far - fog_near);
+			clip_array.color = fog_table[CLAMP(level, 0, fog_levels)][clip_array.color];
+		}
+
 		// Check to make sure polygon wasn't clipped out of existence
 		if (clip_array.number_of_vertices > 0) {
 			// Perform perspective projection:
@@ -706,38 +1184,91 @@ void draw_polygon_list(polygon_list_type *polylist, unsigned char *screen)
 			// Check to make sure polygon wasn't clipped out of existence:
 			if (clip_array.number_of_vertices > 0) {
 				// Draw polygon:
-				drawpoly(&clip_array, screen);
+				drawpoly(&clip_array, screen, overlay);
 			}
 		}
 	}
 }
 
+void stage_done(int stage)
+{
+	// Charge the time since the last stage ended to STAGE
+
+	unsigned long long now = SDL_GetPerformanceCounter();
+	stage_ticks[stage] += now - stage_start;
+	stage_start = now;
+}
+
 void display(world_type *world, view_type curview, int horizon_flag)
 {
-	// Clear the viewport:
-	BarFill(xmin, ymin, xmax - xmin, ymax - ymin, 0, screen_buffer);
+	stage_start = SDL_GetPerformanceCounter();
 
-	// If horizon desired, draw it:
+	// Release last frame's scratch memory:
+	RETRO_ResetArena();
+
+	// If horizon desired, draw it over the whole viewport, else clear it:
 	if (horizon_flag) {
 		draw_horizon(curview.xangle, curview.yangle, curview.zangle, screen_buffer);
+	} else if (overlay) {
+		for (int y = ymin; (y <= ymax) && (y <= overlay->ylast); y++) {
+			drawspan(screen_buffer, 320 * y + xmin, xmax - xmin, y, 0, overlay);
+		}
+	} else {
+		BarFill(xmin, ymin, xmax - xmin, ymax - ymin, 0, screen_buffer);
 	}
+	stage_done(STAGE_CLEAR);
 
-	// Update all object vertices to current positions:
-	for (int i = 0; i < world->number_of_objects; i++) {
-		update(&world->obj[i]);
+	// Refile the objects that moved, so that they are found where they are
+	//  now. That sets up its own transformation, so do it before aligning:
+	for (int i = 0; i < grid.moves; i++) {
+		if (grid.moved[i]->update) {
+			regrid(grid.moved[i]);
+		}
 	}
+	grid.moves = 0;
+
+	// Set up alignment with current view position:
+	alignview(curview);
 
-	// Set aligned coordinates to current view position:
-	alignview(world, curview);
+	// Find the objects near enough the view volume to be drawn:
+	object_type **visible = (object_type **)RETRO_ArenaAlloc(grid.objects * sizeof(object_type *));
+	int count = query_grid(&curview, visible);
+
+	stage_done(STAGE_QUERY);
+
+	// Pick the level of detail they are drawn at:
+	for (int i = 0; i < count; i++) {
+		if (visible[i]->number_of_lods) {
+			select_lod(visible[i], &curview);
+		}
+	}
+
+	// Update the vertices of any that changed level of detail, or came
+	//  into view, refiling them in the grid. That sets up its own transformation,
+	//  so align again afterwards:
+	int updated = 0;
+	for (int i = 0; i < count; i++) {
+		if (visible[i]->update) {
+			regrid(visible[i]);
+			updated++;
+		}
+	}
+	if (updated) {
+		alignview(curview);
+	}
+	stage_done(STAGE_UPDATE);
 
 	// Set up the polygon list:
-	make_polygon_list(world, &polylist);
+	make_polygon_list(visible, count, &curview, &polylist);
+	stage_done(STAGE_LIST);
 
 	// Perform depth sort on the polygon list:
 	z_sort(&polylist);
+	stage_done(STAGE_SORT);
 
 	// Draw the polygon list:
 	draw_polygon_list(&polylist, screen_buffer);
+	stage_done(STAGE_DRAW);
 }
 
 #endif
@@ -5,6 +5,7 @@
 #include "gauges.h"
 #include "view.h"
 #include "loadpoly.h"
+#include "tiles.h"
 
 // offsets for view system, forward, right, rear, and left views, offset
 // in degrees in the -180 to 180 system
@@ -17,6 +18,9 @@ static int rt2lft_ofs[4] = { 0, -90, 180, 90 };
 
 enum { PCX_TITLE, PCX_FRONT, PCX_RIGHT, PCX_LEFT, PCX_REAR, PCX_DOODADS };
 
+static int cockpitImage[4] = { PCX_FRONT, PCX_RIGHT, PCX_REAR, PCX_LEFT };  // cockpit for each view
+static mask_type cockpitMask[4];     // window area each cockpit leaves visible
+
 enum { forward, right, rear, left };
 
 static float degree_mul;             // used to convert between degree systems
@@ -27,6 +31,10 @@ static view_type curview;   	       // Structure for view descriptor
 static double acPitch;               // current aircraft rotations
 static double acYaw;
 static double acRoll;
+static SDL_atomic_t crashShown;      // set while the crash sign is up in pipelined mode
+static int compositeView = -1;       // view whose cockpit is below the 3D window
+static bool depthFog;                // fade distant polygons into the haze
+static const char *worldTiles;       // tiled world to stream, if any
 
 // This block of declarations specifies the cockpit instrument objects
 
@@ -65,6 +73,38 @@ static const int SKY_CLR = 11;            // palette color for sky
 static const int GRND_CLR = 105;          // palette color for ground
 static const int FCL_LEN = 400;           // focal plane distance
 
+// atmosphere constants. The ramps use palette colors that neither the
+// cockpit images nor the world use
+
+static const int RAMP_CLR = 224;          // first palette color of the ramps
+static const int RAMP_LEN = 15;           // colors in each of the two ramps
+static const float RAMP_DEG = 2.0;        // degrees from the horizon per color
+static const int FOG_NEAR = 2000;         // depth where the fog starts
+static const int FOG_FAR = 16000;         // depth of the thickest fog
+static const int FOG_MAX = 75;            // percent of haze at FOG_FAR
+static const RETRO_Palette HAZE = { 215, 235, 250 };   // sky at the horizon
+static const RETRO_Palette ZENITH = { 60, 140, 245 };  // sky high above it
+static const RETRO_Palette FIELD = { 120, 165, 105 };  // ground at the horizon
+static const RETRO_Palette GRASS = { 7, 139, 0 };      // ground right below
+
+// lighting constants, world y points down
+
+static const float SUN_X = 0.5;           // direction towards the sun
+static const float SUN_Y = -0.8;
+static const float SUN_Z = -0.35;
+static const float AMBIENT = 0.4;         // light on faces turned from the sun
+static const RETRO_Palette SHADOW = { 0, 0, 0 };      // color of no light at all
+
+// world coordinates are kept relative to an origin near the viewer, which
+// moves to the viewer once it is farther than this from it
+
+static const long long REBASE_DIST = 65536;
+
+// world streaming constants
+
+static const float TILE_RADIUS = 24000;   // distance ahead to keep tiles loaded
+static const long TILE_BUDGET = 64 << 20; // bytes of tiles loaded at once
+
 // instrument constants
 
 static const int FUE_X = 49;              // fuel gauge location left
@@ -126,32 +166,151 @@ void SetUpACDisplay(unsigned char *image)
 // create a single PVC object and buffer in main() and pass them to other
 // parts of the program as required.
 
+// this function builds the occlusion mask of a cockpit image from its opaque
+// spans. Each line is visible from the end of the span touching the left edge
+// to the start of the span touching the right edge, if there are any.
+void BuildMask(RETRO_Spans *spans, mask_type *mask)
+{
+	mask->ylast = -1;
+	for (int y = 0; y < spans->height; y++) {
+		int first = spans->row[y];
+		int last = spans->row[y + 1] - 1;
+		mask->xstart[y] = 0;
+		mask->xend[y] = spans->width - 1;
+		if (first <= last) {
+			if (spans->span[first].x == 0) {
+				mask->xstart[y] = spans->span[first].length;
+			}
+			if (spans->span[last].x + spans->span[last].length == spans->width) {
+				mask->xend[y] = spans->span[last].x - 1;
+			}
+		}
+		if (mask->xstart[y] <= mask->xend[y]) {
+			mask->ylast = y;
+		}
+	}
+}
+
+// blends color A towards color B by PERCENT
+RETRO_Palette BlendColor(RETRO_Palette a, RETRO_Palette b, int percent)
+{
+	RETRO_Palette c;
+	c.r = a.r + (b.r - a.r) * percent / 100;
+	c.g = a.g + (b.g - a.g) * percent / 100;
+	c.b = a.b + (b.b - a.b) * percent / 100;
+	return c;
+}
+
+// returns the color among the first COLORS of PALETTE closest to COLOR,
+// leaving out the transparent color 0
+int NearestColor(RETRO_Palette *palette, int colors, RETRO_Palette color)
+{
+	int best = 1, bestDist = INT_MAX;
+	for (int i = 1; i < colors; i++) {
+		RETRO_Palette p = palette[i];
+		int dr = p.r - color.r, dg = p.g - color.g, db = p.b - color.b;
+		int dist = dr * dr + dg * dg + db * db;
+		if (dist < bestDist) {
+			best = i;
+			bestDist = dist;
+		}
+	}
+	return best;
+}
+
+// this function sets up the palette ramps for the sky and ground gradients,
+// and the shade tables that fade distant polygons into the haze. The tables
+// are only handed to the view system when depth fog is enabled.
+void InitAtmosphere()
+{
+	unsigned char skyRamp[RAMP_LEN], groundRamp[RAMP_LEN];
+	static unsigned char fogTable[FOG_LEVELS][256];
+	RETRO_Palette palette[RETRO_COLORS];
+
+	for (int i = 0; i < RAMP_LEN; i++) {
+		RETRO_Palette sky = BlendColor(HAZE, ZENITH, i * 100 / (RAMP_LEN - 1));
+		RETRO_Palette ground = BlendColor(FIELD, GRASS, i * 100 / (RAMP_LEN - 1));
+		skyRamp[i] = RAMP_CLR + i;
+		groundRamp[i] = RAMP_CLR + RAMP_LEN + i;
+		RETRO_SetColor(skyRamp[i], sky.r, sky.g, sky.b);
+		RETRO_SetColor(groundRamp[i], ground.r, ground.g, ground.b);
+	}
+	setramps(skyRamp, groundRamp, RAMP_LEN, RAMP_DEG);
+
+	if (depthFog) {
+		for (int c = 0; c < RETRO_COLORS; c++) {
+			palette[c] = RETRO_GetColor(c);
+		}
+		for (int level = 0; level < FOG_LEVELS; level++) {
+			fogTable[level][0] = 0;
+			for (int c = 1; c < RETRO_COLORS; c++) {
+				int percent = FOG_MAX * level / (FOG_LEVELS - 1);
+				fogTable[level][c] = level ? NearestColor(palette, RETRO_COLORS, BlendColor(palette[c], HAZE, percent)) : c;
+			}
+		}
+		setfog(fogTable, FOG_LEVELS, FOG_NEAR, FOG_FAR);
+	}
+}
+
+// this function sets up the shade tables for lighting polygons from the sun.
+// Shades are matched against the colors of the cockpit palette below the
+// ramps, since the ramps take the place of unused black entries.
+void InitLighting()
+{
+	static unsigned char shadeTable[SHADE_LEVELS][256];
+	RETRO_Palette *palette = RETRO_ImagePalette(PCX_FRONT);
+
+	for (int level = 0; level < SHADE_LEVELS; level++) {
+		shadeTable[level][0] = 0;
+		for (int c = 1; c < RETRO_COLORS; c++) {
+			int percent = 100 - 100 * (level + 1) / SHADE_LEVELS;
+			shadeTable[level][c] = percent ? NearestColor(palette, RAMP_CLR, BlendColor(palette[c], SHADOW, percent)) : c;
+		}
+	}
+	setlight(shadeTable, SHADE_LEVELS, SUN_X, SUN_Y, SUN_Z, AMBIENT);
+}
+
+// turns on depth fog, must be called before InitView()
+void EnableDepthFog()
+{
+	depthFog = true;
+}
+
+// streams the world from a tiled world file instead of loading
+// assets/fof2.wld, must be called before InitView()
+void UseWorldTiles(const char *filename)
+{
+	worldTiles = filename;
+}
+
 void InitView()
 {
-	int polycount = loadpoly(&world, "assets/fof2.wld");
+	int polycount;
+	if (worldTiles) {
+		polycount = opentiles(worldTiles, TILE_RADIUS, TILE_BUDGET);
+	} else {
+		polycount = loadpoly(&world, "assets/fof2.wld");
+	}
 	initworld(polycount);
+	InitAtmosphere();
+	InitLighting();
+	if (!worldTiles) {
+		initgrid(&world);
+	}
 	degree_mul = NUMBER_OF_DEGREES;
 	degree_mul /= 360;
+
+	// opaque spans of each cockpit view, for compositing and occlusion
+	for (int i = 0; i < 4; i++) {
+		BuildMask(RETRO_CreateSpans(cockpitImage[i]), &cockpitMask[i]);
+	}
 }
 
-// this function flips the side view image so that it looks correct in either
-// the right or left cockpit views. Could be done much faster in assembler,
-// but, since it's called only when the right view is called for it's not
-// really worth the effort at optimization
-void FlipFrame(int x1, int y1, int x2, int y2, unsigned char *buf)
+// stops streaming the world, if it was
+void DeinitView()
 {
-	int i, j, ofs, lines, pix;
-
-	unsigned char gfxLnBuf[GFX_LINE];       // line buffer for various gfx tricks
-
-	lines = (y2 - y1) + 1;
-	pix = (x2 - x1) + 1;
-	for (i = 0; i < lines; i++) {
-		ofs = i * pix;
-		memcpy(gfxLnBuf, (buf + ofs), pix);
-		for (j = (pix - 1); j > -1; j--) {
-			*(buf + ofs + ((pix - 1) - j)) = gfxLnBuf[j];
-		}
+	if (worldTiles) {
+		closetiles();
 	}
 }
 
@@ -182,6 +341,7 @@ void UpdateInstruments(state_vect *tSV)
 	} else {
 		Line(23, 161, 23, 157, 8);
 	}
+	RETRO_MarkDirty(23, 157, 23, 161);
 }
 
 // This function performs a final rotation on the view angles to get the
@@ -276,12 +436,29 @@ void MapAngles()
 	curview.zangle = floor(acRoll);
 }
 
-// this function displays the "CRASH!" icon
-void ShowCrash()
+// this function draws the "CRASH!" icon into the view
+void DrawCrash()
 {
 	PutImage(CRSH_TXT_X, CRSH_TXT_Y, (CRSH_TXT_X + CRSH_TXT_DX) - 1, (CRSH_TXT_Y + CRSH_TXT_DY) - 1, crshTxt);
-	RETRO_Flip();
-	SDL_Delay(5000);
+	RETRO_MarkDirty(CRSH_TXT_X, CRSH_TXT_Y, (CRSH_TXT_X + CRSH_TXT_DX) - 1, (CRSH_TXT_Y + CRSH_TXT_DY) - 1);
+}
+
+// this function displays the "CRASH!" icon for five seconds, or until
+// cancel is set. In pipelined mode it is called from the simulation thread,
+// so it only flags UpdateView() to draw the icon on the render thread while
+// the simulation waits.
+void ShowCrash(SDL_atomic_t *cancel)
+{
+	if (RETRO.pipeline) {
+		SDL_AtomicSet(&crashShown, 1);
+	} else {
+		DrawCrash();
+		RETRO_Flip();
+	}
+	for (int waited = 0; waited < 5000 && !SDL_AtomicGet(cancel); waited += 10) {
+		SDL_Delay(10);
+	}
+	SDL_AtomicSet(&crashShown, 0);
 }
 
 // this function is called from main() to update the offscreen image buffer
@@ -292,33 +469,55 @@ void UpdateView(state_vect *tSV)
 	ViewShift(tSV);
 	MapAngles();
 
-	curview.copx = tSV->x_pos;
-	curview.copy = tSV->y_pos;
-	curview.copz = tSV->z_pos;
+	if (llabs(tSV->x_pos - origin_x) > REBASE_DIST || llabs(tSV->y_pos - origin_y) > REBASE_DIST || llabs(tSV->z_pos - origin_z) > REBASE_DIST) {
+		rebase(tSV->x_pos, tSV->y_pos, tSV->z_pos);
+	}
+	curview.copx = tSV->x_pos - origin_x;
+	curview.copy = tSV->y_pos - origin_y;
+	curview.copz = tSV->z_pos - origin_z;
 
+	int winY2 = RWIN_Y2;                  // last row of the 3D window
 	view_ofs = rt2lft_ofs[tSV->view_state];
 	if (tSV->opMode == WALK) {
 		setview(AWINC_X, AWINC_Y, RWIN_X1, RWIN_Y1, RWIN_X2, RWIN_Y2, FCL_LEN, GRND_CLR, SKY_CLR, RETRO.framebuffer);
 	} else if (tSV->view_state == 0) {
 		setview(FWINC_X, FWINC_Y, FWIN_X1, FWIN_Y1, FWIN_X2, FWIN_Y2, FCL_LEN, GRND_CLR, SKY_CLR, RETRO.framebuffer);
+		winY2 = FWIN_Y2;
 	} else if (tSV->view_state == 1) {
 		setview(AWINC_X, AWINC_Y, SWIN_X1, SWIN_Y1, SWIN_X2, SWIN_Y2, FCL_LEN, GRND_CLR, SKY_CLR, RETRO.framebuffer);
+		winY2 = SWIN_Y2;
 	} else if (tSV->view_state == 2) {
 		setview(AWINC_X, AWINC_Y, RWIN_X1, RWIN_Y1, RWIN_X2, RWIN_Y2, FCL_LEN, GRND_CLR, SKY_CLR, RETRO.framebuffer);
 	} else if (tSV->view_state == 3) {
 		setview(AWINC_X, AWINC_Y, SWIN_X1, SWIN_Y1, SWIN_X2, SWIN_Y2, FCL_LEN, GRND_CLR, SKY_CLR, RETRO.framebuffer);
+		winY2 = SWIN_Y2;
 	}
 
+	// window pixels the cockpit will cover are never drawn
+	int id = cockpitImage[tSV->view_state];
+	setmask(&cockpitMask[tSV->view_state]);
+
+	if (worldTiles) {
+		stream_tiles(tSV->x_pos, tSV->z_pos, tSV->yaw);
+	}
 	display(&world, curview, 1);
 
-	if (tSV->view_state == 0) {
-		RETRO_BitBlit(RETRO_ImageData(PCX_FRONT));
-	} else if (tSV->view_state == 1) {
-		RETRO_BitBlit(RETRO_ImageData(PCX_RIGHT));
-	} else if (tSV->view_state == 2) {
-		RETRO_BitBlit(RETRO_ImageData(PCX_REAR));
-	} else if (tSV->view_state == 3) {
-		RETRO_BitBlit(RETRO_ImageData(PCX_LEFT));
+	// the cockpit is composited over the 3D window every frame. The rows below
+	// the window only change with the view, so with dirty rectangles they are
+	// copied once, and the instruments restore and redraw themselves there
+	// only when their readings change.
+	unsigned char *cockpit = RETRO_ImageData(id);
+	int band = (winY2 + 1) * GFX_LINE;
+	int view = (tSV->opMode == WALK) ? 4 : tSV->view_state;
+	RETRO_SpanBlit(RETRO_ImageSpans(id), cockpit, 0, winY2);
+	if (!RETRO.dirtyrects || view != compositeView) {
+		RETRO_Blit(cockpit + band, (RETRO_WIDTH * RETRO_HEIGHT) - band, RETRO.framebuffer + band);
+		RETRO_MarkAllDirty();
+		Instrument::SetBackdrop(cockpit, RETRO_HEIGHT);
+		compositeView = view;
+	} else {
+		RETRO_MarkDirty(0, 0, RETRO_WIDTH - 1, winY2);
+		Instrument::SetBackdrop(cockpit, winY2 + 1);
 	}
 
 	if (tSV->opMode != WALK) {
@@ -326,6 +525,10 @@ void UpdateView(state_vect *tSV)
 			UpdateInstruments(tSV);
 		}
 	}
+
+	if (SDL_AtomicGet(&crashShown)) {
+		DrawCrash();
+	}
 }
 
 #endif
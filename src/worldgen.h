@@ -0,0 +1,285 @@
+#ifndef _WORLDGEN_H_
+#define _WORLDGEN_H_
+
+// Generates synthetic worlds of any size, for finding out how the renderer
+// and the world loader scale. Objects are faceted ellipsoids resting on the
+// ground, spread over a square centered on the world origin. The same
+// parameters and seed always give the same world.
+
+#include "loadpoly.h"
+
+#define GEN_SIDES 16           // most facets around an object, so caps fit a polygon
+
+enum { GEN_UNIFORM, GEN_CLUSTERED, GEN_GRID };
+
+struct worldgen_type {
+	unsigned long seed;
+	int objects;               // Number of objects
+	int polygons;              // Polygons in each object
+	int area;                  // Side of the square the objects are spread over
+	int distribution;          // GEN_UNIFORM, and so on
+	float overlap;             // Object width as a fraction of the space between objects
+	int meshes;                // Library meshes the objects are instances of, 0 for none
+};
+
+const char *gen_distributions[] = { "uniform", "clustered", "grid" };
+const int gen_colors[] = { 1, 2, 3, 4, 5, 6, 16, 17, 18, 19, 20, 21, 22, 208, 210, 212, 214, 216, 218 };
+
+// Command line options shared by the tools that generate worlds, for their
+// getopt_long() option string and table
+#define GEN_SHORT_OPTIONS "s:p:a:d:v:m:"
+#define GEN_LONG_OPTIONS \
+	{"seed", required_argument, 0, 's'}, \
+	{"polygons", required_argument, 0, 'p'}, \
+	{"area", required_argument, 0, 'a'}, \
+	{"distribution", required_argument, 0, 'd'}, \
+	{"overlap", required_argument, 0, 'v'}, \
+	{"meshes", required_argument, 0, 'm'}
+
+bool gen_option(worldgen_type *gen, int c, const char *arg)
+{
+	// Set the parameter of option C to ARG, returning false if C is not
+	//  one of GEN_SHORT_OPTIONS
+
+	switch (c) {
+	case 's':
+		gen->seed = strtoul(arg, NULL, 10);
+		break;
+	case 'p':
+		gen->polygons = atoi(arg);
+		break;
+	case 'a':
+		gen->area = atoi(arg);
+		break;
+	case 'd':
+		gen->distribution = -1;
+		for (int i = 0; i < 3; i++) {
+			if (strcmp(arg, gen_distributions[i]) == 0) {
+				gen->distribution = i;
+			}
+		}
+		break;
+	case 'v':
+		gen->overlap = atof(arg);
+		break;
+	case 'm':
+		gen->meshes = atoi(arg);
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+bool gen_valid(worldgen_type *gen)
+{
+	return gen->objects >= 0 && gen->polygons > 0 && gen->area > 0 && gen->distribution >= 0 && gen->overlap > 0 && gen->meshes >= 0;
+}
+
+void gen_usage(worldgen_type *defaults)
+{
+	// Print the usage of the options, with the parameters in DEFAULTS
+
+	printf(" -s, --seed=VALUE     Seed for the generator (default %lu)\n", defaults->seed);
+	printf(" -p, --polygons=N     Polygons per object (default %d)\n", defaults->polygons);
+	printf(" -a, --area=UNITS     Side of the square the objects are spread over (default %d)\n", defaults->area);
+	printf(" -d, --distribution=uniform|clustered|grid\n");
+	printf("                      How the objects are spread (default %s)\n", gen_distributions[defaults->distribution]);
+	printf(" -v, --overlap=F      Object width as a fraction of the space between them (default %g)\n", defaults->overlap);
+	printf(" -m, --meshes=N       Make the objects instances of N library meshes (default %d, none)\n", defaults->meshes);
+}
+
+unsigned long gen_random(unsigned long *state)
+{
+	// Return the next number of splitmix64 sequence STATE
+
+	unsigned long x = (*state += 0x9e3779b97f4a7c15UL);
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+	return x ^ (x >> 31);
+}
+
+double gen_uniform(unsigned long *state)
+{
+	// Return a number from 0 up to 1 from sequence STATE
+
+	return (gen_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void gen_mesh(mesh_type *mesh, int polygons, long radius, long height, int color)
+{
+	// Build an ellipsoid of about POLYGONS facets, RADIUS wide and HEIGHT
+	//  tall either side of its origin, into MESH the way loadmesh() does.
+	//  It has SIDES facets around and BANDS from top to bottom, triangles
+	//  at the poles and quadrilaterals between.
+
+	int sides = CLAMP((int)lround(sqrt((double)polygons)), 3, GEN_SIDES + 1);
+	int bands = MAX(2, (polygons + sides / 2) / sides);
+	mesh->number_of_vertices = 2 + (bands - 1) * sides;
+	mesh->number_of_polygons = bands * sides;
+	mesh->vertex = new vertex_type[mesh->number_of_vertices];
+	mesh->polygon = new polygon_type[mesh->number_of_polygons];
+	mesh->pixels = 0;
+	mesh->pointers = 0;
+
+	// Poles first, then the rings from the top down. Negative y is up:
+	vertex_type *vertex = mesh->vertex;
+	vertex[0].lx = vertex[0].lz = 0;
+	vertex[0].ly = -height;
+	vertex[1].lx = vertex[1].lz = 0;
+	vertex[1].ly = height;
+	for (int band = 1; band < bands; band++) {
+		double phi = M_PI * band / bands;
+		for (int side = 0; side < sides; side++) {
+			double theta = 2 * M_PI * side / sides;
+			vertex_type *curvert = &vertex[2 + (band - 1) * sides + side];
+			curvert->lx = lround(radius * sin(phi) * cos(theta));
+			curvert->ly = lround(-height * cos(phi));
+			curvert->lz = lround(radius * sin(phi) * sin(theta));
+		}
+	}
+	for (int v = 0; v < mesh->number_of_vertices; v++) {
+		vertex[v].lt = 1;
+		vertex[v].wt = 1;
+		vertex[v].stamp = 0;
+	}
+
+	// Going down, then around, faces outwards:
+	for (int band = 0; band < bands; band++) {
+		for (int side = 0; side < sides; side++) {
+			polygon_type *curpoly = &mesh->polygon[band * sides + side];
+			int next = (side + 1) % sides;
+			int upper = 2 + (band - 1) * sides, lower = 2 + band * sides;
+			vertex_type *corner[4];
+			int corners = 0;
+			if (band == 0) {
+				corner[corners++] = &vertex[0];
+			} else {
+				corner[corners++] = &vertex[upper + side];
+			}
+			if (band == bands - 1) {
+				corner[corners++] = &vertex[1];
+			} else {
+				corner[corners++] = &vertex[lower + side];
+				corner[corners++] = &vertex[lower + next];
+			}
+			if (band > 0) {
+				corner[corners++] = &vertex[upper + next];
+			}
+			curpoly->number_of_vertices = corners;
+			curpoly->number_of_clipped_vertices = corners + 4;
+			curpoly->vertex = new vertex_type * [corners];
+			memcpy(curpoly->vertex, corner, corners * sizeof(vertex_type *));
+			curpoly->color = color;
+			curpoly->sortflag = 0;
+			curpoly->light = 0;
+			mesh->pointers += corners;
+		}
+	}
+	find_planes(mesh);
+}
+
+void gen_position(worldgen_type *gen, int index, long *centers, unsigned long *state, long *x, long *z)
+{
+	// Pick the place of object INDEX on the ground
+
+	float half = gen->area / 2.0;
+	switch (gen->distribution) {
+	case GEN_CLUSTERED: {
+		// Around one of the cluster centers, spread about a quarter of the
+		//  space between clusters:
+		int clusters = MAX(gen->objects / 64, 1);
+		int c = gen_random(state) % clusters;
+		double spread = gen->area / (4 * sqrt((double)clusters));
+		*x = centers[2 * c] + spread * (gen_uniform(state) + gen_uniform(state) + gen_uniform(state) - 1.5);
+		*z = centers[2 * c + 1] + spread * (gen_uniform(state) + gen_uniform(state) + gen_uniform(state) - 1.5);
+		break;
+	}
+	case GEN_GRID: {
+		// In the middle of its own cell, give or take a quarter cell:
+		int across = ceil(sqrt((double)gen->objects));
+		double cell = (double)gen->area / across;
+		*x = -half + cell * (index % across + 0.25 + gen_uniform(state) / 2);
+		*z = -half + cell * (index / across + 0.25 + gen_uniform(state) / 2);
+		break;
+	}
+	default:
+		*x = -half + gen->area * gen_uniform(state);
+		*z = -half + gen->area * gen_uniform(state);
+		break;
+	}
+}
+
+int generate_world(worldgen_type *gen, FILE *f)
+{
+	// Write the world described by GEN to file F in the format loadpoly()
+	//  reads, returning its number of polygons
+
+	unsigned long state = gen->seed;
+	double spacing = gen->area / sqrt((double)MAX(gen->objects, 1));
+	double size = MAX(gen->overlap * spacing / 2, 4.0);
+
+	long *centers = (long *)malloc(2 * MAX(gen->objects / 64, 1) * sizeof(long));
+	mesh_type *library = new mesh_type[gen->meshes];
+	if (centers == NULL) {
+		RETRO_RageQuit("Cannot allocate world memory\n");
+	}
+	for (int c = 0; c < MAX(gen->objects / 64, 1); c++) {
+		centers[2 * c] = -gen->area / 2 + gen->area * gen_uniform(&state);
+		centers[2 * c + 1] = -gen->area / 2 + gen->area * gen_uniform(&state);
+	}
+	for (int m = 0; m < gen->meshes; m++) {
+		long radius = size * (0.5 + gen_uniform(&state));
+		long height = radius * (0.5 + gen_uniform(&state));
+		int color = gen_colors[gen_random(&state) % (sizeof(gen_colors) / sizeof(int))];
+		gen_mesh(&library[m], gen->polygons, radius, height, color);
+	}
+
+	fprintf(f, "*** World definition file ***\n\n");
+	fprintf(f, "* Generated from seed %lu: %d objects of %d polygons, %s over %d units, overlap %g, %d meshes\n\n",
+		gen->seed, gen->objects, gen->polygons, gen_distributions[gen->distribution], gen->area, gen->overlap, gen->meshes);
+	fprintf(f, "%d,\t\t* Number of objects in file\n\n", gen->objects);
+	int polycount = 0;
+	for (int i = 0; i < gen->objects; i++) {
+		object_type object = {};
+		long x, z;
+		gen_position(gen, i, centers, &state, &x, &z);
+		object.x = x;
+		object.z = z;
+		object.yangle = gen_random(&state) % NUMBER_OF_DEGREES;
+		object.xscale = 1;
+		object.convex = 1;
+
+		mesh_type mesh;
+		if (gen->meshes) {
+			object.shared = &library[gen_random(&state) % gen->meshes];
+			object.y = object.shared->vertex[0].ly;
+			polycount += object.shared->number_of_polygons;
+		} else {
+			long radius = size * (0.5 + gen_uniform(&state));
+			long height = radius * (0.5 + gen_uniform(&state));
+			int color = gen_colors[gen_random(&state) % (sizeof(gen_colors) / sizeof(int))];
+			gen_mesh(&mesh, gen->polygons, radius, height, color);
+			setmesh(&object, &mesh);
+			object.y = -height;
+			polycount += mesh.number_of_polygons;
+		}
+		fprintf(f, "* OBJECT #%d:\n\n", i);
+		saveobject(&object, library, f);
+		if (!gen->meshes) {
+			freemesh(&mesh);
+		}
+	}
+
+	world_type world = { 0, NULL, gen->meshes, library };
+	savelods(&world, f);
+	savemeshes(&world, f);
+	for (int m = 0; m < gen->meshes; m++) {
+		freemesh(&library[m]);
+	}
+	delete[] library;
+	free(centers);
+	return polycount;
+}
+
+#endif